@@ -0,0 +1,417 @@
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "mock_redis.h"
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+mock_redis::mock_redis()
+    : m_port(0), m_listenfd(-1), m_epollfd(-1), m_timerfd(-1), m_wakefd(-1), m_running(false),
+      m_latency_us(0), m_jitter_us(0), m_error_threshold(0), m_commands(0), m_errors(0),
+      m_next_id(0), m_seq(0), m_armed(0), m_rng(0x2545F4914F6CDD1DULL) {
+}
+
+mock_redis::~mock_redis() {
+    stop();
+}
+
+void mock_redis::set_latency(int latency_us, int jitter_us) {
+    m_latency_us = latency_us > 0 ? latency_us : 0;
+    m_jitter_us = jitter_us > 0 ? jitter_us : 0;
+}
+
+void mock_redis::set_error_rate(double rate) {
+    if (rate <= 0)
+        m_error_threshold = 0;
+    else if (rate >= 1)
+        m_error_threshold = UINT32_MAX;
+    else
+        m_error_threshold = (uint32_t)(rate * 4294967296.0);
+}
+
+void mock_redis::put(const std::string &key, const std::string &value) {
+    m_lock.lock();
+    m_data[key] = value;
+    m_lock.unlock();
+}
+
+bool mock_redis::start(int port) {
+    if (m_running)
+        return true;
+    m_listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listenfd < 0)
+        return false;
+    int flag = 1;
+    setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(m_listenfd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(m_listenfd, 128) < 0) {
+        close(m_listenfd);
+        m_listenfd = -1;
+        return false;
+    }
+    socklen_t len = sizeof(address);
+    getsockname(m_listenfd, (struct sockaddr *)&address, &len);
+    m_port = ntohs(address.sin_port);
+
+    m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = m_listenfd;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_listenfd, &ev);
+    ev.data.fd = m_timerfd;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_timerfd, &ev);
+    ev.data.fd = m_wakefd;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_wakefd, &ev);
+
+    m_running = true;
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        m_running = false;
+        return false;
+    }
+    return true;
+}
+
+void mock_redis::stop() {
+    if (!m_running)
+        return;
+    m_running = false;
+    uint64_t one = 1;
+    ::write(m_wakefd, &one, sizeof(one));
+    pthread_join(m_thread, NULL);
+
+    for (std::unordered_map<int, client *>::iterator it = m_clients.begin(); it != m_clients.end(); ++it) {
+        close(it->first);
+        delete it->second;
+    }
+    m_clients.clear();
+    while (!m_pending.empty())
+        m_pending.pop();
+    close(m_listenfd);
+    close(m_timerfd);
+    close(m_wakefd);
+    close(m_epollfd);
+    m_listenfd = m_timerfd = m_wakefd = m_epollfd = -1;
+}
+
+void *mock_redis::worker(void *arg) {
+    mock_redis *server = static_cast<mock_redis *>(arg);
+    server->run();
+    return server;
+}
+
+void mock_redis::run() {
+    epoll_event events[256];
+    while (m_running) {
+        int n = epoll_wait(m_epollfd, events, 256, -1);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == m_listenfd) {
+                on_accept();
+            }
+            else if (fd == m_timerfd) {
+                on_timer();
+            }
+            else if (fd == m_wakefd) {
+                uint64_t v;
+                ::read(m_wakefd, &v, sizeof(v));
+            }
+            else {
+                std::unordered_map<int, client *>::iterator it = m_clients.find(fd);
+                if (it == m_clients.end())
+                    continue;
+                client *c = it->second;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    on_read(c);
+                    if (m_clients.find(fd) == m_clients.end())
+                        continue;
+                }
+                if (events[i].events & EPOLLOUT)
+                    flush(c);
+            }
+        }
+    }
+}
+
+void mock_redis::on_accept() {
+    while (true) {
+        int fd = accept4(m_listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        client *c = new client;
+        c->fd = fd;
+        c->id = ++m_next_id;
+        c->last_due = 0;
+        c->queued = 0;
+        c->want_out = false;
+        m_clients[fd] = c;
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = fd;
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void mock_redis::on_read(client *c) {
+    char buf[16384];
+    while (true) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            c->in.append(buf, n);
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN)
+            break;
+        close_client(c);
+        return;
+    }
+    if (!execute(c)) {
+        reply(c, "-ERR Protocol error\r\n");
+        flush(c);
+        close_client(c);
+        return;
+    }
+    flush(c);
+}
+
+void mock_redis::close_client(client *c) {
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    m_clients.erase(c->fd);
+    delete c;
+}
+
+void mock_redis::flush(client *c) {
+    while (!c->out.empty()) {
+        ssize_t n = send(c->fd, c->out.data(), c->out.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN)
+                break;
+            close_client(c);
+            return;
+        }
+        c->out.erase(0, n);
+    }
+    bool want_out = !c->out.empty();
+    if (want_out != c->want_out) {
+        c->want_out = want_out;
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | (want_out ? (uint32_t)EPOLLOUT : 0);
+        ev.data.fd = c->fd;
+        epoll_ctl(m_epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+}
+
+uint64_t mock_redis::next_delay() {
+    uint64_t delay = (uint64_t)m_latency_us.load(std::memory_order_relaxed) * 1000;
+    int jitter = m_jitter_us.load(std::memory_order_relaxed);
+    if (jitter > 0) {
+        m_rng ^= m_rng << 13;
+        m_rng ^= m_rng >> 7;
+        m_rng ^= m_rng << 17;
+        delay += (m_rng % ((uint64_t)jitter * 1000));
+    }
+    return delay;
+}
+
+//无延迟直接写入发送缓冲，否则挂到定时队列
+void mock_redis::reply(client *c, const std::string &r) {
+    uint64_t delay = next_delay();
+    if (delay == 0 && c->queued == 0) {
+        c->out += r;
+        return;
+    }
+    uint64_t due = mono_ns() + delay;
+    if (due < c->last_due)
+        due = c->last_due;
+    c->last_due = due;
+    ++c->queued;
+    pending p;
+    p.due = due;
+    p.seq = ++m_seq;
+    p.fd = c->fd;
+    p.id = c->id;
+    p.reply = r;
+    m_pending.push(p);
+    arm_timer();
+}
+
+void mock_redis::arm_timer() {
+    if (m_pending.empty())
+        return;
+    uint64_t due = m_pending.top().due;
+    if (m_armed != 0 && m_armed <= due)
+        return;
+    m_armed = due;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = due / 1000000000ULL;
+    its.it_value.tv_nsec = due % 1000000000ULL;
+    timerfd_settime(m_timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+void mock_redis::on_timer() {
+    uint64_t v;
+    ::read(m_timerfd, &v, sizeof(v));
+    m_armed = 0;
+    uint64_t now = mono_ns();
+    std::vector<std::pair<int, uint64_t> > touched;
+    while (!m_pending.empty() && m_pending.top().due <= now) {
+        const pending &p = m_pending.top();
+        std::unordered_map<int, client *>::iterator it = m_clients.find(p.fd);
+        if (it != m_clients.end() && it->second->id == p.id) {
+            client *c = it->second;
+            c->out += p.reply;
+            --c->queued;
+            touched.push_back(std::make_pair(c->fd, c->id));
+        }
+        m_pending.pop();
+    }
+    for (size_t i = 0; i < touched.size(); ++i) {
+        //同一连接可能出现多次，flush出错关闭后不再访问
+        std::unordered_map<int, client *>::iterator it = m_clients.find(touched[i].first);
+        if (it != m_clients.end() && it->second->id == touched[i].second)
+            flush(it->second);
+    }
+    arm_timer();
+}
+
+//支持RESP数组和内联命令
+bool mock_redis::execute(client *c) {
+    size_t pos = 0;
+    std::string &in = c->in;
+    while (pos < in.size()) {
+        std::vector<std::string> argv;
+        if (in[pos] == '*') {
+            size_t eol = in.find("\r\n", pos);
+            if (eol == std::string::npos)
+                break;
+            long argc = strtol(in.c_str() + pos + 1, NULL, 10);
+            if (argc <= 0 || argc > 1024)
+                return false;
+            size_t p = eol + 2;
+            bool complete = true;
+            for (long i = 0; i < argc; ++i) {
+                if (p >= in.size()) {
+                    complete = false;
+                    break;
+                }
+                if (in[p] != '$')
+                    return false;
+                size_t e = in.find("\r\n", p);
+                if (e == std::string::npos) {
+                    complete = false;
+                    break;
+                }
+                long len = strtol(in.c_str() + p + 1, NULL, 10);
+                if (len < 0 || len > 512 * 1024 * 1024L)
+                    return false;
+                if (e + 2 + len + 2 > in.size()) {
+                    complete = false;
+                    break;
+                }
+                argv.push_back(in.substr(e + 2, len));
+                p = e + 2 + len + 2;
+            }
+            if (!complete)
+                break;
+            pos = p;
+        }
+        else {
+            size_t eol = in.find('\n', pos);
+            if (eol == std::string::npos)
+                break;
+            std::string line = in.substr(pos, eol - pos);
+            if (!line.empty() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+            pos = eol + 1;
+            size_t s = 0;
+            while (s < line.size()) {
+                size_t e = line.find(' ', s);
+                if (e == std::string::npos)
+                    e = line.size();
+                if (e > s)
+                    argv.push_back(line.substr(s, e - s));
+                s = e + 1;
+            }
+            if (argv.empty())
+                continue;
+        }
+        m_commands.fetch_add(1, std::memory_order_relaxed);
+        reply(c, command(argv));
+    }
+    in.erase(0, pos);
+    return true;
+}
+
+static std::string bulk(const std::string &s) {
+    return "$" + std::to_string(s.size()) + "\r\n" + s + "\r\n";
+}
+
+std::string mock_redis::command(std::vector<std::string> &argv) {
+    uint32_t threshold = m_error_threshold.load(std::memory_order_relaxed);
+    if (threshold) {
+        m_rng ^= m_rng << 13;
+        m_rng ^= m_rng >> 7;
+        m_rng ^= m_rng << 17;
+        if ((uint32_t)m_rng < threshold || threshold == UINT32_MAX) {
+            m_errors.fetch_add(1, std::memory_order_relaxed);
+            return "-ERR injected failure\r\n";
+        }
+    }
+
+    const std::string &cmd = argv[0];
+    if (strcasecmp(cmd.c_str(), "PING") == 0) {
+        return argv.size() > 1 ? bulk(argv[1]) : "+PONG\r\n";
+    }
+    if (strcasecmp(cmd.c_str(), "GET") == 0) {
+        if (argv.size() != 2)
+            return "-ERR wrong number of arguments for 'get' command\r\n";
+        m_lock.lock();
+        std::unordered_map<std::string, std::string>::iterator it = m_data.find(argv[1]);
+        std::string r = it == m_data.end() ? "$-1\r\n" : bulk(it->second);
+        m_lock.unlock();
+        return r;
+    }
+    if (strcasecmp(cmd.c_str(), "SET") == 0) {
+        if (argv.size() < 3)
+            return "-ERR wrong number of arguments for 'set' command\r\n";
+        m_lock.lock();
+        m_data[argv[1]] = argv[2];
+        m_lock.unlock();
+        return "+OK\r\n";
+    }
+    if (strcasecmp(cmd.c_str(), "SETNX") == 0) {
+        if (argv.size() != 3)
+            return "-ERR wrong number of arguments for 'setnx' command\r\n";
+        m_lock.lock();
+        bool inserted = m_data.insert(std::make_pair(argv[1], argv[2])).second;
+        m_lock.unlock();
+        return inserted ? ":1\r\n" : ":0\r\n";
+    }
+    return "-ERR unknown command '" + cmd + "'\r\n";
+}
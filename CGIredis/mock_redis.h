@@ -0,0 +1,96 @@
+#ifndef M_MOCK_REDIS_H
+#define M_MOCK_REDIS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <queue>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "../locker.h"
+
+//进程内的RESP服务端，代替redis-server用于压测和测试
+//支持GET/SET/SETNX/PING，可注入固定延迟、均匀抖动和错误率
+//单线程epoll，延迟回复挂在timerfd上，同一连接上的回复保持顺序
+class mock_redis {
+public:
+    mock_redis();
+    ~mock_redis();
+
+    //port为0时由内核分配，成功后通过port()获取
+    bool start(int port = 0);
+    void stop();
+    int port() const { return m_port; }
+
+    //每条命令的回复延迟为 latency_us + [0, jitter_us) 内均匀分布
+    void set_latency(int latency_us, int jitter_us);
+    //以rate(0~1)的概率回复 -ERR
+    void set_error_rate(double rate);
+    //预置数据
+    void put(const std::string &key, const std::string &value);
+
+    uint64_t commands() const { return m_commands.load(std::memory_order_relaxed); }
+    uint64_t injected_errors() const { return m_errors.load(std::memory_order_relaxed); }
+
+private:
+    struct client {
+        int fd;
+        uint64_t id;
+        std::string in;
+        std::string out;
+        uint64_t last_due;  //本连接最后一条延迟回复的时间，保证回复有序
+        int queued;         //本连接尚未到期的回复数
+        bool want_out;
+    };
+    struct pending {
+        uint64_t due;
+        uint64_t seq;
+        int fd;
+        uint64_t id;
+        std::string reply;
+        bool operator>(const pending &other) const {
+            return due != other.due ? due > other.due : seq > other.seq;
+        }
+    };
+
+    static void *worker(void *arg);
+    void run();
+    void on_accept();
+    void on_read(client *c);
+    void on_timer();
+    void flush(client *c);
+    void close_client(client *c);
+    void arm_timer();
+    //解析并执行in中所有完整的命令，返回false表示协议错误
+    bool execute(client *c);
+    std::string command(std::vector<std::string> &argv);
+    void reply(client *c, const std::string &r);
+    uint64_t next_delay();
+
+    int m_port;
+    int m_listenfd;
+    int m_epollfd;
+    int m_timerfd;
+    int m_wakefd;
+    pthread_t m_thread;
+    std::atomic<bool> m_running;
+
+    std::atomic<int> m_latency_us;
+    std::atomic<int> m_jitter_us;
+    std::atomic<uint32_t> m_error_threshold;  //错误率映射到[0, 2^32)
+    std::atomic<uint64_t> m_commands;
+    std::atomic<uint64_t> m_errors;
+
+    std::unordered_map<int, client *> m_clients;
+    std::priority_queue<pending, std::vector<pending>, std::greater<pending> > m_pending;
+    uint64_t m_next_id;
+    uint64_t m_seq;
+    uint64_t m_armed;
+    uint64_t m_rng;
+
+    locker m_lock;  //保护m_data，put可能来自其他线程
+    std::unordered_map<std::string, std::string> m_data;
+};
+
+#endif
@@ -65,6 +65,13 @@ bool connection_pool::ReleaseConnection(redisContext *con) {
 
 	lock.lock();
 
+	//连接池已缩小，多出的连接直接关闭
+	if (m_FreeConn + m_CurConn > m_MaxConn) {
+		--m_CurConn;
+		lock.unlock();
+		redisFree(con);
+		return true;
+	}
 	connDeque.push_back(con);
 	++m_FreeConn;
 	--m_CurConn;
@@ -75,6 +82,33 @@ bool connection_pool::ReleaseConnection(redisContext *con) {
 	return true;
 }
 
+void connection_pool::resize(int MaxConn) {
+	//增加：在锁外建立连接，建好一个放入一个
+	while (m_MaxConn < MaxConn) {
+		redisContext *redis = redisConnect(m_url.c_str(), m_Port);
+		if (redis == nullptr || redis->err) {
+			std::cout << "connect error: " << (redis ? redis->errstr : "") << std::endl;
+			redisFree(redis);
+			return;
+		}
+		lock.lock();
+		connDeque.push_back(redis);
+		++m_FreeConn;
+		++m_MaxConn;
+		lock.unlock();
+		reserve.post();
+	}
+	//减少：空闲的连接立即关闭
+	lock.lock();
+	m_MaxConn = MaxConn;
+	while (m_FreeConn + m_CurConn > m_MaxConn && reserve.trywait()) {
+		redisFree(connDeque.front());
+		connDeque.pop_front();
+		--m_FreeConn;
+	}
+	lock.unlock();
+}
+
 //销毁数据库连接池
 void connection_pool::DestroyPool() {
 
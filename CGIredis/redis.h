@@ -23,6 +23,8 @@ public:
 	static connection_pool *GetInstance();
 
 	void init(string url, int Port, int MaxConn); 
+	//运行中调整连接数，减少时正在使用的连接在归还时关闭
+	void resize(int MaxConn);
     
 private:
 	connection_pool();
@@ -50,4 +52,25 @@ private:
 	connection_pool *poolRAII;
 };
 
+//redisCommand返回的回复，析构时freeReplyObject
+//连接出错时回复为空，get()返回NULL
+class replyRAII {
+public:
+	explicit replyRAII(void *reply) : m_reply(static_cast<redisReply *>(reply)) {}
+	~replyRAII() {
+		if (m_reply)
+			freeReplyObject(m_reply);
+	}
+	redisReply *get() const { return m_reply; }
+	//回复是字符串时返回内容，nil或出错返回NULL
+	const char *str() const {
+		return m_reply && m_reply->type == REDIS_REPLY_STRING ? m_reply->str : NULL;
+	}
+
+private:
+	replyRAII(const replyRAII &);
+	replyRAII &operator=(const replyRAII &);
+	redisReply *m_reply;
+};
+
 #endif
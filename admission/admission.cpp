@@ -0,0 +1,65 @@
+#include <time.h>
+#include "admission.h"
+#include "spdlog/spdlog.h"
+
+admission::admission() : m_max_conns(0), m_target_us(0), m_interval_us(0), m_first_above(0), m_overloaded(false) {
+    for (int i = 0; i < SHED_NUM; ++i)
+        m_shed[i] = 0;
+}
+
+void admission::init(int max_conns, int target_us, int interval_ms) {
+    m_max_conns = max_conns;
+    m_target_us = target_us;
+    m_interval_us = (uint64_t)interval_ms * 1000;
+    if (target_us == 0) {
+        m_first_above = 0;
+        m_overloaded = false;
+    }
+}
+
+uint64_t admission::now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool admission::admit_conn(int active) {
+    if (m_max_conns > 0 && active >= m_max_conns) {
+        shed(SHED_CONN);
+        return false;
+    }
+    return true;
+}
+
+bool admission::admit_request(bool idle_worker) {
+    if (idle_worker || !overloaded())
+        return true;
+    shed(SHED_LATENCY);
+    return false;
+}
+
+void admission::record_sojourn(uint64_t sojourn_us) {
+    if (m_target_us == 0)
+        return;
+    //低于目标值的样本说明队列能排空，立即退出过载
+    if (sojourn_us < m_target_us) {
+        if (m_first_above.load(std::memory_order_relaxed) != 0)
+            m_first_above.store(0, std::memory_order_relaxed);
+        if (m_overloaded.load(std::memory_order_relaxed)) {
+            m_overloaded.store(false, std::memory_order_relaxed);
+            spdlog::info("overload: queue delay back under {0}us", m_target_us);
+        }
+        return;
+    }
+    uint64_t now = now_us();
+    uint64_t first = m_first_above.load(std::memory_order_relaxed);
+    if (first == 0)
+        m_first_above.compare_exchange_strong(first, now + m_interval_us, std::memory_order_relaxed);
+    else if (now >= first && !m_overloaded.exchange(true, std::memory_order_relaxed))
+        spdlog::warn("overload: queue delay over {0}us for {1}ms, shedding", m_target_us, m_interval_us / 1000);
+}
+
+void admission::dump() {
+    spdlog::info("shed conn={0} queue={1} latency={2} overloaded={3}", shed_count(SHED_CONN),
+                 shed_count(SHED_QUEUE), shed_count(SHED_LATENCY), overloaded());
+}
@@ -0,0 +1,56 @@
+#ifndef M_ADMISSION_H
+#define M_ADMISSION_H
+
+#include <stdint.h>
+#include <atomic>
+
+//过载保护：按活动连接数、请求队列和排队时延决定是否接纳，拒绝时回复503
+//排队时延按CoDel的思路判断：持续一个窗口都高于目标值才算过载，瞬时的突发不拒绝
+//过载期间只在没有空闲工作线程时拒绝新请求，主线程不再自旋等待，已接纳的请求继续提供时延样本
+
+enum SHED_REASON {
+    SHED_CONN = 0,  //连接数超过上限
+    SHED_QUEUE,     //投递到请求队列失败(线程池停止或max_requests过小)，防止主线程一直自旋
+    SHED_LATENCY,   //排队时延持续超标且没有空闲的工作线程
+    SHED_NUM
+};
+
+class admission {
+public:
+    static admission *get_instance() {
+        static admission instance;
+        return &instance;
+    }
+
+    //max_conns为连接数上限，target_us为0时不按时延拒绝；可在运行中修改
+    void init(int max_conns, int target_us, int interval_ms);
+
+    //新连接，active为当前连接数
+    bool admit_conn(int active);
+    //连接上的新请求，idle_worker表示有工作线程在等待任务
+    bool admit_request(bool idle_worker);
+    //工作线程取出任务时记录在队列中等待的时间
+    void record_sojourn(uint64_t sojourn_us);
+    //投递失败等无需判断的拒绝
+    void shed(SHED_REASON reason) { m_shed[reason].fetch_add(1, std::memory_order_relaxed); }
+
+    bool overloaded() const { return m_overloaded.load(std::memory_order_relaxed); }
+    uint64_t shed_count(SHED_REASON reason) const { return m_shed[reason].load(std::memory_order_relaxed); }
+    //输出各原因的拒绝次数
+    void dump();
+
+    static uint64_t now_us();
+
+private:
+    admission();
+
+    int m_max_conns;
+    uint64_t m_target_us;
+    uint64_t m_interval_us;
+    //排队时延首次超过目标值后，再过一个窗口的时刻；0表示当前没有超标
+    std::atomic<uint64_t> m_first_above;
+    std::atomic<bool> m_overloaded;
+    std::atomic<uint64_t> m_shed[SHED_NUM];
+};
+
+#endif
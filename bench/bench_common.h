@@ -0,0 +1,320 @@
+#ifndef M_BENCH_COMMON_H
+#define M_BENCH_COMMON_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+//压测工具公用部分：单调时钟、延迟直方图、HTTP响应增量解析
+
+static inline uint64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//对数线性直方图，每个2的幂区间再分16个子桶，相对误差约6%
+class latency_hist {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB = 1 << SUB_BITS;
+    static const int BUCKETS = 64 * SUB;
+
+    latency_hist() { reset(); }
+
+    void reset() {
+        memset(m_bucket, 0, sizeof(m_bucket));
+        m_count = 0;
+        m_sum = 0;
+        m_max = 0;
+    }
+    void record(uint64_t ns) {
+        ++m_bucket[index(ns)];
+        ++m_count;
+        m_sum += ns;
+        if (ns > m_max)
+            m_max = ns;
+    }
+    void merge(const latency_hist &other) {
+        for (int i = 0; i < BUCKETS; ++i)
+            m_bucket[i] += other.m_bucket[i];
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        if (other.m_max > m_max)
+            m_max = other.m_max;
+    }
+    //p取值0~1，返回所在子桶的中点
+    uint64_t percentile(double p) const {
+        if (m_count == 0)
+            return 0;
+        uint64_t target = (uint64_t)(m_count * p);
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += m_bucket[i];
+            if (seen > target) {
+                uint64_t low = lower(i), high = lower(i + 1);
+                uint64_t mid = low + (high - low) / 2;
+                return mid > m_max ? m_max : mid;
+            }
+        }
+        return m_max;
+    }
+    uint64_t count() const { return m_count; }
+    uint64_t max() const { return m_max; }
+    uint64_t mean() const { return m_count ? m_sum / m_count : 0; }
+
+private:
+    static int index(uint64_t v) {
+        if (v < (uint64_t)(2 * SUB))
+            return (int)v;
+        int e = 63 - __builtin_clzll(v) - SUB_BITS;
+        int idx = e * SUB + (int)(v >> e);
+        return idx < BUCKETS ? idx : BUCKETS - 1;
+    }
+    static uint64_t lower(int idx) {
+        if (idx < 2 * SUB)
+            return idx;
+        int e = idx / SUB - 1;
+        return (uint64_t)(idx % SUB + SUB) << e;
+    }
+
+    uint64_t m_bucket[BUCKETS];
+    uint64_t m_count;
+    uint64_t m_sum;
+    uint64_t m_max;
+};
+
+//HTTP/1.1响应增量解析，支持Content-Length、chunked和无长度(读到关闭)
+class http_resp_parser {
+public:
+    enum RESULT {
+        RESP_MORE = 0,   //需要更多数据
+        RESP_DONE,       //解析出一个完整响应
+        RESP_ERROR
+    };
+
+    http_resp_parser() { reset(); }
+
+    void reset() {
+        m_state = ST_HEAD;
+        m_head_len = 0;
+        m_status = 0;
+        m_body_left = 0;
+        m_chunked = false;
+        m_close = false;
+        m_until_close = false;
+        m_body_bytes = 0;
+    }
+
+    //消费data中最多len个字节，consumed返回实际消费数
+    RESULT feed(const char *data, int len, int *consumed) {
+        int pos = 0;
+        RESULT ret = RESP_MORE;
+        while (pos < len && ret == RESP_MORE) {
+            switch (m_state) {
+            case ST_HEAD:
+            {
+                char c = data[pos++];
+                if (m_head_len >= (int)sizeof(m_head) - 1) {
+                    ret = RESP_ERROR;
+                    break;
+                }
+                m_head[m_head_len++] = c;
+                if (c == '\n' && m_head_len >= 4 && memcmp(m_head + m_head_len - 4, "\r\n\r\n", 4) == 0) {
+                    m_head[m_head_len] = '\0';
+                    ret = parse_head();
+                }
+                break;
+            }
+            case ST_BODY:
+            {
+                int n = len - pos;
+                if (m_until_close) {
+                    m_body_bytes += n;
+                    pos += n;
+                    break;
+                }
+                if ((uint64_t)n > m_body_left)
+                    n = (int)m_body_left;
+                pos += n;
+                m_body_left -= n;
+                m_body_bytes += n;
+                if (m_body_left == 0)
+                    ret = RESP_DONE;
+                break;
+            }
+            case ST_CHUNK_SIZE:
+            {
+                char c = data[pos++];
+                if (c == '\n') {
+                    m_line[m_line_len] = '\0';
+                    m_body_left = strtoull(m_line, NULL, 16);
+                    m_line_len = 0;
+                    m_state = m_body_left == 0 ? ST_CHUNK_TRAILER : ST_CHUNK_DATA;
+                }
+                else if (m_line_len < (int)sizeof(m_line) - 1) {
+                    m_line[m_line_len++] = c;
+                }
+                break;
+            }
+            case ST_CHUNK_DATA:
+            {
+                int n = len - pos;
+                if ((uint64_t)n > m_body_left)
+                    n = (int)m_body_left;
+                pos += n;
+                m_body_left -= n;
+                m_body_bytes += n;
+                if (m_body_left == 0) {
+                    m_state = ST_CHUNK_CRLF;
+                    m_line_len = 0;
+                }
+                break;
+            }
+            case ST_CHUNK_CRLF:
+            {
+                if (data[pos++] == '\n')
+                    m_state = ST_CHUNK_SIZE;
+                break;
+            }
+            case ST_CHUNK_TRAILER:
+            {
+                //跳过trailer，遇到空行结束
+                char c = data[pos++];
+                if (c == '\n') {
+                    if (m_line_len == 0)
+                        ret = RESP_DONE;
+                    m_line_len = 0;
+                }
+                else if (c != '\r') {
+                    ++m_line_len;
+                }
+                break;
+            }
+            }
+        }
+        *consumed = pos;
+        return ret;
+    }
+
+    //对端关闭时调用，无长度响应以关闭作为结束
+    bool finish_on_close() const { return m_state == ST_BODY && m_until_close; }
+
+    int status() const { return m_status; }
+    bool close() const { return m_close; }
+    uint64_t body_bytes() const { return m_body_bytes; }
+
+private:
+    enum STATE {
+        ST_HEAD = 0,
+        ST_BODY,
+        ST_CHUNK_SIZE,
+        ST_CHUNK_DATA,
+        ST_CHUNK_CRLF,
+        ST_CHUNK_TRAILER
+    };
+
+    RESULT parse_head() {
+        if (strncmp(m_head, "HTTP/1.", 7) != 0)
+            return RESP_ERROR;
+        m_status = atoi(m_head + 9);
+        bool has_length = false;
+        for (char *line = strstr(m_head, "\r\n"); line && line[2] != '\r'; line = strstr(line + 2, "\r\n")) {
+            char *h = line + 2;
+            if (strncasecmp(h, "Content-Length:", 15) == 0) {
+                m_body_left = strtoull(h + 15 + strspn(h + 15, " \t"), NULL, 10);
+                has_length = true;
+            }
+            else if (strncasecmp(h, "Transfer-Encoding:", 18) == 0) {
+                char *v = strcasestr(h, "chunked");
+                m_chunked = v && v < strstr(h, "\r\n");
+            }
+            else if (strncasecmp(h, "Connection:", 11) == 0) {
+                char *v = h + 11 + strspn(h + 11, " \t");
+                m_close = strncasecmp(v, "close", 5) == 0;
+            }
+        }
+        m_line_len = 0;
+        //1xx、204、304没有消息体
+        if ((m_status >= 100 && m_status < 200) || m_status == 204 || m_status == 304)
+            return RESP_DONE;
+        if (m_chunked) {
+            m_state = ST_CHUNK_SIZE;
+            return RESP_MORE;
+        }
+        if (has_length) {
+            if (m_body_left == 0)
+                return RESP_DONE;
+            m_state = ST_BODY;
+            return RESP_MORE;
+        }
+        m_until_close = true;
+        m_close = true;
+        m_state = ST_BODY;
+        return RESP_MORE;
+    }
+
+    STATE m_state;
+    char m_head[8192];
+    int m_head_len;
+    char m_line[64];
+    int m_line_len;
+    int m_status;
+    uint64_t m_body_left;
+    uint64_t m_body_bytes;
+    bool m_chunked;
+    bool m_close;
+    bool m_until_close;
+};
+
+//解析host:port，填充IPv4地址
+static inline bool bench_resolve(const char *host, int port, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr->sin_addr) == 1)
+        return true;
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || !res)
+        return false;
+    addr->sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return true;
+}
+
+//非阻塞connect，返回fd，失败返回-1
+static inline int bench_connect(const struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static inline void bench_print_latency(const char *title, const latency_hist &h) {
+    printf("%s  n=%llu  mean=%.1fus  p50=%.1fus  p90=%.1fus  p99=%.1fus  p999=%.1fus  max=%.1fus\n",
+           title, (unsigned long long)h.count(), h.mean() / 1e3,
+           h.percentile(0.5) / 1e3, h.percentile(0.9) / 1e3, h.percentile(0.99) / 1e3,
+           h.percentile(0.999) / 1e3, h.max() / 1e3);
+}
+
+#endif
@@ -0,0 +1,546 @@
+//基于epoll的多线程HTTP压测工具
+//支持长连接、管线深度、固定速率(开环，按计划发送时间计算延迟以修正coordinated omission)
+//以及按权重混合的GET/POST场景，输出吞吐和p50/p99/p999延迟
+#include <sys/epoll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include "bench_common.h"
+
+//一次请求的场景
+struct scenario {
+    std::string name;
+    int weight;
+    std::string req_keepalive;
+    std::string req_close;
+};
+
+//每个场景的结果统计
+struct scenario_stat {
+    latency_hist hist;
+    uint64_t done;
+    uint64_t errors;
+};
+
+struct options {
+    const char *host;
+    int port;
+    int conns;
+    int threads;
+    int duration;
+    int depth;
+    double rate;       //总速率 req/s，0表示闭环
+    int timeout_ms;
+    bool keepalive;
+    const char *mix;
+    const char *user;
+    const char *password;
+};
+
+static const int MAX_DEPTH = 64;
+
+struct conn {
+    int fd;
+    bool connected;
+    bool want_out;
+    std::string out;
+    size_t out_off;
+    //已发出(或已排队)请求的计划发送时间和场景，FIFO
+    uint64_t start[MAX_DEPTH];
+    int scn[MAX_DEPTH];
+    int head;
+    int count;
+    uint64_t next_send;
+    uint64_t last_progress;
+    http_resp_parser parser;
+};
+
+struct thread_result {
+    std::vector<scenario_stat> stat;
+    latency_hist all;
+    uint64_t status[6];   //按 1xx~5xx 分类，[0]为其它
+    uint64_t connect_errors;
+    uint64_t read_errors;
+    uint64_t timeouts;
+    uint64_t bytes;
+};
+
+static options g_opt;
+static std::vector<scenario> g_scenarios;
+static int g_total_weight = 0;
+static struct sockaddr_in g_addr;
+static std::atomic<bool> g_stop(false);
+
+static std::string build_request(const char *method, const char *path, const std::string &body, bool keepalive) {
+    std::string req;
+    req.reserve(256 + body.size());
+    req += method;
+    req += " ";
+    req += path;
+    req += " HTTP/1.1\r\nHost: ";
+    req += g_opt.host;
+    req += "\r\nUser-Agent: poor-loadgen\r\nAccept: */*\r\nConnection: ";
+    req += keepalive ? "keep-alive" : "close";
+    req += "\r\n";
+    if (!body.empty()) {
+        req += "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: ";
+        req += std::to_string(body.size());
+        req += "\r\n";
+    }
+    req += "\r\n";
+    req += body;
+    return req;
+}
+
+static bool add_scenario(const std::string &name, int weight) {
+    const char *method = "GET";
+    const char *path = NULL;
+    std::string body;
+    std::string cred = std::string("user=") + g_opt.user + "&password=" + g_opt.password;
+    if (name == "index")
+        path = "/";
+    else if (name == "route")
+        path = "/0";
+    else if (name == "picture")
+        path = "/5";
+    else if (name == "image")
+        path = "/frame.jpg";
+    else if (name == "video")
+        path = "/xxx.mp4";
+    else if (name == "login") {
+        method = "POST";
+        path = "/2CGISQL.cgi";
+        body = cred;
+    }
+    else if (name == "register") {
+        method = "POST";
+        path = "/3CGISQL.cgi";
+        body = cred;
+    }
+    else if (name[0] == '/')
+        path = name.c_str();
+    else
+        return false;
+
+    scenario s;
+    s.name = name;
+    s.weight = weight;
+    s.req_keepalive = build_request(method, path, body, true);
+    s.req_close = build_request(method, path, body, false);
+    g_scenarios.push_back(s);
+    g_total_weight += weight;
+    return true;
+}
+
+//解析 "index:60,login:20,/xxx.jpg:20"
+static bool parse_mix(const char *mix) {
+    std::string s = mix;
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t end = s.find(',', pos);
+        if (end == std::string::npos)
+            end = s.size();
+        std::string item = s.substr(pos, end - pos);
+        int weight = 1;
+        size_t colon = item.rfind(':');
+        if (colon != std::string::npos) {
+            weight = atoi(item.c_str() + colon + 1);
+            item = item.substr(0, colon);
+        }
+        if (weight > 0 && !add_scenario(item, weight)) {
+            fprintf(stderr, "unknown scenario %s\n", item.c_str());
+            return false;
+        }
+        pos = end + 1;
+    }
+    return g_total_weight > 0;
+}
+
+static inline uint64_t xorshift(uint64_t &s) {
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return s;
+}
+
+class worker {
+public:
+    worker(int id, int nconn, thread_result *res) : m_id(id), m_res(res), m_conns(nconn) {
+        m_rng = 0x9E3779B97F4A7C15ULL * (id + 1);
+        m_res->stat.resize(g_scenarios.size());
+        for (size_t i = 0; i < g_scenarios.size(); ++i) {
+            m_res->stat[i].done = 0;
+            m_res->stat[i].errors = 0;
+        }
+        memset(m_res->status, 0, sizeof(m_res->status));
+        m_res->connect_errors = m_res->read_errors = m_res->timeouts = m_res->bytes = 0;
+        //开环模式下每个连接的发送间隔
+        m_interval = g_opt.rate > 0 ? (uint64_t)(1e9 * g_opt.conns / g_opt.rate) : 0;
+    }
+
+    void run() {
+        m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+        uint64_t start = bench_now_ns();
+        for (size_t i = 0; i < m_conns.size(); ++i) {
+            conn &c = m_conns[i];
+            c.fd = -1;
+            //错开各连接的首次发送时间，避免同时突发
+            c.next_send = start + (m_interval ? m_interval * i / m_conns.size() : 0);
+            reconnect(c, (int)i);
+        }
+
+        epoll_event events[1024];
+        while (!g_stop.load(std::memory_order_relaxed)) {
+            uint64_t now = bench_now_ns();
+            for (size_t i = 0; i < m_conns.size(); ++i) {
+                conn &c = m_conns[i];
+                if (c.fd < 0)
+                    reconnect(c, (int)i);
+                if (c.fd < 0)
+                    continue;
+                fill(c, now);
+                if (c.connected)
+                    flush(c, (int)i);
+                if (c.count > 0 && now - c.last_progress > (uint64_t)g_opt.timeout_ms * 1000000ULL) {
+                    m_res->timeouts += c.count;
+                    fail(c, (int)i);
+                }
+            }
+            int n = epoll_wait(m_epollfd, events, 1024, m_interval ? 1 : 10);
+            for (int k = 0; k < n; ++k) {
+                int idx = events[k].data.u32;
+                conn &c = m_conns[idx];
+                if (c.fd < 0)
+                    continue;
+                if (!c.connected && (events[k].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                    if (err != 0) {
+                        ++m_res->connect_errors;
+                        fail(c, idx);
+                        continue;
+                    }
+                    c.connected = true;
+                    c.last_progress = bench_now_ns();
+                }
+                if (events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    on_read(c, idx);
+                if (c.fd >= 0 && c.connected && (events[k].events & EPOLLOUT))
+                    flush(c, idx);
+            }
+        }
+        for (size_t i = 0; i < m_conns.size(); ++i) {
+            if (m_conns[i].fd >= 0)
+                close(m_conns[i].fd);
+        }
+        close(m_epollfd);
+    }
+
+private:
+    int pick() {
+        int r = (int)(xorshift(m_rng) % g_total_weight);
+        for (size_t i = 0; i < g_scenarios.size(); ++i) {
+            r -= g_scenarios[i].weight;
+            if (r < 0)
+                return (int)i;
+        }
+        return 0;
+    }
+
+    //按计划把请求放入发送缓冲，闭环模式下补满管线深度
+    void fill(conn &c, uint64_t now) {
+        int depth = g_opt.keepalive ? g_opt.depth : 1;
+        while (c.count < depth) {
+            uint64_t intended = now;
+            if (m_interval) {
+                if (c.next_send > now)
+                    break;
+                intended = c.next_send;
+                c.next_send += m_interval;
+            }
+            int s = pick();
+            const scenario &sc = g_scenarios[s];
+            c.out += g_opt.keepalive ? sc.req_keepalive : sc.req_close;
+            int slot = (c.head + c.count) % MAX_DEPTH;
+            c.start[slot] = intended;
+            c.scn[slot] = s;
+            if (c.count == 0)
+                c.last_progress = now;
+            ++c.count;
+        }
+    }
+
+    void flush(conn &c, int idx) {
+        while (c.out_off < c.out.size()) {
+            ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    watch(c, idx, true);
+                    return;
+                }
+                ++m_res->read_errors;
+                fail(c, idx);
+                return;
+            }
+            c.out_off += n;
+        }
+        c.out.clear();
+        c.out_off = 0;
+        watch(c, idx, false);
+    }
+
+    void watch(conn &c, int idx, bool want_out) {
+        if (c.want_out == want_out)
+            return;
+        c.want_out = want_out;
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | (want_out ? EPOLLOUT : 0);
+        ev.data.u32 = idx;
+        epoll_ctl(m_epollfd, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+
+    void on_read(conn &c, int idx) {
+        char buf[65536];
+        while (c.fd >= 0) {
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if (n < 0) {
+                if (errno == EAGAIN)
+                    return;
+                ++m_res->read_errors;
+                fail(c, idx);
+                return;
+            }
+            if (n == 0) {
+                if (c.parser.finish_on_close() && c.count > 0) {
+                    complete(c);
+                }
+                else if (c.count > 0) {
+                    ++m_res->read_errors;
+                }
+                fail(c, idx);
+                return;
+            }
+            m_res->bytes += n;
+            c.last_progress = bench_now_ns();
+            int off = 0;
+            while (off < n) {
+                int used = 0;
+                http_resp_parser::RESULT r = c.parser.feed(buf + off, (int)(n - off), &used);
+                off += used;
+                if (r == http_resp_parser::RESP_ERROR) {
+                    ++m_res->read_errors;
+                    fail(c, idx);
+                    return;
+                }
+                if (r == http_resp_parser::RESP_DONE) {
+                    bool closing = c.parser.close() || !g_opt.keepalive;
+                    if (c.count == 0) {
+                        //多出来的响应
+                        ++m_res->read_errors;
+                        fail(c, idx);
+                        return;
+                    }
+                    complete(c);
+                    if (closing) {
+                        //未收到响应的管线请求计为错误
+                        if (c.count > 0)
+                            m_res->read_errors += c.count;
+                        c.count = 0;
+                        fail(c, idx);
+                        return;
+                    }
+                    c.parser.reset();
+                }
+            }
+        }
+    }
+
+    void complete(conn &c) {
+        uint64_t now = bench_now_ns();
+        int slot = c.head;
+        int s = c.scn[slot];
+        uint64_t lat = now > c.start[slot] ? now - c.start[slot] : 0;
+        c.head = (c.head + 1) % MAX_DEPTH;
+        --c.count;
+        int cls = c.parser.status() / 100;
+        ++m_res->status[(cls >= 1 && cls <= 5) ? cls : 0];
+        if (cls >= 4 || cls < 1)
+            ++m_res->stat[s].errors;
+        ++m_res->stat[s].done;
+        m_res->stat[s].hist.record(lat);
+        m_res->all.record(lat);
+    }
+
+    //关闭连接，丢弃未完成的请求，随后重连
+    void fail(conn &c, int idx) {
+        if (c.fd >= 0) {
+            epoll_ctl(m_epollfd, EPOLL_CTL_DEL, c.fd, NULL);
+            close(c.fd);
+        }
+        c.fd = -1;
+        (void)idx;
+    }
+
+    void reconnect(conn &c, int idx) {
+        c.connected = false;
+        c.want_out = true;
+        c.out.clear();
+        c.out_off = 0;
+        c.head = 0;
+        c.count = 0;
+        c.parser.reset();
+        c.last_progress = bench_now_ns();
+        c.fd = bench_connect(&g_addr);
+        if (c.fd < 0) {
+            ++m_res->connect_errors;
+            return;
+        }
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+        ev.data.u32 = idx;
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+
+    int m_id;
+    thread_result *m_res;
+    std::vector<conn> m_conns;
+    int m_epollfd;
+    uint64_t m_rng;
+    uint64_t m_interval;
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -a host       server address (127.0.0.1)\n"
+            "  -p port       server port (9000)\n"
+            "  -c conns      concurrent connections (100)\n"
+            "  -t threads    worker threads (4)\n"
+            "  -d seconds    test duration (10)\n"
+            "  -k            keep-alive (default: new connection per request)\n"
+            "  -P depth      pipeline depth per keep-alive connection (1)\n"
+            "  -R rate       open-loop total rate req/s, latency from intended send time (0 = closed loop)\n"
+            "  -T ms         per-request timeout (5000)\n"
+            "  -m mix        weighted scenarios, e.g. index:60,route:10,login:20,register:5,video:5\n"
+            "                scenarios: index route picture image video login register /any/path\n"
+            "  -u user       login/register user name (bench)\n"
+            "  -w password   login/register password (123)\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    g_opt.host = "127.0.0.1";
+    g_opt.port = 9000;
+    g_opt.conns = 100;
+    g_opt.threads = 4;
+    g_opt.duration = 10;
+    g_opt.depth = 1;
+    g_opt.rate = 0;
+    g_opt.timeout_ms = 5000;
+    g_opt.keepalive = false;
+    g_opt.mix = "index";
+    g_opt.user = "bench";
+    g_opt.password = "123";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:c:t:d:kP:R:T:m:u:w:h")) != -1) {
+        switch (opt) {
+        case 'a': g_opt.host = optarg; break;
+        case 'p': g_opt.port = atoi(optarg); break;
+        case 'c': g_opt.conns = atoi(optarg); break;
+        case 't': g_opt.threads = atoi(optarg); break;
+        case 'd': g_opt.duration = atoi(optarg); break;
+        case 'k': g_opt.keepalive = true; break;
+        case 'P': g_opt.depth = atoi(optarg); break;
+        case 'R': g_opt.rate = atof(optarg); break;
+        case 'T': g_opt.timeout_ms = atoi(optarg); break;
+        case 'm': g_opt.mix = optarg; break;
+        case 'u': g_opt.user = optarg; break;
+        case 'w': g_opt.password = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (g_opt.conns <= 0 || g_opt.threads <= 0 || g_opt.duration <= 0 || g_opt.depth <= 0 || g_opt.depth > MAX_DEPTH) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (g_opt.threads > g_opt.conns)
+        g_opt.threads = g_opt.conns;
+    if (!bench_resolve(g_opt.host, g_opt.port, &g_addr)) {
+        fprintf(stderr, "cannot resolve %s\n", g_opt.host);
+        return 1;
+    }
+    if (!parse_mix(g_opt.mix)) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("target %s:%d  %d connections  %d threads  %ds  %s  depth %d  %s\n",
+           g_opt.host, g_opt.port, g_opt.conns, g_opt.threads, g_opt.duration,
+           g_opt.keepalive ? "keep-alive" : "close", g_opt.keepalive ? g_opt.depth : 1,
+           g_opt.rate > 0 ? ("open-loop " + std::to_string((long long)g_opt.rate) + " req/s").c_str() : "closed-loop");
+
+    std::vector<thread_result> results(g_opt.threads);
+    std::vector<std::thread> threads;
+    uint64_t begin = bench_now_ns();
+    for (int i = 0; i < g_opt.threads; ++i) {
+        int n = g_opt.conns / g_opt.threads + (i < g_opt.conns % g_opt.threads ? 1 : 0);
+        threads.emplace_back([i, n, &results] {
+            worker w(i, n, &results[i]);
+            w.run();
+        });
+    }
+    sleep(g_opt.duration);
+    g_stop = true;
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+    double secs = (bench_now_ns() - begin) / 1e9;
+
+    thread_result total;
+    total.stat.resize(g_scenarios.size());
+    memset(total.status, 0, sizeof(total.status));
+    total.connect_errors = total.read_errors = total.timeouts = total.bytes = 0;
+    for (size_t s = 0; s < g_scenarios.size(); ++s)
+        total.stat[s].done = total.stat[s].errors = 0;
+    for (size_t i = 0; i < results.size(); ++i) {
+        thread_result &r = results[i];
+        total.all.merge(r.all);
+        for (int k = 0; k < 6; ++k)
+            total.status[k] += r.status[k];
+        total.connect_errors += r.connect_errors;
+        total.read_errors += r.read_errors;
+        total.timeouts += r.timeouts;
+        total.bytes += r.bytes;
+        for (size_t s = 0; s < g_scenarios.size(); ++s) {
+            total.stat[s].hist.merge(r.stat[s].hist);
+            total.stat[s].done += r.stat[s].done;
+            total.stat[s].errors += r.stat[s].errors;
+        }
+    }
+
+    printf("\n%llu responses in %.2fs, %.1f req/s, %.2f MB/s\n",
+           (unsigned long long)total.all.count(), secs, total.all.count() / secs, total.bytes / secs / 1048576.0);
+    printf("status 2xx=%llu 3xx=%llu 4xx=%llu 5xx=%llu other=%llu\n",
+           (unsigned long long)total.status[2], (unsigned long long)total.status[3],
+           (unsigned long long)total.status[4], (unsigned long long)total.status[5],
+           (unsigned long long)(total.status[0] + total.status[1]));
+    printf("errors connect=%llu read=%llu timeout=%llu\n",
+           (unsigned long long)total.connect_errors, (unsigned long long)total.read_errors,
+           (unsigned long long)total.timeouts);
+    bench_print_latency("latency", total.all);
+    if (g_scenarios.size() > 1) {
+        for (size_t s = 0; s < g_scenarios.size(); ++s) {
+            char title[64];
+            snprintf(title, sizeof(title), "  %-10s", g_scenarios[s].name.c_str());
+            bench_print_latency(title, total.stat[s].hist);
+        }
+    }
+    return 0;
+}
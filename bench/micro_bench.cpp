@@ -0,0 +1,365 @@
+//各模块的微基准测试：请求解析、限流查表、定时器链表、阻塞队列、线程池投递、redis连接池
+//基于Google Benchmark，--benchmark_format=json 或 --benchmark_out=xx.json 输出JSON便于对比
+#include <benchmark/benchmark.h>
+#include <stdarg.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include "../http/http_conn.h"
+#include "../http/response_builder.h"
+#include "../http/router.h"
+#include "../ratelimit/rate_limiter.h"
+#include "../timer/lst_timer.h"
+#include "../log/block_queue.h"
+#include "../threadpool.h"
+#include "../CGIredis/redis.h"
+#include "../CGIredis/mock_redis.h"
+
+static char g_root[] = "./root";
+
+//构造带n个额外请求头的GET请求
+static std::string make_get(int extra_headers, const char *url) {
+    std::string req = std::string("GET ") + url + " HTTP/1.1\r\n"
+                      "Host: localhost:9000\r\n"
+                      "Connection: keep-alive\r\n";
+    for (int i = 0; i < extra_headers; ++i)
+        req += "X-Bench-Header-" + std::to_string(i) + ": value-" + std::to_string(i) + "\r\n";
+    req += "\r\n";
+    return req;
+}
+
+//请求行和请求头解析，不进入do_request
+static void BM_http_parse(benchmark::State &state) {
+    http_conn *conn = new http_conn;
+    conn->init_offline(g_root);
+    std::string req = make_get(state.range(0), "/judge.html");
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(conn->parse_buffer(req.data(), req.size(), true));
+    }
+    state.SetBytesProcessed(state.iterations() * req.size());
+    delete conn;
+}
+BENCHMARK(BM_http_parse)->Arg(0)->Arg(4)->Arg(16)->Arg(32);
+
+//完整的process_read，包含do_request的stat和mmap
+static void BM_http_process_read(benchmark::State &state) {
+    http_conn *conn = new http_conn;
+    conn->init_offline(g_root);
+    std::string req = make_get(state.range(0), "/judge.html");
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(conn->parse_buffer(req.data(), req.size(), false));
+    }
+    delete conn;
+}
+BENCHMARK(BM_http_process_read)->Arg(0)->Arg(16);
+
+//POST登录表单解析，不访问redis
+static void BM_http_parse_post(benchmark::State &state) {
+    http_conn *conn = new http_conn;
+    conn->init_offline(g_root);
+    std::string body = "user=benchuser&password=123456";
+    std::string req = "POST /2CGISQL.cgi HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n"
+                      "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: " +
+                      std::to_string(body.size()) + "\r\n\r\n" + body;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(conn->parse_buffer(req.data(), req.size(), true));
+    }
+    delete conn;
+}
+BENCHMARK(BM_http_parse_post);
+
+//原add_response的做法：每个头部一次vsnprintf(不含原来每次调用的spdlog输出)
+static bool legacy_add(char *buf, int &idx, const char *format, ...) {
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(buf + idx, 1024 - 1 - idx, format, arg_list);
+    va_end(arg_list);
+    if (len >= 1024 - 1 - idx)
+        return false;
+    idx += len;
+    return true;
+}
+
+//一个普通200静态文件响应的头部，旧的格式化路径
+static void BM_header_vsnprintf(benchmark::State &state) {
+    char buf[1024];
+    for (auto _ : state) {
+        int idx = 0;
+        legacy_add(buf, idx, "%s %d %s\r\n", "HTTP/1.1", 200, "OK");
+        legacy_add(buf, idx, "Last-Modified:%s\r\nETag:%s\r\n", "Fri, 12 May 2023 11:27:26 GMT",
+                   "\"11e03e-2ec551-175e61cd845cac00\"");
+        legacy_add(buf, idx, "Vary:Accept-Encoding\r\n");
+        legacy_add(buf, idx, "Content-Type:%s\r\n", "text/html; charset=utf-8");
+        legacy_add(buf, idx, "Accept-Ranges:bytes\r\n");
+        legacy_add(buf, idx, "Content-Length:%d\r\n", 3065169);
+        legacy_add(buf, idx, "Connection:%s\r\n", "keep-alive");
+        legacy_add(buf, idx, "%s", "\r\n");
+        benchmark::DoNotOptimize(buf);
+        benchmark::DoNotOptimize(idx);
+    }
+}
+BENCHMARK(BM_header_vsnprintf);
+
+//同样的头部，经response_builder，另含Date和Server
+static void BM_header_builder(benchmark::State &state) {
+    char buf[1024];
+    date_cache::refresh();
+    for (auto _ : state) {
+        int idx = 0;
+        response_builder b(buf, sizeof(buf), &idx);
+        b.status_line(200, "OK");
+        date_cache::append_to(b);
+        b.header(HDR("Last-Modified"), "Fri, 12 May 2023 11:27:26 GMT");
+        b.header(HDR("ETag"), "\"11e03e-2ec551-175e61cd845cac00\"");
+        b.header(HDR("Vary"), "Accept-Encoding");
+        b.header(HDR("Content-Type"), "text/html; charset=utf-8");
+        b.append("Accept-Ranges:bytes\r\n");
+        b.header(HDR("Content-Length"), 3065169LL);
+        b.header(HDR("Connection"), "keep-alive");
+        b.blank_line();
+        benchmark::DoNotOptimize(buf);
+        benchmark::DoNotOptimize(idx);
+    }
+}
+BENCHMARK(BM_header_builder);
+
+//n条精确路由中查找，耗时应与路由数无关
+static void BM_router_find(benchmark::State &state) {
+    int n = state.range(0);
+    router<int> table;
+    std::vector<std::string> paths(n);
+    std::vector<int> values(n);
+    for (int i = 0; i < n; ++i) {
+        paths[i] = "/api/v1/resource" + std::to_string(i);
+        values[i] = i;
+        table.add(paths[i].c_str(), &values[i]);
+    }
+    table.add_prefix("/", &values[0]);
+    table.build();
+    int i = 0;
+    for (auto _ : state) {
+        const std::string &path = paths[i];
+        benchmark::DoNotOptimize(table.find(path.data(), path.size()));
+        i = i + 1 == n ? 0 : i + 1;
+    }
+}
+BENCHMARK(BM_router_find)->RangeMultiplier(10)->Range(10, 10000);
+
+//按IP限流的一次检查，range为轮流出现的IP数，多个线程同时查表
+static void BM_rate_limit(benchmark::State &state) {
+    rate_limiter *limiter = rate_limiter::get_instance();
+    if (state.thread_index() == 0)
+        limiter->set_rate(RATE_REQUEST, 1000000, 0);
+    uint32_t n = state.range(0);
+    uint32_t base = state.thread_index() * n;
+    uint32_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(limiter->allow(RATE_REQUEST, base + i));
+        i = i + 1 == n ? 0 : i + 1;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_rate_limit)->Arg(1)->Arg(1000)->Arg(20000)->ThreadRange(1, 8)->UseRealTime();
+
+static void noop_cb(client_data *) {
+}
+
+//在已有n个定时器的链表中插入并删除一个
+static void BM_timer_add(benchmark::State &state) {
+    sort_timer_lst lst;
+    int n = state.range(0);
+    time_t base = time(NULL);
+    for (int i = 0; i < n; ++i) {
+        util_timer *t = new util_timer;
+        t->expire = base + i;
+        t->cb_func = noop_cb;
+        t->user_data = NULL;
+        lst.add_timer(t);
+    }
+    unsigned seed = 1;
+    for (auto _ : state) {
+        util_timer *t = new util_timer;
+        seed = seed * 1103515245 + 12345;
+        t->expire = base + (seed >> 8) % (n + 1);
+        t->cb_func = noop_cb;
+        t->user_data = NULL;
+        lst.add_timer(t);
+        lst.del_timer(t);
+    }
+}
+BENCHMARK(BM_timer_add)->RangeMultiplier(10)->Range(100, 10000);
+
+//活跃连接延长超时，模拟adjust_timer：从表头移到表尾
+static void BM_timer_adjust(benchmark::State &state) {
+    sort_timer_lst lst;
+    int n = state.range(0);
+    std::vector<util_timer *> timers(n);
+    time_t expire = 0;
+    for (int i = 0; i < n; ++i) {
+        timers[i] = new util_timer;
+        timers[i]->expire = ++expire;
+        timers[i]->cb_func = noop_cb;
+        timers[i]->user_data = NULL;
+        lst.add_timer(timers[i]);
+    }
+    int head = 0;
+    for (auto _ : state) {
+        util_timer *t = timers[head];
+        head = (head + 1) % n;
+        t->expire = ++expire;
+        lst.adjust_timer(t);
+    }
+}
+BENCHMARK(BM_timer_adjust)->RangeMultiplier(10)->Range(100, 10000);
+
+//n个定时器全部到期时tick的开销
+static void BM_timer_tick(benchmark::State &state) {
+    int n = state.range(0);
+    for (auto _ : state) {
+        state.PauseTiming();
+        sort_timer_lst *lst = new sort_timer_lst;
+        for (int i = 0; i < n; ++i) {
+            util_timer *t = new util_timer;
+            t->expire = 0;
+            t->cb_func = noop_cb;
+            t->user_data = NULL;
+            lst->add_timer(t);
+        }
+        state.ResumeTiming();
+        lst->tick();
+        state.PauseTiming();
+        delete lst;
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_timer_tick)->RangeMultiplier(10)->Range(100, 10000);
+
+//每个线程先push再pop，队列中始终有元素，不会阻塞
+static block_queue<std::string> *g_queue = NULL;
+static void BM_block_queue(benchmark::State &state) {
+    if (state.thread_index() == 0)
+        g_queue = new block_queue<std::string>(1024);
+    std::string item(64, 'x');
+    std::string out;
+    for (auto _ : state) {
+        g_queue->push(item);
+        g_queue->pop(out);
+    }
+    //计时循环的开始和结束处各线程互相等待，此时其他线程已不再使用队列
+    if (state.thread_index() == 0) {
+        delete g_queue;
+        g_queue = NULL;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_block_queue)->ThreadRange(1, 8)->UseRealTime();
+
+//线程池中的模拟任务，只计数
+struct bench_task {
+    int m_state;
+    int improv;
+    int timer_flag;
+    redisContext *redis;
+    req_trace m_trace;
+    std::atomic<long> *done;
+
+    bool read_once() { return true; }
+    bool write() { return true; }
+    void process() { done->fetch_add(1, std::memory_order_relaxed); }
+};
+
+//线程池的工作线程不会退出，按线程数缓存，不析构
+static threadpool<bench_task> *get_pool(int threads) {
+    static std::map<int, threadpool<bench_task> *> pools;
+    static locker lock;
+    lock.lock();
+    threadpool<bench_task> *&pool = pools[threads];
+    if (!pool)
+        pool = new threadpool<bench_task>(connection_pool::GetInstance(), threads, 10000);
+    lock.unlock();
+    return pool;
+}
+
+//主线程投递任务的开销，range为工作线程数，结束时等待任务全部处理
+static void BM_threadpool_append(benchmark::State &state) {
+    threadpool<bench_task> *pool = get_pool(state.range(0));
+    std::atomic<long> done(0);
+    const int N = 1024;
+    std::vector<bench_task> tasks(N);
+    for (int i = 0; i < N; ++i) {
+        tasks[i].done = &done;
+        tasks[i].redis = NULL;
+    }
+    long appended = 0, dropped = 0;
+    int i = 0;
+    for (auto _ : state) {
+        if (pool->append(&tasks[i], 0))
+            ++appended;
+        else
+            ++dropped;
+        i = (i + 1) % N;
+        //同一个任务对象可能仍在队列中，周期性等待处理完
+        if (i == 0) {
+            while (done.load(std::memory_order_relaxed) < appended) {
+            }
+        }
+    }
+    while (done.load(std::memory_order_relaxed) < appended) {
+    }
+    state.counters["dropped"] = dropped;
+    state.SetItemsProcessed(appended);
+}
+BENCHMARK(BM_threadpool_append)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime();
+
+//进程内模拟redis，连接池指向它
+static mock_redis *get_mock_redis() {
+    static mock_redis *server = NULL;
+    if (!server) {
+        server = new mock_redis;
+        server->put("bench", "123");
+        server->start(0);
+    }
+    return server;
+}
+
+static const int POOL_SIZE = 8;
+
+static connection_pool *get_conn_pool() {
+    connection_pool *pool = connection_pool::GetInstance();
+    if (pool->GetFreeConn() == 0)
+        pool->init("127.0.0.1", get_mock_redis()->port(), POOL_SIZE);
+    return pool;
+}
+
+//获取并归还一个连接，线程数超过连接数时会在信号量上等待
+static void BM_connection_pool(benchmark::State &state) {
+    connection_pool *pool = connection_pool::GetInstance();
+    if (state.thread_index() == 0)
+        get_conn_pool();
+    for (auto _ : state) {
+        redisContext *conn = pool->GetConnection();
+        benchmark::DoNotOptimize(conn);
+        pool->ReleaseConnection(conn);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_connection_pool)->ThreadRange(1, 16)->UseRealTime();
+
+//经连接池对模拟redis做一次GET，range为注入的延迟(微秒)
+static void BM_redis_get(benchmark::State &state) {
+    connection_pool *pool = get_conn_pool();
+    get_mock_redis()->set_latency(state.range(0), 0);
+    for (auto _ : state) {
+        redisContext *redis = NULL;
+        connectionRAII rediscon(&redis, pool);
+        redisReply *reply = static_cast<redisReply *>(redisCommand(redis, "GET %s", "bench"));
+        benchmark::DoNotOptimize(reply);
+        freeReplyObject(reply);
+    }
+    get_mock_redis()->set_latency(0, 0);
+}
+BENCHMARK(BM_redis_get)->Arg(0)->Arg(50)->Arg(500)->UseRealTime();
+
+BENCHMARK_MAIN();
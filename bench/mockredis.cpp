@@ -0,0 +1,64 @@
+//独立运行的模拟redis，供loadgen压测登录注册接口
+//./mockredis -p 6379 -l 500 -j 200 -e 0.01 -u bench:123
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string>
+#include "../CGIredis/mock_redis.h"
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_signal(int) {
+    g_stop = 1;
+}
+
+int main(int argc, char *argv[]) {
+    int port = 6379;
+    int latency_us = 0, jitter_us = 0;
+    double error_rate = 0;
+    mock_redis server;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:l:j:e:u:h")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'l': latency_us = atoi(optarg); break;
+        case 'j': jitter_us = atoi(optarg); break;
+        case 'e': error_rate = atof(optarg); break;
+        case 'u':
+        {
+            //预置用户 name:password
+            const char *colon = strchr(optarg, ':');
+            if (colon)
+                server.put(std::string(optarg, colon - optarg), colon + 1);
+            break;
+        }
+        default:
+            fprintf(stderr, "usage: %s [-p port] [-l latency_us] [-j jitter_us] [-e error_rate] [-u user:password]...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    server.set_latency(latency_us, jitter_us);
+    server.set_error_rate(error_rate);
+    if (!server.start(port)) {
+        perror("mockredis start");
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    printf("mockredis on 127.0.0.1:%d latency %dus jitter %dus error rate %.4f\n",
+           server.port(), latency_us, jitter_us, error_rate);
+    fflush(stdout);
+
+    while (!g_stop)
+        pause();
+    server.stop();
+    printf("%llu commands, %llu injected errors\n",
+           (unsigned long long)server.commands(), (unsigned long long)server.injected_errors());
+    return 0;
+}
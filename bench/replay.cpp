@@ -0,0 +1,383 @@
+//回放服务器抓包(-c)得到的请求，按原始节奏或倍速重放，统计每个请求的延迟
+//同一连接内等待上一批请求的响应收齐后才发送下一段，与浏览器行为一致
+//延迟从计划发送时间算起，服务器变慢时不会因为推迟发送而低估延迟
+#include <sys/epoll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include "bench_common.h"
+#include "../trace/capture_format.h"
+
+//从请求字节流中切分出完整请求，只识别Content-Length
+class http_req_scanner {
+public:
+    http_req_scanner() : m_body_left(0) {}
+
+    //返回本段数据中完成的请求路径
+    void feed(const char *data, size_t len, std::vector<std::string> &done) {
+        size_t pos = 0;
+        while (pos < len) {
+            if (m_body_left > 0) {
+                size_t n = len - pos < m_body_left ? len - pos : m_body_left;
+                pos += n;
+                m_body_left -= n;
+                if (m_body_left == 0)
+                    done.push_back(m_path);
+                continue;
+            }
+            m_head.push_back(data[pos++]);
+            size_t n = m_head.size();
+            if (n >= 4 && m_head.compare(n - 4, 4, "\r\n\r\n") == 0) {
+                parse_head();
+                m_head.clear();
+                if (m_body_left == 0)
+                    done.push_back(m_path);
+            }
+        }
+    }
+
+private:
+    void parse_head() {
+        size_t sp1 = m_head.find(' ');
+        size_t sp2 = sp1 == std::string::npos ? std::string::npos : m_head.find(' ', sp1 + 1);
+        m_path = sp2 == std::string::npos ? "?" : m_head.substr(sp1 + 1, sp2 - sp1 - 1);
+        m_body_left = 0;
+        size_t p = 0;
+        while ((p = m_head.find("\r\n", p)) != std::string::npos) {
+            p += 2;
+            if (strncasecmp(m_head.c_str() + p, "Content-Length:", 15) == 0)
+                m_body_left = strtoull(m_head.c_str() + p + 15, NULL, 10);
+        }
+    }
+
+    std::string m_head;
+    std::string m_path;
+    size_t m_body_left;
+};
+
+struct chunk {
+    uint64_t ts;
+    size_t off;
+    uint32_t len;
+};
+
+struct session {
+    std::vector<chunk> chunks;
+    size_t next;
+    int fd;
+    bool connected;
+    std::string out;
+    size_t out_off;
+    //已发出请求的计划时间和路径
+    std::deque<std::pair<uint64_t, std::string> > inflight;
+    http_req_scanner scanner;
+    http_resp_parser parser;
+    bool want_out;
+};
+
+struct path_stat {
+    path_stat() : errors(0) {}
+    latency_hist hist;
+    uint64_t errors;
+};
+
+static std::string g_data;
+static std::map<uint32_t, session> g_sessions;
+static std::map<std::string, path_stat> g_paths;
+static latency_hist g_all;
+static uint64_t g_errors = 0;
+static uint64_t g_bytes = 0;
+static struct sockaddr_in g_addr;
+static int g_epollfd;
+static const size_t MAX_PATHS = 64;
+
+static bool load(const char *file) {
+    FILE *fp = fopen(file, "rb");
+    if (!fp) {
+        perror(file);
+        return false;
+    }
+    capture_file_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, CAPTURE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", file);
+        fclose(fp);
+        return false;
+    }
+    capture_record_header rec;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        chunk c;
+        c.ts = rec.ts_ns;
+        c.off = g_data.size();
+        c.len = rec.len;
+        g_data.resize(g_data.size() + rec.len);
+        if (fread(&g_data[c.off], 1, rec.len, fp) != rec.len) {
+            g_data.resize(c.off);
+            break;
+        }
+        session &s = g_sessions[rec.conn_id];
+        s.chunks.push_back(c);
+    }
+    fclose(fp);
+    return true;
+}
+
+static path_stat &stat_of(const std::string &path) {
+    std::map<std::string, path_stat>::iterator it = g_paths.find(path);
+    if (it != g_paths.end())
+        return it->second;
+    if (g_paths.size() >= MAX_PATHS)
+        return g_paths["(other)"];
+    return g_paths[path];
+}
+
+static void drop(session &s) {
+    if (s.fd >= 0) {
+        epoll_ctl(g_epollfd, EPOLL_CTL_DEL, s.fd, NULL);
+        close(s.fd);
+    }
+    s.fd = -1;
+    s.connected = false;
+    g_errors += s.inflight.size();
+    for (size_t i = 0; i < s.inflight.size(); ++i)
+        ++stat_of(s.inflight[i].second).errors;
+    s.inflight.clear();
+    s.out.clear();
+    s.out_off = 0;
+    s.parser.reset();
+}
+
+static void open_conn(session &s, uint32_t id) {
+    s.fd = bench_connect(&g_addr);
+    s.connected = false;
+    s.want_out = true;
+    s.parser.reset();
+    if (s.fd < 0) {
+        ++g_errors;
+        return;
+    }
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.u32 = id;
+    epoll_ctl(g_epollfd, EPOLL_CTL_ADD, s.fd, &ev);
+}
+
+static void watch(session &s, uint32_t id, bool want_out) {
+    if (s.want_out == want_out)
+        return;
+    s.want_out = want_out;
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (want_out ? EPOLLOUT : 0);
+    ev.data.u32 = id;
+    epoll_ctl(g_epollfd, EPOLL_CTL_MOD, s.fd, &ev);
+}
+
+static void flush(session &s, uint32_t id) {
+    while (s.out_off < s.out.size()) {
+        ssize_t n = send(s.fd, s.out.data() + s.out_off, s.out.size() - s.out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                watch(s, id, true);
+                return;
+            }
+            drop(s);
+            return;
+        }
+        s.out_off += n;
+    }
+    s.out.clear();
+    s.out_off = 0;
+    watch(s, id, false);
+}
+
+static void on_read(session &s) {
+    char buf[65536];
+    while (s.fd >= 0) {
+        ssize_t n = recv(s.fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno != EAGAIN)
+                drop(s);
+            return;
+        }
+        if (n == 0) {
+            if (s.parser.finish_on_close() && !s.inflight.empty()) {
+                uint64_t lat = bench_now_ns() - s.inflight.front().first;
+                g_all.record(lat);
+                stat_of(s.inflight.front().second).hist.record(lat);
+                s.inflight.pop_front();
+            }
+            drop(s);
+            return;
+        }
+        g_bytes += n;
+        int off = 0;
+        while (off < n) {
+            int used = 0;
+            http_resp_parser::RESULT r = s.parser.feed(buf + off, n - off, &used);
+            off += used;
+            if (r == http_resp_parser::RESP_ERROR || (r == http_resp_parser::RESP_DONE && s.inflight.empty())) {
+                drop(s);
+                return;
+            }
+            if (r == http_resp_parser::RESP_DONE) {
+                uint64_t now = bench_now_ns();
+                uint64_t lat = now > s.inflight.front().first ? now - s.inflight.front().first : 0;
+                path_stat &st = stat_of(s.inflight.front().second);
+                st.hist.record(lat);
+                if (s.parser.status() >= 400) {
+                    ++st.errors;
+                    ++g_errors;
+                }
+                g_all.record(lat);
+                s.inflight.pop_front();
+                bool closing = s.parser.close();
+                s.parser.reset();
+                if (closing) {
+                    drop(s);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    int port = 9000;
+    double speed = 1.0;
+    int timeout_ms = 10000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:s:T:h")) != -1) {
+        switch (opt) {
+        case 'a': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 's': speed = atof(optarg); break;
+        case 'T': timeout_ms = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-a host] [-p port] [-s speed] [-T idle_timeout_ms] capture.bin\n"
+                            "  -s 2 replays twice as fast as captured, 0.5 at half speed\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || speed <= 0) {
+        fprintf(stderr, "usage: %s [-a host] [-p port] [-s speed] capture.bin\n", argv[0]);
+        return 1;
+    }
+    if (!bench_resolve(host, port, &g_addr)) {
+        fprintf(stderr, "cannot resolve %s\n", host);
+        return 1;
+    }
+    if (!load(argv[optind]))
+        return 1;
+    signal(SIGPIPE, SIG_IGN);
+
+    uint64_t last_ts = 0;
+    size_t nchunks = 0;
+    for (std::map<uint32_t, session>::iterator it = g_sessions.begin(); it != g_sessions.end(); ++it) {
+        session &s = it->second;
+        s.next = 0;
+        s.fd = -1;
+        s.connected = false;
+        s.out_off = 0;
+        s.want_out = false;
+        nchunks += s.chunks.size();
+        if (s.chunks.back().ts > last_ts)
+            last_ts = s.chunks.back().ts;
+    }
+    printf("replaying %zu connections, %zu reads, %.2f MB, %.1fs captured, speed x%.2f\n",
+           g_sessions.size(), nchunks, g_data.size() / 1048576.0, last_ts / 1e9, speed);
+
+    g_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    uint64_t start = bench_now_ns();
+    uint64_t last_progress = start;
+    epoll_event events[1024];
+    while (true) {
+        uint64_t now = bench_now_ns();
+        bool active = false;
+        for (std::map<uint32_t, session>::iterator it = g_sessions.begin(); it != g_sessions.end(); ++it) {
+            session &s = it->second;
+            if (s.next >= s.chunks.size() && s.inflight.empty()) {
+                if (s.fd >= 0) {
+                    epoll_ctl(g_epollfd, EPOLL_CTL_DEL, s.fd, NULL);
+                    close(s.fd);
+                    s.fd = -1;
+                }
+                continue;
+            }
+            active = true;
+            //上一批请求的响应收齐且到了计划时间，才发送下一段
+            while (s.next < s.chunks.size() && s.inflight.empty()) {
+                const chunk &c = s.chunks[s.next];
+                uint64_t due = start + (uint64_t)(c.ts / speed);
+                if (due > now)
+                    break;
+                if (s.fd < 0)
+                    open_conn(s, it->first);
+                if (s.fd < 0)
+                    break;
+                s.out.append(g_data, c.off, c.len);
+                std::vector<std::string> done;
+                s.scanner.feed(g_data.data() + c.off, c.len, done);
+                for (size_t i = 0; i < done.size(); ++i)
+                    s.inflight.push_back(std::make_pair(due, done[i]));
+                ++s.next;
+            }
+            if (s.fd >= 0 && s.connected && !s.out.empty())
+                flush(s, it->first);
+        }
+        if (!active)
+            break;
+        if (now - last_progress > (uint64_t)timeout_ms * 1000000ULL) {
+            fprintf(stderr, "no progress for %dms, giving up\n", timeout_ms);
+            for (std::map<uint32_t, session>::iterator it = g_sessions.begin(); it != g_sessions.end(); ++it)
+                drop(it->second);
+            break;
+        }
+
+        int n = epoll_wait(g_epollfd, events, 1024, 1);
+        for (int i = 0; i < n; ++i) {
+            uint32_t id = events[i].data.u32;
+            session &s = g_sessions[id];
+            if (s.fd < 0)
+                continue;
+            last_progress = bench_now_ns();
+            if (!s.connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(s.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    drop(s);
+                    continue;
+                }
+                s.connected = true;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                on_read(s);
+            if (s.fd >= 0 && s.connected && (events[i].events & EPOLLOUT))
+                flush(s, id);
+        }
+        if (n > 0)
+            continue;
+        //空闲时只要仍有等待发送的段，就不算超时
+        bool waiting = false;
+        for (std::map<uint32_t, session>::iterator it = g_sessions.begin(); it != g_sessions.end() && !waiting; ++it)
+            waiting = it->second.inflight.empty() && it->second.next < it->second.chunks.size();
+        if (waiting)
+            last_progress = bench_now_ns();
+    }
+    double secs = (bench_now_ns() - start) / 1e9;
+
+    printf("\n%llu responses in %.2fs (%.1f req/s), %.2f MB received, %llu errors\n",
+           (unsigned long long)g_all.count(), secs, g_all.count() / secs, g_bytes / 1048576.0,
+           (unsigned long long)g_errors);
+    bench_print_latency("latency", g_all);
+    for (std::map<std::string, path_stat>::iterator it = g_paths.begin(); it != g_paths.end(); ++it) {
+        char title[96];
+        snprintf(title, sizeof(title), "  %-24s err=%llu", it->first.c_str(), (unsigned long long)it->second.errors);
+        bench_print_latency(title, it->second.hist);
+    }
+    return 0;
+}
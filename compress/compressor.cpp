@@ -0,0 +1,162 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "compressor.h"
+#include "spdlog/spdlog.h"
+
+compressor::compressor() : m_enabled(false), m_min_size(0), m_queue(NULL) {
+}
+
+compressor::~compressor() {
+}
+
+bool compressor::init(const char *cache_dir, int min_size) {
+    if (cache_dir == NULL || cache_dir[0] == '\0')
+        return false;
+    if (mkdir(cache_dir, 0755) < 0 && errno != EEXIST) {
+        spdlog::error("compressor: cannot create {0}", cache_dir);
+        return false;
+    }
+    m_cache_dir = cache_dir;
+    m_min_size = min_size;
+    m_queue = new block_queue<std::string>(1024);
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        delete m_queue;
+        m_queue = NULL;
+        return false;
+    }
+    pthread_detach(m_thread);
+    m_enabled = true;
+    spdlog::info("gzip cache in {0}", cache_dir);
+    return true;
+}
+
+//绝对路径中的/转义为%2F，所有缓存平铺在一个目录下，超出size时返回false
+bool compressor::cache_path(const char *file, char *path, int size) {
+    int n = m_cache_dir.size();
+    if (n + 1 >= size)
+        return false;
+    memcpy(path, m_cache_dir.data(), n);
+    path[n++] = '/';
+    for (const char *p = file; *p; ++p) {
+        const char *esc = *p == '/' ? "%2F" : *p == '%' ? "%25" : NULL;
+        int len = esc ? 3 : 1;
+        if (n + len >= size)
+            return false;
+        if (esc)
+            memcpy(path + n, esc, 3);
+        else
+            path[n] = *p;
+        n += len;
+    }
+    if (n + 4 > size)
+        return false;
+    memcpy(path + n, ".gz", 4);
+    return true;
+}
+
+bool compressor::lookup(const char *file, const struct stat &src, char *path, int size, struct stat &st,
+                        bool *queued) {
+    *queued = false;
+    if (!m_enabled || src.st_size < m_min_size || !cache_path(file, path, size))
+        return false;
+    //缓存文件的修改时间被设为压缩时源文件的修改时间，不相等即过期；源文件换成更旧的版本时同样重新压缩
+    if (stat(path, &st) == 0 && st.st_mtim.tv_sec == src.st_mtim.tv_sec && st.st_mtim.tv_nsec == src.st_mtim.tv_nsec)
+        return true;
+
+    m_lock.lock();
+    *queued = m_pending.insert(file).second;
+    m_lock.unlock();
+    if (*queued && !m_queue->push(file)) {
+        //队列满，下次请求再投递
+        m_lock.lock();
+        m_pending.erase(file);
+        m_lock.unlock();
+    }
+    return false;
+}
+
+bool compressor::gzip(const std::string &in, std::string &out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    //windowBits加16输出gzip格式
+    if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    out.resize(deflateBound(&zs, in.size()) + 32);
+    zs.next_in = (Bytef *)in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef *)&out[0];
+    zs.avail_out = out.size();
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+void *compressor::worker(void *arg) {
+    compressor *self = (compressor *)arg;
+    self->run();
+    return self;
+}
+
+void compressor::run() {
+    std::string file;
+    while (m_queue->pop(file)) {
+        if (!compress_file(file))
+            spdlog::warn("compressor: failed to compress {0}", file);
+        m_lock.lock();
+        m_pending.erase(file);
+        m_lock.unlock();
+    }
+}
+
+bool compressor::compress_file(const std::string &file) {
+    char cache[PATH_MAX];
+    if (!cache_path(file.c_str(), cache, sizeof(cache)))
+        return false;
+    std::string path = cache;
+    std::string tmp = path + ".tmp";
+    FILE *in = fopen(file.c_str(), "rb");
+    if (in == NULL)
+        return false;
+    //读取之前的修改时间，压缩期间源文件被修改时下次查找不相等，会再压缩一次
+    struct stat src;
+    if (fstat(fileno(in), &src) < 0) {
+        fclose(in);
+        return false;
+    }
+    gzFile out = gzopen(tmp.c_str(), "wb9");
+    if (out == NULL) {
+        fclose(in);
+        return false;
+    }
+    char buf[16384];
+    size_t n;
+    bool ok = true;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (gzwrite(out, buf, n) != (int)n) {
+            ok = false;
+            break;
+        }
+    }
+    if (ferror(in))
+        ok = false;
+    fclose(in);
+    if (gzclose(out) != Z_OK)
+        ok = false;
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1] = src.st_mtim;
+    if (ok && utimensat(AT_FDCWD, tmp.c_str(), times, 0) < 0)
+        ok = false;
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef M_COMPRESSOR_H
+#define M_COMPRESSOR_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <string>
+#include <unordered_set>
+#include "../locker.h"
+#include "../log/block_queue.h"
+
+//后台gzip压缩静态文件，结果缓存在m_cache_dir中
+//工作线程只查找缓存，未命中时投递压缩任务，本次请求仍发送原文件
+
+class compressor {
+public:
+    static compressor *get_instance() {
+        static compressor instance;
+        return &instance;
+    }
+
+    //cache_dir为空时关闭，小于min_size的文件不压缩
+    bool init(const char *cache_dir, int min_size = 256);
+    bool enabled() const { return m_enabled; }
+
+    //查找与源文件修改时间一致的压缩缓存，命中时写入path(size字节)和st，不分配内存
+    //未命中时投递后台压缩并返回false，queued表示本次投递了新任务
+    bool lookup(const char *file, const struct stat &src, char *path, int size, struct stat &st, bool *queued);
+
+    //内存中gzip压缩，用于启动时生成固定响应
+    static bool gzip(const std::string &in, std::string &out);
+
+private:
+    compressor();
+    ~compressor();
+
+    static void *worker(void *arg);
+    void run();
+    //压缩到临时文件后rename，读者不会看到写了一半的文件
+    bool compress_file(const std::string &file);
+    bool cache_path(const char *file, char *path, int size);
+
+    bool m_enabled;
+    int m_min_size;
+    std::string m_cache_dir;
+    pthread_t m_thread;
+    block_queue<std::string> *m_queue;
+    //已投递尚未完成的文件，避免重复压缩
+    std::unordered_set<std::string> m_pending;
+    locker m_lock;
+};
+
+#endif
@@ -1,42 +1,339 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <thread>
 #include "configure.h"
 
 Config::Config(){
     //端口号,默认9000
     PORT = 9000;
 
+    //redis地址,默认127.0.0.1:6379
+    redis_host = "127.0.0.1";
+    redis_port = 6379;
+
     //数据库连接池数量,默认8
     redis_num = 8;
 
     //线程池内的线程数量,根据硬件确定
     thread_num = std::thread::hardware_concurrency();
+
+    //请求队列长度,默认10000
+    max_requests = 10000;
+
+    //慢请求阈值(微秒)，-1关闭请求打点，0只统计直方图，默认0
+    trace_slow_us = 0;
+
+    //慢请求日志采样率，每n个打印一次，默认1
+    trace_sample = 1;
+
+    //抓包文件，默认不抓包
+    capture_file = "";
+
+    //抓包采样率，每n个连接抓1个，默认1
+    capture_rate = 1;
+
+    //后台gzip压缩缓存目录，为空时关闭，默认./gzip_cache
+    gzip_cache = "./gzip_cache";
+
+    //请求体上限(字节)，默认8MB
+    max_body_size = 8 << 20;
+    //请求体临时文件目录，默认/tmp
+    spool_dir = "/tmp";
+
+    //以/结尾的目录请求返回目录列表，默认关闭
+    autoindex = false;
+
+    //HTTPS端口，0为关闭，默认0
+    tls_port = 0;
+
+    //证书链和私钥，默认 ./server.crt ./server.key
+    tls_cert = "./server.crt";
+    tls_key = "./server.key";
+
+    //TLS会话缓存条目数,默认20480
+    tls_session_cache = 20480;
+
+    //反向代理每个后端的空闲连接数,默认32
+    proxy_idle = 32;
+
+    //最大连接数,默认65536；每次epoll_wait最多10000个事件
+    max_fd = 65536;
+    max_events = 10000;
+
+    //定时器5秒一次，连接空闲15秒关闭
+    timeslot = 5;
+    idle_timeout = 15;
+    //请求头10秒内收完，消息体20秒且每500字节多给1秒，长连接最多1000个请求
+    header_timeout = 10;
+    body_timeout = 20;
+    body_min_rate = 500;
+    keepalive_requests = 1000;
+
+    //listen的backlog,默认1024，整点大量客户端同时重连时不丢SYN
+    backlog = 1024;
+    //连接上有数据后才accept，最多等5秒；不开启TCP Fast Open
+    defer_accept = 5;
+    fastopen = 0;
+    //每次最多accept 64个连接，之后先处理其他事件
+    accept_batch = 64;
+
+    //socket缓冲区,默认由内核自动调整
+    sndbuf = 0;
+    rcvbuf = 0;
+
+    //日志级别,默认info
+    log_level = "info";
+
+    //连接数不超过max_fd；排队时延持续100ms超过5ms时开始拒绝
+    max_conns = 0;
+    queue_target = 5;
+    queue_interval = 100;
+
+    //默认不限流，压测工具都从同一个IP发起
+    conn_rate = 0;
+    conn_burst = 0;
+    req_rate = 0;
+    req_burst = 0;
+    login_rate = 0;
+    login_burst = 0;
+
+    //平滑升级时旧进程最多等待30秒
+    drain_timeout = 30;
+
+    m_argc = 0;
+    m_argv = NULL;
+}
+
+//整数配置项，整个值都必须是数字
+static bool to_int(const string &value, long long *out) {
+    char *end;
+    errno = 0;
+    *out = strtoll(value.c_str(), &end, 10);
+    return !value.empty() && *end == '\0' && errno == 0;
 }
 
-void Config::parse_arg(int argc, char*argv[]){
+static string trim(const string &s) {
+    size_t first = s.find_first_not_of(" \t\r");
+    if (first == string::npos)
+        return "";
+    return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+}
+
+bool Config::set(const string &key, const string &value) {
+    //整数项，写入对应的成员
+    struct int_option {
+        const char *key;
+        int *value;
+        int min;
+    };
+    const int_option ints[] = {
+        {"port", &PORT, 1},
+        {"redis_port", &redis_port, 1},
+        {"redis_num", &redis_num, 1},
+        {"thread_num", &thread_num, 1},
+        {"max_requests", &max_requests, 1},
+        {"trace_slow_us", &trace_slow_us, -1},
+        {"trace_sample", &trace_sample, 1},
+        {"capture_rate", &capture_rate, 1},
+        {"tls_port", &tls_port, 0},
+        {"tls_session_cache", &tls_session_cache, 0},
+        {"proxy_idle", &proxy_idle, 0},
+        {"max_fd", &max_fd, 16},
+        {"max_events", &max_events, 1},
+        {"timeslot", &timeslot, 1},
+        {"idle_timeout", &idle_timeout, 1},
+        {"header_timeout", &header_timeout, 0},
+        {"body_timeout", &body_timeout, 0},
+        {"body_min_rate", &body_min_rate, 0},
+        {"keepalive_requests", &keepalive_requests, 0},
+        {"backlog", &backlog, 1},
+        {"defer_accept", &defer_accept, 0},
+        {"fastopen", &fastopen, 0},
+        {"accept_batch", &accept_batch, 0},
+        {"sndbuf", &sndbuf, 0},
+        {"rcvbuf", &rcvbuf, 0},
+        {"drain_timeout", &drain_timeout, 0},
+        {"max_conns", &max_conns, 0},
+        {"queue_target", &queue_target, 0},
+        {"queue_interval", &queue_interval, 1},
+        {"conn_rate", &conn_rate, 0},
+        {"conn_burst", &conn_burst, 0},
+        {"req_rate", &req_rate, 0},
+        {"req_burst", &req_burst, 0},
+        {"login_rate", &login_rate, 0},
+        {"login_burst", &login_burst, 0},
+    };
+    for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); ++i) {
+        if (key != ints[i].key)
+            continue;
+        long long v;
+        if (!to_int(value, &v) || v < ints[i].min || v > INT_MAX)
+            return false;
+        *ints[i].value = v;
+        return true;
+    }
+    long long v;
+    if (key == "max_body_size") {
+        if (!to_int(value, &v) || v < 0)
+            return false;
+        max_body_size = v;
+    }
+    else if (key == "autoindex") {
+        if (value != "on" && value != "off")
+            return false;
+        autoindex = value == "on";
+    }
+    else if (key == "redis_host")
+        redis_host = value;
+    else if (key == "capture_file")
+        capture_file = value;
+    else if (key == "gzip_cache")
+        gzip_cache = value;
+    else if (key == "spool_dir") {
+        if (value.empty())
+            return false;
+        spool_dir = value;
+    }
+    else if (key == "tls_cert")
+        tls_cert = value;
+    else if (key == "tls_key")
+        tls_key = value;
+    else if (key == "log_level")
+        log_level = value;
+    else if (key == "cache_control")
+        cache_rules.push_back(value);
+    else if (key == "proxy")
+        proxy_rules.push_back(value);
+    else
+        return false;
+    return true;
+}
+
+bool Config::load_file(const string &path) {
+    std::ifstream in(path.c_str());
+    if (!in) {
+        fprintf(stderr, "cannot open config file %s\n", path.c_str());
+        return false;
+    }
+    config_file = path;
+    string line;
+    bool ok = true;
+    for (int lineno = 1; std::getline(in, line); ++lineno) {
+        size_t hash = line.find('#');
+        if (hash != string::npos)
+            line.resize(hash);
+        if (trim(line).empty())
+            continue;
+        string key, value;
+        size_t eq = line.find('=');
+        if (eq != string::npos) {
+            key = trim(line.substr(0, eq));
+            value = trim(line.substr(eq + 1));
+        }
+        if (key.empty() || value.empty() || !set(key, value)) {
+            fprintf(stderr, "%s:%d: invalid line\n", path.c_str(), lineno);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool Config::reload(Config &next) const {
+    return next.parse_arg(m_argc, m_argv);
+}
+
+bool Config::parse_arg(int argc, char*argv[]){
+    m_argc = argc;
+    m_argv = argv;
     int opt;
+    bool ok = true;
     // 单个字符后接一个冒号：表示该选项后必须跟一个参数
-    const char *str = "p:s:t";
+    const char *str = "p:s:t:l:n:c:C:e:z:b:iS:K:k:P:f:";
+    //先读取配置文件，命令行中的其他选项再覆盖它
+    optind = 1;
+    opterr = 0;
+    while ((opt = getopt(argc, argv, str)) != -1) {
+        if (opt == 'f' && !load_file(optarg))
+            ok = false;
+    }
+    optind = 1;
+    opterr = 1;
+    //数值选项与配置文件中的同名项一样检查范围
+    struct int_flag {
+        int opt;
+        const char *key;
+    };
+    const int_flag int_flags[] = {
+        {'p', "port"},
+        {'s', "redis_num"},
+        {'t', "thread_num"},
+        {'l', "trace_slow_us"},
+        {'n', "trace_sample"},
+        {'C', "capture_rate"},
+        {'b', "max_body_size"},
+        {'S', "tls_port"},
+    };
     // getopt()用来分析命令行参数 参数argc和argv分别代表参数个数和内容
     while ((opt = getopt(argc, argv, str)) != -1)
     {
+        size_t i = 0;
+        while (i < sizeof(int_flags) / sizeof(int_flags[0]) && int_flags[i].opt != opt)
+            ++i;
+        if (i < sizeof(int_flags) / sizeof(int_flags[0])) {
+            if (!set(int_flags[i].key, optarg)) {
+                fprintf(stderr, "invalid value for -%c: %s\n", opt, optarg);
+                ok = false;
+            }
+            continue;
+        }
         switch (opt)
         {
-        case 'p':
+        case 'c':
         {
-            PORT = atoi(optarg);
+            capture_file = optarg;
             break;
         }
-        case 's':
+        case 'e':
         {
-            redis_num = atoi(optarg);
+            cache_rules.push_back(optarg);
             break;
         }
-        case 't':
+        case 'z':
         {
-            thread_num = atoi(optarg);
+            gzip_cache = optarg;
             break;
         }
+        case 'i':
+        {
+            autoindex = true;
+            break;
+        }
+        case 'K':
+        {
+            tls_cert = optarg;
+            break;
+        }
+        case 'k':
+        {
+            tls_key = optarg;
+            break;
+        }
+        case 'P':
+        {
+            proxy_rules.push_back(optarg);
+            break;
+        }
+        case 'f':
+            break;
+        //未知选项或缺少参数，getopt已打印错误
         default:
+            ok = false;
             break;
         }
     }
+    return ok;
 }
\ No newline at end of file
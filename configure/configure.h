@@ -1,26 +1,126 @@
 #ifndef M_CONFIG_H
 #define M_CONFIG_H
 
-#include "../webserver/webserver.h"
+#include <string>
+#include <vector>
 
 using namespace std;
 
+//配置依次来自默认值、-f指定的配置文件和命令行，后者覆盖前者
+//配置文件每行一个 key = value，#开始注释，cache_control和proxy可以出现多次
 class Config
 {
 public:
     Config();
     ~Config(){};
 
-    void parse_arg(int argc, char*argv[]);
+    //解析失败(配置文件打不开或有无效的行)时返回false
+    bool parse_arg(int argc, char*argv[]);
+    //SIGHUP时重新读取配置文件并再次应用命令行
+    bool reload(Config &next) const;
 
     //端口号
     int PORT;
 
-    //数据库连接池数量
+    //redis地址和连接池数量
+    string redis_host;
+    int redis_port;
     int redis_num;
 
-    //线程池内的线程数量
+    //线程池内的线程数量和请求队列长度
     int thread_num;
+    int max_requests;
+
+    //慢请求阈值(微秒)
+    int trace_slow_us;
+
+    //慢请求日志采样率
+    int trace_sample;
+
+    //抓包文件
+    string capture_file;
+
+    //抓包采样率
+    int capture_rate;
+
+    //按路径前缀的Cache-Control，可多次指定 -e /prefix=value
+    vector<string> cache_rules;
+
+    //gzip压缩缓存目录
+    string gzip_cache;
+
+    //请求体上限
+    long long max_body_size;
+    //超出读缓冲区的请求体写入该目录下的临时文件
+    string spool_dir;
+
+    //目录列表
+    bool autoindex;
+
+    //HTTPS端口、证书链和私钥(PEM)
+    int tls_port;
+    string tls_cert;
+    string tls_key;
+    //TLS会话缓存的条目数
+    int tls_session_cache;
+
+    //反向代理，可多次指定 -P /prefix=host:port,host:port[;lc]
+    vector<string> proxy_rules;
+    //每个后端保留的空闲连接数
+    int proxy_idle;
+
+    //最大连接数和每次epoll_wait的最大事件数
+    int max_fd;
+    int max_events;
+    //定时器的最小单位(秒)和连接的空闲超时(秒)
+    int timeslot;
+    int idle_timeout;
+    //请求头的截止时间(秒)，消息体的截止时间(秒)和最低速率(字节/秒)，长连接最多处理的请求数，0为不限
+    int header_timeout;
+    int body_timeout;
+    int body_min_rate;
+    int keepalive_requests;
+    //listen的backlog，受net.core.somaxconn限制
+    int backlog;
+    //TCP_DEFER_ACCEPT等待首个数据的秒数和TCP_FASTOPEN的队列长度，0为关闭
+    int defer_accept;
+    int fastopen;
+    //每个监听事件最多accept的连接数，0为不限
+    int accept_batch;
+    //新连接的SO_SNDBUF/SO_RCVBUF，0为系统默认
+    int sndbuf;
+    int rcvbuf;
+
+    //spdlog日志级别 trace/debug/info/warn/err/critical/off
+    string log_level;
+
+    //过载保护：连接数上限(0为max_fd)，排队时延的目标值和判断窗口(毫秒)，目标值为0时不按时延拒绝
+    int max_conns;
+    int queue_target;
+    int queue_interval;
+
+    //按客户端IP限流：新连接、请求、登录注册每秒的个数和可积攒的个数(0时等于每秒个数)，每秒个数为0时不限流
+    int conn_rate;
+    int conn_burst;
+    int req_rate;
+    int req_burst;
+    int login_rate;
+    int login_burst;
+
+    //平滑升级时旧进程等待已有连接结束的最长秒数
+    int drain_timeout;
+
+    //配置文件，未指定时为空
+    string config_file;
+    //启动时的命令行，平滑升级时原样传给新进程
+    char **argv() const { return m_argv; }
+
+private:
+    bool load_file(const string &path);
+    bool set(const string &key, const string &value);
+
+    int m_argc;
+    char **m_argv;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,114 @@
+#include <string.h>
+#include "body_reader.h"
+
+void body_reader::reset() {
+    m_status = BODY_MORE;
+    m_chunked = false;
+    m_state = CHUNK_SIZE;
+    m_left = 0;
+    m_total = 0;
+    m_max_size = 0;
+}
+
+void body_reader::start_length(long long length) {
+    reset();
+    m_left = length;
+    m_max_size = length;
+    if (length == 0)
+        m_status = BODY_DONE;
+}
+
+void body_reader::start_chunked(long long max_size) {
+    reset();
+    m_chunked = true;
+    m_max_size = max_size;
+}
+
+void body_reader::skip(long long n) {
+    m_left -= n;
+    m_total += n;
+    if (!m_chunked && m_left == 0)
+        m_status = BODY_DONE;
+}
+
+//1a;ext=1\r\n，忽略扩展
+int body_reader::parse_size_line(char *data, int len) {
+    char *eol = (char *)memchr(data, '\n', len);
+    if (!eol)
+        return len >= MAX_LINE ? fail(BODY_BAD) : 0;
+    long long size = 0;
+    int digits = 0;
+    for (char *p = data; p < eol; ++p, ++digits) {
+        int v;
+        if (*p >= '0' && *p <= '9')
+            v = *p - '0';
+        else if (*p >= 'a' && *p <= 'f')
+            v = *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'F')
+            v = *p - 'A' + 10;
+        else
+            break;
+        //防止溢出，超过上限的分块不会被接受
+        if (size > (m_max_size >> 4))
+            return fail(BODY_TOO_LARGE);
+        size = size * 16 + v;
+    }
+    char next = data[digits];
+    if (digits == 0 || (next != ';' && next != ' ' && next != '\t' && next != '\r' && next != '\n'))
+        return fail(BODY_BAD);
+    if (m_total + size > m_max_size)
+        return fail(BODY_TOO_LARGE);
+    m_left = size;
+    m_state = size == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+    return eol - data + 1;
+}
+
+int body_reader::decode(char *data, int len, char **payload, int *payload_len) {
+    *payload = data;
+    *payload_len = 0;
+    if (m_status != BODY_MORE)
+        return m_status == BODY_DONE ? 0 : -1;
+    if (len <= 0)
+        return 0;
+
+    if (!m_chunked || m_state == CHUNK_DATA) {
+        int n = m_left < len ? (int)m_left : len;
+        *payload_len = n;
+        skip(n);
+        if (m_chunked && m_left == 0)
+            m_state = CHUNK_DATA_END;
+        return n;
+    }
+
+    switch (m_state) {
+    case CHUNK_SIZE:
+        return parse_size_line(data, len);
+    case CHUNK_DATA_END:
+    {
+        if (data[0] == '\n') {
+            m_state = CHUNK_SIZE;
+            return 1;
+        }
+        if (data[0] != '\r')
+            return fail(BODY_BAD);
+        if (len < 2)
+            return 0;
+        if (data[1] != '\n')
+            return fail(BODY_BAD);
+        m_state = CHUNK_SIZE;
+        return 2;
+    }
+    case CHUNK_TRAILER:
+    {
+        //trailer中的头部直接丢弃，空行表示结束
+        char *eol = (char *)memchr(data, '\n', len);
+        if (!eol)
+            return len >= MAX_LINE ? fail(BODY_BAD) : 0;
+        if (eol == data || (eol == data + 1 && data[0] == '\r'))
+            m_status = BODY_DONE;
+        return eol - data + 1;
+    }
+    default:
+        return fail(BODY_BAD);
+    }
+}
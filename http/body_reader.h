@@ -0,0 +1,60 @@
+#ifndef M_BODY_READER_H
+#define M_BODY_READER_H
+
+//请求体的分帧解码：Content-Length或Transfer-Encoding: chunked
+//每次只处理缓冲区中已有的数据，解出的消息体指向输入缓冲区，不分配内存
+class body_reader {
+public:
+    enum STATUS {
+        BODY_MORE = 0,   //还需要更多数据
+        BODY_DONE,       //消息体结束
+        BODY_BAD,        //分帧格式错误
+        BODY_TOO_LARGE   //超过上限
+    };
+
+    body_reader() { reset(); }
+    void reset();
+    void start_length(long long length);
+    void start_chunked(long long max_size);
+
+    //解码data中的数据，返回消耗的字节数，出错返回-1
+    //*payload和*payload_len为其中属于消息体的部分(指向data内，可能为0字节)
+    //返回0表示data中没有完整的分块头，需要继续读取
+    int decode(char *data, int len, char **payload, int *payload_len);
+
+    STATUS status() const { return m_status; }
+    bool done() const { return m_status == BODY_DONE; }
+    bool chunked() const { return m_chunked; }
+    //Content-Length方式下剩余的字节数，这部分可以不经过decode直接splice
+    long long remaining() const { return m_chunked ? 0 : m_left; }
+    //绕过decode消耗了n字节
+    void skip(long long n);
+    //已解码的消息体长度
+    long long total() const { return m_total; }
+
+private:
+    enum CHUNK_STATE {
+        CHUNK_SIZE,      //分块大小行
+        CHUNK_DATA,      //分块数据
+        CHUNK_DATA_END,  //分块数据后的CRLF
+        CHUNK_TRAILER    //0长度分块后的trailer，直到空行
+    };
+    //分块大小行和trailer行的最大长度
+    static const int MAX_LINE = 1024;
+
+    int parse_size_line(char *data, int len);
+    int fail(STATUS status) {
+        m_status = status;
+        return -1;
+    }
+
+    STATUS m_status;
+    bool m_chunked;
+    CHUNK_STATE m_state;
+    //当前分块或Content-Length剩余的字节数
+    long long m_left;
+    long long m_total;
+    long long m_max_size;
+};
+
+#endif
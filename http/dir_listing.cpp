@@ -0,0 +1,98 @@
+#include <string.h>
+#include "dir_listing.h"
+
+dir_listing::dir_listing(DIR *dir, const char *path, int path_len)
+    : m_dir(dir), m_path(path), m_path_len(path_len), m_state(DL_HEAD), m_line_len(0), m_line_sent(0) {}
+
+dir_listing::~dir_listing() {
+    if (m_dir)
+        closedir(m_dir);
+}
+
+int dir_listing::produce(char *buf, int size) {
+    if (m_line_sent == m_line_len) {
+        m_line_len = m_line_sent = 0;
+        if (!next_line())
+            return STREAM_END;
+    }
+    int len = m_line_len - m_line_sent;
+    if (len > size)
+        return STREAM_FULL;
+    memcpy(buf, m_line + m_line_sent, len);
+    m_line_sent = m_line_len;
+    return len;
+}
+
+bool dir_listing::next_line() {
+    switch (m_state) {
+    case DL_HEAD:
+        append("<html><head><meta charset=\"utf-8\"><title>Index of ", -1);
+        append_html(m_path, m_path_len);
+        append("</title></head><body><h1>Index of ", -1);
+        append_html(m_path, m_path_len);
+        append("</h1><ul>\n", -1);
+        m_state = DL_ENTRIES;
+        return true;
+    case DL_ENTRIES:
+    {
+        struct dirent *ent;
+        while ((ent = readdir(m_dir)) != NULL) {
+            //隐藏文件和当前目录不列出
+            if (ent->d_name[0] == '.' && strcmp(ent->d_name, "..") != 0)
+                continue;
+            int len = strlen(ent->d_name);
+            bool is_dir = ent->d_type == DT_DIR;
+            append("<li><a href=\"", -1);
+            append_url(ent->d_name, len);
+            append(is_dir ? "/\">" : "\">", -1);
+            append_html(ent->d_name, len);
+            append(is_dir ? "/</a></li>\n" : "</a></li>\n", -1);
+            return true;
+        }
+        m_state = DL_TAIL;
+    }
+    //fall through
+    case DL_TAIL:
+        append("</ul></body></html>\n", -1);
+        m_state = DL_DONE;
+        return true;
+    default:
+        return false;
+    }
+}
+
+//超出m_line的部分截断，文件名最长255字节，转义后不会超出
+void dir_listing::append(const char *s, int len) {
+    if (len < 0)
+        len = strlen(s);
+    if (len > (int)sizeof(m_line) - m_line_len)
+        len = sizeof(m_line) - m_line_len;
+    memcpy(m_line + m_line_len, s, len);
+    m_line_len += len;
+}
+
+void dir_listing::append_html(const char *s, int len) {
+    for (int i = 0; i < len; ++i) {
+        switch (s[i]) {
+        case '&': append("&amp;", 5); break;
+        case '<': append("&lt;", 4); break;
+        case '>': append("&gt;", 4); break;
+        case '"': append("&quot;", 6); break;
+        default: append(s + i, 1); break;
+        }
+    }
+}
+
+void dir_listing::append_url(const char *s, int len) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (int i = 0; i < len; ++i) {
+        unsigned char c = s[i];
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("-_.~", c)) {
+            append(s + i, 1);
+        }
+        else {
+            char esc[3] = {'%', hex[c >> 4], hex[c & 15]};
+            append(esc, 3);
+        }
+    }
+}
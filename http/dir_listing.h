@@ -0,0 +1,35 @@
+#ifndef M_DIR_LISTING_H
+#define M_DIR_LISTING_H
+
+#include <dirent.h>
+#include "response_stream.h"
+
+//目录列表页，每次produce读取若干目录项，目录再大也只占一行的缓冲
+class dir_listing : public response_stream {
+public:
+    //dir由调用者opendir，析构时关闭；path为请求路径，用于标题
+    dir_listing(DIR *dir, const char *path, int path_len);
+    ~dir_listing();
+    int produce(char *buf, int size);
+
+private:
+    //生成下一行到m_line，没有更多内容时返回false
+    bool next_line();
+    void append(const char *s, int len);
+    //HTML转义和URL百分号编码
+    void append_html(const char *s, int len);
+    void append_url(const char *s, int len);
+
+    enum STATE { DL_HEAD, DL_ENTRIES, DL_TAIL, DL_DONE };
+
+    DIR *m_dir;
+    const char *m_path;
+    int m_path_len;
+    STATE m_state;
+    //放不进上一次缓冲区的行，留到下一次
+    char m_line[4096];
+    int m_line_len;
+    int m_line_sent;
+};
+
+#endif
@@ -0,0 +1,625 @@
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "h2_session.h"
+#include "http_conn.h"
+
+const char h2_session::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+//帧标志
+static const uint8_t FLAG_END_STREAM = 0x1;
+static const uint8_t FLAG_ACK = 0x1;
+static const uint8_t FLAG_END_HEADERS = 0x4;
+static const uint8_t FLAG_PADDED = 0x8;
+static const uint8_t FLAG_PRIORITY = 0x20;
+
+//一个头部块的上限，超出视为攻击
+static const size_t MAX_HEADER_BLOCK = 65536;
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_u32(std::string &out, uint32_t v) {
+    out.push_back((char)(v >> 24));
+    out.push_back((char)(v >> 16));
+    out.push_back((char)(v >> 8));
+    out.push_back((char)v);
+}
+
+//HTTP2-Settings使用不带填充的base64url
+static bool base64url_decode(const char *s, std::string &out) {
+    uint32_t acc = 0;
+    int bits = 0;
+    for (; *s && *s != '='; ++s) {
+        int v;
+        char c = *s;
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if (c == '-' || c == '+')
+            v = 62;
+        else if (c == '_' || c == '/')
+            v = 63;
+        else
+            return false;
+        acc = acc << 6 | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    return true;
+}
+
+h2_stream::h2_stream(uint32_t stream_id, int32_t window)
+    : id(stream_id), remote_closed(false), body_too_large(false), recv_window(65535), seg_idx(0), seg_off(0),
+      body_left(0), map_addr(NULL), map_len(0), send_window(window), responded(false), headers_sent(false),
+      end_sent(false), reset(false) {}
+
+h2_stream::~h2_stream() {
+    if (map_addr)
+        munmap(map_addr, map_len);
+}
+
+void h2_stream::add_body(const char *data, size_t len, bool stable) {
+    if (len == 0)
+        return;
+    segment seg;
+    if (stable) {
+        seg.ext = data;
+        seg.off = 0;
+    }
+    else {
+        seg.ext = NULL;
+        seg.off = copy.size();
+        copy.append(data, len);
+    }
+    seg.len = len;
+    segments.push_back(seg);
+    body_left += len;
+}
+
+h2_session::h2_session(http_conn *conn, bool preface_received)
+    : m_conn(conn), m_in_start(0), m_in_end(0), m_preface_received(preface_received), m_last_stream_id(0),
+      m_continuation_id(0), m_block_end_stream(false), m_block_refused(false), m_peer_max_frame(16384),
+      m_peer_initial_window(65535), m_send_window(65535), m_batch_covered(0), m_iov_idx(0),
+      m_goaway_sent(false), m_peer_goaway(false) {}
+
+h2_session::~h2_session() {
+    for (std::map<uint32_t, h2_stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+        delete it->second;
+}
+
+void h2_session::queue_raw(const char *data, size_t len) {
+    m_ctrl.append(data, len);
+}
+
+void h2_session::start() {
+    //只通告并发流数，其余使用默认值
+    write_frame_header(m_ctrl, 6, F_SETTINGS, 0, 0);
+    m_ctrl.push_back(0);
+    m_ctrl.push_back(3);
+    put_u32(m_ctrl, MAX_STREAMS);
+}
+
+//101响应即为确认，不回复SETTINGS ACK
+bool h2_session::apply_upgrade_settings(const char *b64) {
+    std::string payload;
+    if (!base64url_decode(b64, payload))
+        return false;
+    return on_settings(0, (const uint8_t *)payload.data(), payload.size(), false);
+}
+
+void h2_session::upgrade_stream(const std::string &headers) {
+    h2_stream *s = new h2_stream(1, m_peer_initial_window);
+    s->headers = headers;
+    s->remote_closed = true;
+    m_streams[1] = s;
+    m_last_stream_id = 1;
+    dispatch(s);
+}
+
+bool h2_session::feed(const char *data, size_t len) {
+    if (m_in_start > 0) {
+        memmove(m_in, m_in + m_in_start, m_in_end - m_in_start);
+        m_in_end -= m_in_start;
+        m_in_start = 0;
+    }
+    if (len > INPUT_BUFFER_SIZE - m_in_end)
+        return false;
+    memcpy(m_in + m_in_end, data, len);
+    m_in_end += len;
+    return true;
+}
+
+bool h2_session::read(int fd) {
+    if (m_in_start > 0) {
+        memmove(m_in, m_in + m_in_start, m_in_end - m_in_start);
+        m_in_end -= m_in_start;
+        m_in_start = 0;
+    }
+    //缓冲区满时先处理，重新注册EPOLLIN后继续读
+    while (m_in_end < INPUT_BUFFER_SIZE) {
+        ssize_t n = recv(fd, m_in + m_in_end, INPUT_BUFFER_SIZE - m_in_end, 0);
+        if (n > 0) {
+            m_in_end += n;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (n < 0 && errno == EINTR)
+            continue;
+        return false;
+    }
+    return true;
+}
+
+bool h2_session::process() {
+    while (!m_goaway_sent) {
+        size_t avail = m_in_end - m_in_start;
+        const uint8_t *p = (const uint8_t *)m_in + m_in_start;
+        if (!m_preface_received) {
+            //不是HTTP/2客户端，直接关闭
+            if (memcmp(p, PREFACE, avail < PREFACE_LEN ? avail : PREFACE_LEN) != 0)
+                return false;
+            if (avail < PREFACE_LEN)
+                break;
+            m_in_start += PREFACE_LEN;
+            m_preface_received = true;
+            continue;
+        }
+        if (avail < 9)
+            break;
+        uint32_t len = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+        if (len > MAX_FRAME_SIZE) {
+            goaway(E_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (avail < 9 + len)
+            break;
+        m_in_start += 9 + len;
+        if (!on_frame(p[3], p[4], get_u32(p + 5) & 0x7fffffff, p + 9, len))
+            break;
+    }
+    if (m_in_start == m_in_end)
+        m_in_start = m_in_end = 0;
+    return true;
+}
+
+bool h2_session::on_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len) {
+    //头部块未结束时只能收到同一个流的CONTINUATION
+    if (m_continuation_id && (type != F_CONTINUATION || stream_id != m_continuation_id))
+        return goaway(E_PROTOCOL_ERROR);
+
+    switch (type) {
+    case F_DATA:
+        return on_data(flags, stream_id, payload, len);
+    case F_HEADERS:
+    case F_CONTINUATION:
+        return on_headers(type, flags, stream_id, payload, len);
+    case F_PRIORITY:
+        //不支持优先级，按顺序轮流发送
+        if (!stream_id)
+            return goaway(E_PROTOCOL_ERROR);
+        if (len != 5)
+            rst_stream(stream_id, E_FRAME_SIZE_ERROR);
+        return true;
+    case F_RST_STREAM:
+    {
+        if (!stream_id || stream_id > m_last_stream_id)
+            return goaway(E_PROTOCOL_ERROR);
+        if (len != 4)
+            return goaway(E_FRAME_SIZE_ERROR);
+        std::map<uint32_t, h2_stream *>::iterator it = m_streams.find(stream_id);
+        if (it != m_streams.end())
+            close_stream(it->second);
+        return true;
+    }
+    case F_SETTINGS:
+        if (stream_id)
+            return goaway(E_PROTOCOL_ERROR);
+        return on_settings(flags, payload, len, true);
+    case F_PUSH_PROMISE:
+        return goaway(E_PROTOCOL_ERROR);
+    case F_PING:
+        if (stream_id)
+            return goaway(E_PROTOCOL_ERROR);
+        if (len != 8)
+            return goaway(E_FRAME_SIZE_ERROR);
+        if (!(flags & FLAG_ACK)) {
+            write_frame_header(m_ctrl, 8, F_PING, FLAG_ACK, 0);
+            m_ctrl.append((const char *)payload, 8);
+        }
+        return true;
+    case F_GOAWAY:
+        if (stream_id)
+            return goaway(E_PROTOCOL_ERROR);
+        m_peer_goaway = true;
+        return true;
+    case F_WINDOW_UPDATE:
+        return on_window_update(stream_id, payload, len);
+    default:
+        //未知类型忽略
+        return true;
+    }
+}
+
+bool h2_session::on_data(uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len) {
+    if (!stream_id)
+        return goaway(E_PROTOCOL_ERROR);
+    //流量控制按整个帧计算，包括填充；连接窗口立即补回
+    uint32_t frame_len = len;
+    if (frame_len)
+        window_update(0, frame_len);
+    if (flags & FLAG_PADDED) {
+        if (len < 1 || payload[0] >= len)
+            return goaway(E_PROTOCOL_ERROR);
+        len -= payload[0] + 1;
+        ++payload;
+    }
+
+    std::map<uint32_t, h2_stream *>::iterator it = m_streams.find(stream_id);
+    if (it == m_streams.end() || it->second->remote_closed || it->second->reset) {
+        if (stream_id > m_last_stream_id)
+            return goaway(E_PROTOCOL_ERROR);
+        rst_stream(stream_id, E_STREAM_CLOSED);
+        return true;
+    }
+    h2_stream *s = it->second;
+    s->recv_window -= frame_len;
+    if (s->recv_window < 0) {
+        rst_stream(stream_id, E_FLOW_CONTROL_ERROR);
+        close_stream(s);
+        return true;
+    }
+    //超过上限的请求体不再保存，处理时返回413
+    if (s->body_too_large || s->body.size() + len > MAX_BODY)
+        s->body_too_large = true;
+    else
+        s->body.append((const char *)payload, len);
+
+    if (flags & FLAG_END_STREAM) {
+        s->remote_closed = true;
+        dispatch(s);
+    }
+    else if (frame_len) {
+        window_update(stream_id, frame_len);
+        s->recv_window += frame_len;
+    }
+    return true;
+}
+
+bool h2_session::on_headers(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len) {
+    if (!stream_id)
+        return goaway(E_PROTOCOL_ERROR);
+    if (type == F_HEADERS) {
+        uint32_t off = 0, pad = 0;
+        if (flags & FLAG_PADDED) {
+            if (len < 1)
+                return goaway(E_PROTOCOL_ERROR);
+            pad = payload[0];
+            off = 1;
+        }
+        if (flags & FLAG_PRIORITY)
+            off += 5;
+        if (off + pad > len)
+            return goaway(E_PROTOCOL_ERROR);
+
+        std::map<uint32_t, h2_stream *>::iterator it = m_streams.find(stream_id);
+        if (it != m_streams.end()) {
+            //已有的流上只能是带END_STREAM的trailer
+            h2_stream *s = it->second;
+            if (s->remote_closed || !(flags & FLAG_END_STREAM))
+                return goaway(E_PROTOCOL_ERROR);
+            m_block_refused = false;
+        }
+        else {
+            if ((stream_id & 1) == 0 || stream_id <= m_last_stream_id)
+                return goaway(E_PROTOCOL_ERROR);
+            m_last_stream_id = stream_id;
+            m_streams[stream_id] = new h2_stream(stream_id, m_peer_initial_window);
+            //并发流过多时拒绝，头部块仍须解码以保持HPACK状态一致
+            m_block_refused = m_streams.size() - m_sent.size() > MAX_STREAMS;
+        }
+        m_block.assign((const char *)payload + off, len - off - pad);
+        m_block_end_stream = flags & FLAG_END_STREAM;
+    }
+    else {
+        //CONTINUATION只能紧跟在未结束的头部块之后
+        if (stream_id != m_continuation_id)
+            return goaway(E_PROTOCOL_ERROR);
+        m_block.append((const char *)payload, len);
+    }
+    if (m_block.size() > MAX_HEADER_BLOCK)
+        return goaway(E_ENHANCE_YOUR_CALM);
+    if (!(flags & FLAG_END_HEADERS)) {
+        m_continuation_id = stream_id;
+        return true;
+    }
+    m_continuation_id = 0;
+
+    //已重置的流等待当前批次写完后释放，接收头部块期间可能已被释放
+    std::map<uint32_t, h2_stream *>::iterator it = m_streams.find(stream_id);
+    h2_stream *s = it != m_streams.end() && !it->second->reset ? it->second : NULL;
+    //trailer和已关闭的流的头部块仍须解码以保持HPACK状态一致，之后丢弃
+    std::string discard;
+    bool keep = s && s->headers.empty();
+    bool ok = m_decoder.decode((const uint8_t *)m_block.data(), m_block.size(), keep ? s->headers : discard);
+    m_block.clear();
+    if (!ok)
+        return goaway(E_COMPRESSION_ERROR);
+    if (!s) {
+        rst_stream(stream_id, E_STREAM_CLOSED);
+        return true;
+    }
+    if (m_block_refused) {
+        rst_stream(stream_id, E_REFUSED_STREAM);
+        close_stream(s);
+        return true;
+    }
+    if (m_block_end_stream) {
+        s->remote_closed = true;
+        dispatch(s);
+    }
+    return true;
+}
+
+bool h2_session::on_settings(uint8_t flags, const uint8_t *payload, uint32_t len, bool ack) {
+    if (flags & FLAG_ACK)
+        return len == 0 ? true : goaway(E_FRAME_SIZE_ERROR);
+    if (len % 6)
+        return goaway(E_FRAME_SIZE_ERROR);
+    for (uint32_t i = 0; i < len; i += 6) {
+        uint16_t id = payload[i] << 8 | payload[i + 1];
+        uint32_t value = get_u32(payload + i + 2);
+        switch (id) {
+        case 2:    //ENABLE_PUSH，不使用推送
+            if (value > 1)
+                return goaway(E_PROTOCOL_ERROR);
+            break;
+        case 4:    //INITIAL_WINDOW_SIZE，已有的流按差值调整
+        {
+            if (value > 0x7fffffff)
+                return goaway(E_FLOW_CONTROL_ERROR);
+            int64_t delta = (int64_t)value - m_peer_initial_window;
+            for (std::map<uint32_t, h2_stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+                it->second->send_window += delta;
+            m_peer_initial_window = value;
+            break;
+        }
+        case 5:    //MAX_FRAME_SIZE
+            if (value < 16384 || value > 16777215)
+                return goaway(E_PROTOCOL_ERROR);
+            m_peer_max_frame = value;
+            break;
+        default:
+            break;
+        }
+    }
+    if (ack)
+        write_frame_header(m_ctrl, 0, F_SETTINGS, FLAG_ACK, 0);
+    return true;
+}
+
+bool h2_session::on_window_update(uint32_t stream_id, const uint8_t *payload, uint32_t len) {
+    if (len != 4)
+        return goaway(E_FRAME_SIZE_ERROR);
+    uint32_t increment = get_u32(payload) & 0x7fffffff;
+    if (!stream_id) {
+        if (!increment)
+            return goaway(E_PROTOCOL_ERROR);
+        m_send_window += increment;
+        if (m_send_window > 0x7fffffff)
+            return goaway(E_FLOW_CONTROL_ERROR);
+        return true;
+    }
+    std::map<uint32_t, h2_stream *>::iterator it = m_streams.find(stream_id);
+    if (it == m_streams.end())
+        return stream_id > m_last_stream_id ? goaway(E_PROTOCOL_ERROR) : true;
+    h2_stream *s = it->second;
+    s->send_window += increment;
+    if (!increment || s->send_window > 0x7fffffff) {
+        rst_stream(stream_id, increment ? E_FLOW_CONTROL_ERROR : E_PROTOCOL_ERROR);
+        close_stream(s);
+    }
+    return true;
+}
+
+void h2_session::dispatch(h2_stream *s) {
+    m_conn->handle_h2(*s);
+    s->responded = true;
+    m_ready.push_back(s);
+}
+
+bool h2_session::goaway(ERROR_CODE code) {
+    if (!m_goaway_sent) {
+        write_frame_header(m_ctrl, 8, F_GOAWAY, 0, 0);
+        put_u32(m_ctrl, m_last_stream_id);
+        put_u32(m_ctrl, code);
+        m_goaway_sent = true;
+    }
+    return false;
+}
+
+void h2_session::rst_stream(uint32_t stream_id, ERROR_CODE code) {
+    write_frame_header(m_ctrl, 4, F_RST_STREAM, 0, stream_id);
+    put_u32(m_ctrl, code);
+}
+
+//流可能还在当前批次的iovec中，批次写完后才释放
+void h2_session::close_stream(h2_stream *s) {
+    if (s->end_sent || s->reset)
+        return;
+    s->reset = true;
+    m_ready.remove(s);
+    m_sent.push_back(s);
+}
+
+void h2_session::write_frame_header(std::string &out, uint32_t len, uint8_t type, uint8_t flags,
+                                    uint32_t stream_id) {
+    out.push_back((char)(len >> 16));
+    out.push_back((char)(len >> 8));
+    out.push_back((char)len);
+    out.push_back((char)type);
+    out.push_back((char)flags);
+    put_u32(out, stream_id & 0x7fffffff);
+}
+
+void h2_session::window_update(uint32_t stream_id, uint32_t increment) {
+    write_frame_header(m_ctrl, 4, F_WINDOW_UPDATE, 0, stream_id);
+    put_u32(m_ctrl, increment);
+}
+
+void h2_session::add_segment(const char *ext, size_t len) {
+    //m_batch中尚未加入的帧头先作为一段
+    if (m_batch.size() > m_batch_covered) {
+        h2_stream::segment seg = {NULL, m_batch_covered, m_batch.size() - m_batch_covered};
+        m_batch_segs.push_back(seg);
+        m_batch_covered = m_batch.size();
+    }
+    if (ext) {
+        h2_stream::segment seg = {ext, 0, len};
+        m_batch_segs.push_back(seg);
+    }
+}
+
+void h2_session::build_batch() {
+    m_batch.clear();
+    m_batch.swap(m_ctrl);
+    m_batch_segs.clear();
+    m_batch_covered = 0;
+    m_iov.clear();
+    m_iov_idx = 0;
+
+    //每轮每个流最多一帧，直到批次写满或所有流都受窗口限制
+    size_t budget = BATCH_SIZE;
+    bool progress = true;
+    while (progress && !m_ready.empty()) {
+        progress = false;
+        for (std::list<h2_stream *>::iterator it = m_ready.begin(); it != m_ready.end();) {
+            h2_stream *s = *it;
+            if (!s->headers_sent) {
+                //头部块超过对方的最大帧长时拆成CONTINUATION
+                bool end = s->body_left == 0;
+                size_t total = s->resp_headers.size();
+                size_t n = total < m_peer_max_frame ? total : m_peer_max_frame;
+                write_frame_header(m_batch, n, F_HEADERS, (end ? FLAG_END_STREAM : 0) | (n == total ? FLAG_END_HEADERS : 0),
+                                   s->id);
+                m_batch.append(s->resp_headers, 0, n);
+                for (size_t off = n; off < total; off += n) {
+                    n = total - off < m_peer_max_frame ? total - off : m_peer_max_frame;
+                    write_frame_header(m_batch, n, F_CONTINUATION, off + n == total ? FLAG_END_HEADERS : 0, s->id);
+                    m_batch.append(s->resp_headers, off, n);
+                }
+                s->headers_sent = true;
+                s->end_sent = end;
+                progress = true;
+            }
+            else if (budget > 0) {
+                long long n = s->body_left;
+                if (n > (long long)m_peer_max_frame)
+                    n = m_peer_max_frame;
+                if (n > s->send_window)
+                    n = s->send_window;
+                if (n > m_send_window)
+                    n = m_send_window;
+                if (n > (long long)budget)
+                    n = budget;
+                if (n > 0) {
+                    bool end = n == s->body_left;
+                    write_frame_header(m_batch, n, F_DATA, end ? FLAG_END_STREAM : 0, s->id);
+                    //消息体直接指向文件映射或响应内容，不拷贝
+                    for (long long left = n; left > 0;) {
+                        const h2_stream::segment &seg = s->segments[s->seg_idx];
+                        size_t k = seg.len - s->seg_off;
+                        if ((long long)k > left)
+                            k = left;
+                        const char *base = seg.ext ? seg.ext : s->copy.data() + seg.off;
+                        add_segment(base + s->seg_off, k);
+                        s->seg_off += k;
+                        if (s->seg_off == seg.len) {
+                            ++s->seg_idx;
+                            s->seg_off = 0;
+                        }
+                        left -= k;
+                    }
+                    s->body_left -= n;
+                    s->send_window -= n;
+                    m_send_window -= n;
+                    budget -= n;
+                    s->end_sent = end;
+                    progress = true;
+                }
+            }
+            if (s->end_sent) {
+                m_sent.push_back(s);
+                it = m_ready.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+    add_segment(NULL, 0);
+
+    for (size_t i = 0; i < m_batch_segs.size(); ++i) {
+        const h2_stream::segment &seg = m_batch_segs[i];
+        struct iovec iv;
+        iv.iov_base = (void *)(seg.ext ? seg.ext : m_batch.data() + seg.off);
+        iv.iov_len = seg.len;
+        m_iov.push_back(iv);
+    }
+}
+
+void h2_session::release_sent() {
+    for (size_t i = 0; i < m_sent.size(); ++i) {
+        m_streams.erase(m_sent[i]->id);
+        delete m_sent[i];
+    }
+    m_sent.clear();
+}
+
+bool h2_session::flush(int fd) {
+    while (true) {
+        if (m_iov_idx == m_iov.size()) {
+            release_sent();
+            build_batch();
+            if (m_iov.empty())
+                return true;
+        }
+        size_t count = m_iov.size() - m_iov_idx;
+        if (count > IOV_MAX)
+            count = IOV_MAX;
+        ssize_t n = writev(fd, &m_iov[m_iov_idx], count);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        size_t sent = n;
+        while (m_iov_idx < m_iov.size() && sent >= m_iov[m_iov_idx].iov_len) {
+            sent -= m_iov[m_iov_idx].iov_len;
+            ++m_iov_idx;
+        }
+        if (m_iov_idx < m_iov.size()) {
+            m_iov[m_iov_idx].iov_base = (char *)m_iov[m_iov_idx].iov_base + sent;
+            m_iov[m_iov_idx].iov_len -= sent;
+        }
+    }
+}
+
+bool h2_session::finished() const {
+    if (want_write() || !m_ctrl.empty())
+        return false;
+    return m_goaway_sent || (m_peer_goaway && m_streams.empty());
+}
@@ -0,0 +1,186 @@
+#ifndef M_H2_SESSION_H
+#define M_H2_SESSION_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include "hpack.h"
+
+class http_conn;
+
+//一个HTTP/2流：请求的头部和消息体收齐后交给http_conn的路由处理
+//处理结果转换为编码后的头部和若干消息体片段，由会话按流量控制分帧发送
+struct h2_stream {
+    explicit h2_stream(uint32_t stream_id, int32_t window);
+    ~h2_stream();
+    //追加响应体片段，stable为假时拷贝一份
+    void add_body(const char *data, size_t len, bool stable);
+
+    uint32_t id;
+    //解码后的请求头 name\0value\0...
+    std::string headers;
+    std::string body;
+    bool remote_closed;
+    bool body_too_large;
+    //对方发送窗口，我们收到DATA时扣减并立即补回
+    int32_t recv_window;
+
+    //响应，resp_headers为HPACK编码后的头部块
+    std::string resp_headers;
+    struct segment {
+        const char *ext;   //为NULL时指向copy中的off
+        size_t off;
+        size_t len;
+    };
+    std::vector<segment> segments;
+    std::string copy;
+    size_t seg_idx;
+    size_t seg_off;
+    long long body_left;
+    //文件映射，流结束后释放
+    void *map_addr;
+    size_t map_len;
+    int64_t send_window;
+    bool responded;
+    bool headers_sent;
+    bool end_sent;
+    bool reset;
+};
+
+//HTTP/2明文连接(h2c)：帧解析、HPACK、流的多路复用和双向流量控制
+//多个流的HEADERS/DATA和控制帧合并成一批，一次writev写出，socket写满时等待EPOLLOUT
+class h2_session {
+public:
+    static const int INPUT_BUFFER_SIZE = 32768;
+    static const uint32_t MAX_FRAME_SIZE = 16384;
+    static const uint32_t MAX_STREAMS = 100;
+    //单个请求体的上限，HTTP/2下只有表单等小请求体
+    static const size_t MAX_BODY = 65536;
+    //每批写出的DATA上限，所有流轮流分配
+    static const size_t BATCH_SIZE = 256 * 1024;
+    //客户端连接前言
+    static const char PREFACE[];
+    static const int PREFACE_LEN = 24;
+
+    //preface_received为假时先等待连接前言(升级或前言未读完)
+    h2_session(http_conn *conn, bool preface_received);
+    ~h2_session();
+
+    //101响应等须在HTTP/2帧之前发出的字节，须在start之前调用
+    void queue_raw(const char *data, size_t len);
+    //发出我们的SETTINGS
+    void start();
+    //h2c升级：应用请求中HTTP2-Settings(base64url)的设置
+    bool apply_upgrade_settings(const char *b64);
+    //h2c升级：原HTTP/1.1请求作为流1，headers为 name\0value\0...
+    void upgrade_stream(const std::string &headers);
+    //追加从HTTP/1.1读缓冲区带过来的字节
+    bool feed(const char *data, size_t len);
+    //从socket读到输入缓冲区，对方关闭或出错返回false
+    bool read(int fd);
+    //处理输入中的完整帧并分发完整的请求，返回false时应立即关闭连接
+    bool process();
+    //写出待发送的帧，返回false表示写出错；EAGAIN时want_write为真
+    bool flush(int fd);
+    bool want_write() const { return m_iov_idx < m_iov.size(); }
+    //已发出GOAWAY或对方GOAWAY后全部流结束，数据写完即可关闭连接
+    bool finished() const;
+    //没有未结束的流和待发送的帧
+    bool idle() const { return m_streams.empty() && m_ready.empty() && !want_write() && m_ctrl.empty(); }
+
+private:
+    enum FRAME_TYPE {
+        F_DATA = 0,
+        F_HEADERS,
+        F_PRIORITY,
+        F_RST_STREAM,
+        F_SETTINGS,
+        F_PUSH_PROMISE,
+        F_PING,
+        F_GOAWAY,
+        F_WINDOW_UPDATE,
+        F_CONTINUATION
+    };
+    enum ERROR_CODE {
+        E_NO_ERROR = 0,
+        E_PROTOCOL_ERROR,
+        E_INTERNAL_ERROR,
+        E_FLOW_CONTROL_ERROR,
+        E_SETTINGS_TIMEOUT,
+        E_STREAM_CLOSED,
+        E_FRAME_SIZE_ERROR,
+        E_REFUSED_STREAM,
+        E_CANCEL,
+        E_COMPRESSION_ERROR,
+        E_CONNECT_ERROR,
+        E_ENHANCE_YOUR_CALM
+    };
+
+    bool on_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len);
+    bool on_data(uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len);
+    bool on_headers(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len);
+    bool on_settings(uint8_t flags, const uint8_t *payload, uint32_t len, bool ack);
+    bool on_window_update(uint32_t stream_id, const uint8_t *payload, uint32_t len);
+    //请求收齐后交给http_conn
+    void dispatch(h2_stream *s);
+
+    //连接错误：发出GOAWAY，之后不再处理输入
+    bool goaway(ERROR_CODE code);
+    void rst_stream(uint32_t stream_id, ERROR_CODE code);
+    void close_stream(h2_stream *s);
+    void write_frame_header(std::string &out, uint32_t len, uint8_t type, uint8_t flags, uint32_t stream_id);
+    void window_update(uint32_t stream_id, uint32_t increment);
+
+    //组装下一批待写的帧，填充m_iov
+    void build_batch();
+    //ext为NULL时只把m_batch中新增的帧头加入批次
+    void add_segment(const char *ext, size_t len);
+    //已写完的流释放
+    void release_sent();
+
+    http_conn *m_conn;
+    hpack_decoder m_decoder;
+
+    char m_in[INPUT_BUFFER_SIZE];
+    size_t m_in_start;
+    size_t m_in_end;
+    bool m_preface_received;
+
+    std::map<uint32_t, h2_stream *> m_streams;
+    uint32_t m_last_stream_id;
+    //头部块未结束的流，期间只能收到它的CONTINUATION
+    uint32_t m_continuation_id;
+    //HEADERS和CONTINUATION中的头部块，END_HEADERS后解码；不属于流，流在此期间被释放也不受影响
+    std::string m_block;
+    //正在接收的头部块带END_STREAM / 该流被拒绝
+    bool m_block_end_stream;
+    bool m_block_refused;
+
+    //对方的设置和连接级窗口
+    uint32_t m_peer_max_frame;
+    int32_t m_peer_initial_window;
+    int64_t m_send_window;
+
+    //待发送的控制帧
+    std::string m_ctrl;
+    //已生成响应、等待发送的流，按顺序轮流发送
+    std::list<h2_stream *> m_ready;
+    //当前批次中已发完的流，批次写完后释放
+    std::vector<h2_stream *> m_sent;
+
+    //当前批次：帧头和控制帧在m_batch中，消息体直接指向流的数据
+    std::string m_batch;
+    std::vector<h2_stream::segment> m_batch_segs;
+    //m_batch中已加入m_batch_segs的长度
+    size_t m_batch_covered;
+    std::vector<struct iovec> m_iov;
+    size_t m_iov_idx;
+
+    bool m_goaway_sent;
+    bool m_peer_goaway;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef M_HPACK_H
+#define M_HPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <string>
+
+//HPACK(RFC 7541)解码，每个HTTP/2连接一个，头部块须按收到的顺序解码
+class hpack_decoder {
+public:
+    //我们在SETTINGS中通告的HEADER_TABLE_SIZE
+    static const size_t TABLE_SIZE = 4096;
+
+    hpack_decoder() : m_size(0), m_max_size(TABLE_SIZE) {}
+    //解码一个完整的头部块，字段以 name\0value\0 依次追加到out
+    //返回false表示压缩错误，按规定应关闭连接
+    bool decode(const uint8_t *p, size_t len, std::string &out);
+
+private:
+    struct entry {
+        std::string name;
+        std::string value;
+    };
+    //index从1开始，1-61为静态表，之后为动态表(最新的在前)
+    bool lookup(uint64_t index, const char **name, size_t *name_len, const char **value, size_t *value_len) const;
+    void insert(const char *name, size_t name_len, const char *value, size_t value_len);
+    void evict(size_t max_size);
+
+    std::deque<entry> m_table;
+    size_t m_size;
+    size_t m_max_size;
+};
+
+//HPACK编码，响应只用静态表中的名称和不索引的字面量，不维护动态表
+class hpack_encoder {
+public:
+    static void status(int code, std::string &out);
+    //name须为小写
+    static void header(const char *name, size_t name_len, const char *value, size_t value_len, std::string &out);
+};
+
+#endif
@@ -1,6 +1,9 @@
 #include <hiredis/hiredis.h>
 #include <fstream>
+#include <new>
+#include <sys/sendfile.h>
 #include "http_conn.h"
+#include "dir_listing.h"
 
 //定义http响应的一些状态信息
 const char *ok_200_title = "OK";
@@ -12,18 +15,152 @@ const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual problem serving the request file.\n";
+const char *partial_206_title = "Partial Content";
+const char *not_modified_304_title = "Not Modified";
+const char *error_416_title = "Range Not Satisfiable";
+const char *error_416_form = "The requested range is not satisfiable.\n";
+const char *error_413_title = "Payload Too Large";
+const char *error_413_form = "The request body is larger than the server is willing to accept.\n";
+const char *error_502_title = "Bad Gateway";
+const char *error_502_form = "The upstream server is unavailable or sent an invalid response.\n";
+const char *error_503_title = "Service Unavailable";
+const char *error_503_form = "The server is overloaded, please retry later.\n";
+const char *error_429_title = "Too Many Requests";
+const char *error_429_form = "Too many requests from this address, please retry later.\n";
 
-locker m_lock;
+//拼接完整的响应报文，headers为状态行和Connection之间的头部
+static std::string build_response(int status, const char *title, const std::string &headers,
+                                  const std::string &body, bool keep_alive) {
+    char line[128];
+    snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", status, title);
+    std::string resp = line;
+    resp += headers;
+    snprintf(line, sizeof(line), "Content-Length:%zu\r\nConnection:%s\r\n\r\n", body.size(),
+             keep_alive ? "keep-alive" : "close");
+    resp += line;
+    resp += body;
+    return resp;
+}
 
-//对文件描述符设置非阻塞
-int setnonblocking(int fd) {
-    int old_option = fcntl(fd, F_GETFL);
-    int new_option = old_option | O_NONBLOCK;
-    fcntl(fd, F_SETFL, new_option);
-    return old_option;
+//400/403/404/500/413/502/503/429的完整响应，[状态][keep-alive]，首次使用时生成
+enum FIXED_ERROR {
+    FIXED_400 = 0,
+    FIXED_403,
+    FIXED_404,
+    FIXED_500,
+    FIXED_413,
+    FIXED_502,
+    FIXED_503,
+    FIXED_429,
+    FIXED_ERROR_COUNT
+};
+struct fixed_error_table {
+    std::string resp[FIXED_ERROR_COUNT][2];
+    fixed_error_table() {
+        const int status[] = {400, 403, 404, 500, 413, 502, 503, 429};
+        const char *title[] = {error_400_title, error_403_title, error_404_title, error_500_title, error_413_title,
+                               error_502_title, error_503_title, error_429_title};
+        const char *form[] = {error_400_form, error_403_form, error_404_form, error_500_form, error_413_form,
+                              error_502_form, error_503_form, error_429_form};
+        for (int i = 0; i < FIXED_ERROR_COUNT; ++i) {
+            std::string headers = "Content-Type:text/plain; charset=utf-8\r\n";
+            //503和429告诉客户端多久之后重试
+            if (status[i] == 503 || status[i] == 429)
+                headers += "Retry-After:" + std::to_string(http_conn::RETRY_AFTER) + "\r\n";
+            for (int k = 0; k < 2; ++k)
+                resp[i][k] = build_response(status[i], title[i], headers, form[i], k == 1);
+        }
+    }
+};
+static const std::string &fixed_error(FIXED_ERROR err, bool keep_alive) {
+    static const fixed_error_table table;
+    return table.resp[err][keep_alive];
 }
 
-//将内核事件表注册读事件，ET模式，选择开启EPOLLONESHOT
+//页面路由的完整响应，[keep-alive][gzip]，内容为启动时的页面，按路由表下标存放
+//同时记下生成时文件的inode、大小和修改时间，文件被修改后不再使用
+struct fixed_page {
+    std::string resp[2][2];
+    bool gzip;  //压缩失败时[gzip]也是未压缩的响应
+    ino_t ino;
+    off_t size;
+    struct timespec mtim;
+
+    bool same(const struct stat &st) const {
+        return st.st_ino == ino && st.st_size == size && st.st_mtim.tv_sec == mtim.tv_sec &&
+               st.st_mtim.tv_nsec == mtim.tv_nsec;
+    }
+};
+static std::vector<fixed_page> fixed_pages;
+
+
+//扩展名到MIME类型，compressible表示值得gzip/br压缩
+struct mime_type {
+    const char *ext;
+    const char *type;
+    bool compressible;
+};
+static const mime_type mime_types[] = {
+    {"html", "text/html; charset=utf-8", true},
+    {"htm", "text/html; charset=utf-8", true},
+    {"css", "text/css", true},
+    {"js", "application/javascript", true},
+    {"json", "application/json", true},
+    {"txt", "text/plain; charset=utf-8", true},
+    {"md", "text/markdown; charset=utf-8", true},
+    {"xml", "application/xml", true},
+    {"svg", "image/svg+xml", true},
+    {"ico", "image/x-icon", true},
+    {"jpg", "image/jpeg", false},
+    {"jpeg", "image/jpeg", false},
+    {"png", "image/png", false},
+    {"gif", "image/gif", false},
+    {"webp", "image/webp", false},
+    {"mp4", "video/mp4", false},
+    {"webm", "video/webm", false},
+    {"mp3", "audio/mpeg", false},
+    {"pdf", "application/pdf", false},
+    {"woff2", "font/woff2", false},
+    {"wasm", "application/wasm", false},
+};
+static const mime_type default_mime_type = {"", "application/octet-stream", false};
+
+static const mime_type *find_mime_type(const char *file) {
+    const char *dot = strrchr(file, '.');
+    if (!dot || strchr(dot, '/'))
+        return &default_mime_type;
+    for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); ++i) {
+        if (strcasecmp(dot + 1, mime_types[i].ext) == 0)
+            return &mime_types[i];
+    }
+    return &default_mime_type;
+}
+
+//Accept-Encoding中coding的q值是否大于0，未出现时返回false
+static bool accepts_encoding(const char *accept, const char *coding) {
+    size_t len = strlen(coding);
+    const char *p = accept;
+    while (*p) {
+        p += strspn(p, " \t,");
+        size_t tok = strcspn(p, " \t,;");
+        bool match = tok == len && strncasecmp(p, coding, len) == 0;
+        p += tok;
+        p += strspn(p, " \t");
+        double q = 1.0;
+        if (*p == ';') {
+            const char *qv = strstr(p, "q=");
+            const char *next = strchr(p, ',');
+            if (qv && (!next || qv < next))
+                q = atof(qv + 2);
+        }
+        if (match)
+            return q > 0;
+        p += strcspn(p, ",");
+    }
+    return false;
+}
+
+//将内核事件表注册读事件，选择开启EPOLLONESHOT；连接由accept4创建，已是非阻塞
 void addfd(int epollfd, int fd, bool one_shot) {
     epoll_event event;
     event.data.fd = fd;
@@ -33,7 +170,6 @@ void addfd(int epollfd, int fd, bool one_shot) {
     if (one_shot)
         event.events |= EPOLLONESHOT;
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    setnonblocking(fd);
 }
 
 //从内核时间表删除描述符
@@ -52,11 +188,118 @@ void modfd(int epollfd, int fd, int ev) {
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
+//按IMF-fixdate格式化时间，如 Sun, 06 Nov 1994 08:49:37 GMT
+//强校验值 "inode-size-mtime" 总是取自原文件，压缩的响应加上编码后缀，固定响应和普通路径生成的一致
+static void make_etag(const struct stat &st, const char *coding, char *buf, int len) {
+    snprintf(buf, len, "\"%lx-%llx-%llx%s%s\"", (unsigned long)st.st_ino, (unsigned long long)st.st_size,
+             (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec, coding ? "-" : "",
+             coding ? coding : "");
+}
+
+static void http_date(time_t t, char *buf, int len) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
 int http_conn::m_user_count = 0;
 int http_conn::m_epollfd = -1;
+std::vector<std::pair<std::string, std::string> > http_conn::m_cache_rules;
+std::atomic<long long> http_conn::m_max_body_size(8 << 20);
+std::atomic<bool> http_conn::m_autoindex(false);
+std::atomic<bool> http_conn::m_draining(false);
+std::atomic<int> http_conn::m_header_timeout(10);
+std::atomic<int> http_conn::m_body_timeout(20);
+std::atomic<int> http_conn::m_body_min_rate(500);
+std::atomic<int> http_conn::m_keepalive_requests(1000);
+std::string http_conn::m_spool_dir = "/tmp";
+
+void http_conn::set_body_limit(long long max_size, const char *spool_dir) {
+    m_max_body_size.store(max_size, std::memory_order_relaxed);
+    if (spool_dir)
+        m_spool_dir = spool_dir;
+}
+
+void http_conn::set_deadlines(int header_timeout, int body_timeout, int body_min_rate, int keepalive_requests) {
+    m_header_timeout.store(header_timeout, std::memory_order_relaxed);
+    m_body_timeout.store(body_timeout, std::memory_order_relaxed);
+    m_body_min_rate.store(body_min_rate, std::memory_order_relaxed);
+    m_keepalive_requests.store(keepalive_requests, std::memory_order_relaxed);
+}
+
+bool http_conn::add_cache_control(const char *rule) {
+    const char *eq = strchr(rule, '=');
+    if (!eq || eq == rule || rule[0] != '/' || eq[1] == '\0')
+        return false;
+    std::string prefix(rule, eq - rule);
+    std::vector<std::pair<std::string, std::string> >::iterator it = m_cache_rules.begin();
+    while (it != m_cache_rules.end() && it->first.size() >= prefix.size())
+        ++it;
+    m_cache_rules.insert(it, std::make_pair(prefix, std::string(eq + 1)));
+    return true;
+}
+
+const char *http_conn::find_cache_control(const char *url) {
+    for (size_t i = 0; i < m_cache_rules.size(); ++i) {
+        if (strncmp(url, m_cache_rules[i].first.c_str(), m_cache_rules[i].first.size()) == 0)
+            return m_cache_rules[i].second.c_str();
+    }
+    return NULL;
+}
+
+bool http_conn::init_fixed_responses(const char *root) {
+    //路由表和错误页首次使用时才构建，这里提前构建，之后的请求不再分配内存
+    get_router();
+    fixed_error(FIXED_400, false);
+
+    bool ok = true;
+    fixed_pages.assign(m_route_count, fixed_page());
+    for (int i = 0; i < m_route_count; ++i) {
+        const route_entry &route = m_routes[i];
+        if (!route.page)
+            continue;
+        std::string path = std::string(root) + route.page;
+        struct stat st;
+        std::ifstream in(path.c_str(), std::ios::binary);
+        if (stat(path.c_str(), &st) < 0 || !in) {
+            spdlog::warn("fixed route {0}: cannot read {1}", route.path, path);
+            ok = false;
+            continue;
+        }
+        std::string body((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::string gz_body;
+        compressor::gzip(body, gz_body);
+
+        char etag[64], gz_etag[64], date[40];
+        make_etag(st, NULL, etag, sizeof(etag));
+        make_etag(st, "gz", gz_etag, sizeof(gz_etag));
+        http_date(st.st_mtime, date, sizeof(date));
+        const char *cache_control = find_cache_control(route.path);
+
+        std::string common = std::string("Last-Modified:") + date + "\r\n";
+        if (cache_control)
+            common += std::string("Cache-Control:") + cache_control + "\r\n";
+        common += std::string("Vary:Accept-Encoding\r\nContent-Type:") + find_mime_type(route.page)->type +
+                  "\r\nAccept-Ranges:bytes\r\n";
+        std::string identity = std::string("ETag:") + etag + "\r\n" + common;
+        std::string gzip = std::string("ETag:") + gz_etag + "\r\n" + common + "Content-Encoding:gzip\r\n";
+        fixed_pages[i].gzip = !gz_body.empty();
+        fixed_pages[i].ino = st.st_ino;
+        fixed_pages[i].size = st.st_size;
+        fixed_pages[i].mtim = st.st_mtim;
+        std::string (&resp)[2][2] = fixed_pages[i].resp;
+        for (int k = 0; k < 2; ++k) {
+            resp[k][0] = build_response(200, ok_200_title, identity, body, k == 1);
+            resp[k][1] = gz_body.empty() ? resp[k][0] : build_response(200, ok_200_title, gzip, gz_body, k == 1);
+        }
+    }
+    return ok;
+}
 
 //关闭连接，关闭一个连接，客户总量减一
 void http_conn::close_conn(bool real_close) {
+    //后端连接按客户连接的fd登记，须在m_sockfd清除之前归还
+    release(false);
     if (real_close && (m_sockfd != -1)) {
         printf("close %d\n", m_sockfd);
         removefd(m_epollfd, m_sockfd);
@@ -65,6 +308,97 @@ void http_conn::close_conn(bool real_close) {
     }
 }
 
+void http_conn::release(bool failed) {
+    if (m_proxy) {
+        proxy_table::get_instance()->unbind(m_sockfd, false, failed);
+        m_proxy = NULL;
+    }
+    close_body();
+    end_stream();
+    close_h2();
+    close_tls();
+    unmap();
+}
+
+bool http_conn::idle() {
+    //已在工作线程中关闭，只剩定时器
+    if (m_sockfd < 0)
+        return true;
+    char c;
+    ssize_t ret = recv(m_sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    //对方已关闭或连接出错，响应已无法送达
+    if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        return true;
+    //下一个请求已经到达socket，还没有读
+    if (ret > 0)
+        return false;
+    if (m_proxy || m_stream || bytes_to_send > 0 || (m_ssl && m_tls_handshake))
+        return false;
+    return m_h2 ? m_h2->idle() : m_read_idx == 0;
+}
+
+bool http_conn::between_requests() const {
+    return !m_h2 && !m_proxy && !m_stream && bytes_to_send == 0 && m_read_idx == 0 && !(m_ssl && m_tls_handshake);
+}
+
+//丢弃的请求最多读这么多，剩余未读的数据会使close发出RST
+static const int REJECT_DRAIN = 65536;
+
+void http_conn::reject(bool limited) {
+    if (m_sockfd < 0 || m_h2 || (m_ssl && m_tls_handshake))
+        return;
+    char buf[4096];
+    for (int total = 0; total < REJECT_DRAIN;) {
+        ssize_t n = m_ssl ? tls_context::recv(m_ssl, buf, sizeof(buf)) : recv(m_sockfd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            break;
+        total += n;
+    }
+    const std::string &resp = fixed_error(limited ? FIXED_429 : FIXED_503, false);
+    struct iovec iv = {(void *)resp.data(), resp.size()};
+    send_iov(&iv, 1);
+}
+
+void http_conn::reject_fd(int fd, bool limited) {
+    char buf[4096];
+    for (int total = 0; total < REJECT_DRAIN;) {
+        ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n <= 0)
+            break;
+        total += n;
+    }
+    const std::string &resp = fixed_error(limited ? FIXED_429 : FIXED_503, false);
+    send(fd, resp.data(), resp.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+}
+
+bool http_conn::start_tls() {
+    m_ssl = tls_context::get_instance()->accept(m_sockfd);
+    m_tls_handshake = true;
+    m_tls_want_write = false;
+    return m_ssl != NULL;
+}
+
+bool http_conn::tls_handshake() {
+    int ret = tls_context::handshake(m_ssl, &m_tls_want_write);
+    if (ret > 0) {
+        m_tls_handshake = false;
+        tls_context::log_ktls(m_ssl);
+    }
+    return ret >= 0;
+}
+
+void http_conn::close_tls() {
+    if (m_ssl) {
+        SSL_free(m_ssl);
+        m_ssl = NULL;
+    }
+}
+
+ssize_t http_conn::send_iov(const struct iovec *iov, int count) {
+    return m_ssl ? tls_context::writev(m_ssl, m_sockfd, iov, count) : writev(m_sockfd, iov, count);
+}
+
 //初始化连接,外部调用初始化套接字地址
 void http_conn::init(int sockfd, const sockaddr_in &addr, char *root) {
     m_sockfd = sockfd;
@@ -75,7 +409,19 @@ void http_conn::init(int sockfd, const sockaddr_in &addr, char *root) {
 
     //当浏览器出现连接重置时，可能是网站根目录出错或http响应格式出错或者访问的文件中内容完全为空
     doc_root = root;
+    m_parse_only = false;
+    m_capture_id = traffic_capture::get_instance()->sample();
+    m_requests = 0;
+
+    init();
+}
 
+void http_conn::init_offline(char *root) {
+    m_sockfd = -1;
+    doc_root = root;
+    m_parse_only = false;
+    m_capture_id = 0;
+    m_requests = 0;
     init();
 }
 
@@ -83,23 +429,47 @@ void http_conn::init(int sockfd, const sockaddr_in &addr, char *root) {
 //check_state默认为分析请求行状态
 void http_conn::init() {
     redis = NULL;
+    m_state = 0;
+    timer_flag = 0;
+    improv = 0;
+    init_request();
+}
+
+void http_conn::init_request() {
     bytes_to_send = 0;
     bytes_have_send = 0;
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_linger = false;
     m_method = GET;
-    m_url = 0;
-    m_version = 0;
+    close_body();
+    m_request.reset();
     m_content_length = 0;
-    m_host = 0;
+    m_body.reset();
+    m_body_start = 0;
+    m_body_len = 0;
+    m_header_since = 0;
+    m_body_since = 0;
+    m_deadline = 0;
+    m_cache_control = 0;
+    m_content_type = default_mime_type.type;
+    m_content_encoding = 0;
+    m_vary = false;
+    m_fixed = 0;
+    end_stream();
+    m_stream_end = false;
+    m_arena.reset();
+    m_alloc_exempt = false;
+    m_range_count = 0;
+    m_iv_count = 0;
+    m_iv_idx = 0;
     m_start_line = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
     m_write_idx = 0;
     cgi = 0;
-    m_state = 0;
-    timer_flag = 0;
-    improv = 0;
+    //旧的文件日志未初始化，统一使用spdlog
+    m_close_log = 1;
+    m_trace.reset();
 
     memset(m_read_buf, '\0', READ_BUFFER_SIZE);
     memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
@@ -138,14 +508,38 @@ http_conn::LINE_STATUS http_conn::parse_line() {
 //循环读取客户数据，直到无数据可读或对方关闭连接
 //非阻塞ET工作模式下，需要一次性将数据读完
 bool http_conn::read_once() {
+    //代理期间只等待后端或客户端可写，由run_proxy读写
+    if (m_proxy)
+        return true;
+    if (m_h2) {
+        if (m_h2->read(m_sockfd))
+            return true;
+        close_h2();
+        return false;
+    }
+    if (m_ssl && m_tls_handshake) {
+        if (!tls_handshake())
+            return false;
+        //握手完成后继续读取同一批到达的请求
+        if (m_tls_handshake)
+            return true;
+    }
+    //消息体已写入临时文件且缓冲区中没有待解码的数据时，剩余部分不经过用户态
+    //抓包和TLS的连接仍走recv，以便记录原始字节或解密
+    if (m_check_state == CHECK_STATE_CONTENT && m_request.body_fd >= 0 && m_body.remaining() > 0 &&
+        m_checked_idx == m_read_idx && !m_capture_id && !m_ssl)
+        return splice_body();
     if (m_read_idx >= READ_BUFFER_SIZE) {
         return false;
     }
     int bytes_read = 0;
 
-    //ET读数据
-    while (true) {
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+    //ET读数据，缓冲区满时先交给主状态机处理，重新注册EPOLLIN后继续读
+    while (m_read_idx < READ_BUFFER_SIZE) {
+        if (m_ssl)
+            bytes_read = tls_context::recv(m_ssl, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx);
+        else
+            bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
         if (bytes_read == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
                 break;
@@ -154,19 +548,22 @@ bool http_conn::read_once() {
         else if (bytes_read == 0) {
             return false;
         }
+        if (m_capture_id)
+            traffic_capture::get_instance()->record(m_capture_id, m_read_buf + m_read_idx, bytes_read);
         m_read_idx += bytes_read;
     }
     return true; 
 }
 
 //解析http请求行，获得请求方法，目标url及http版本号
+//方法、目标和版本以'\0'分隔后记入m_request，不拷贝
 http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
     //text中找出最先含有 \t 中任一字符的位置并返回
-    m_url = strpbrk(text, " \t");
-    if (!m_url) {
+    char *url = strpbrk(text, " \t");
+    if (!url) {
         return BAD_REQUEST;
     }
-    *m_url++ = '\0';
+    *url++ = '\0';
     char *method = text;
     if (strcasecmp(method, "GET") == 0)
         m_method = GET;
@@ -176,82 +573,258 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
     }
     else
         return BAD_REQUEST;
-    //m_url此时跳过了第一个空格或\t字符，但不知道之后是否还有
-    //将m_url向后偏移，通过查找，继续跳过空格和\t字符，指向请求资源的第一个字符
-    m_url += strspn(m_url, " \t");// strspn 检索字符串 str1 中第一个不在字符串 str2 中出现的字符下标 跳过空格和\t字符
-    m_version = strpbrk(m_url, " \t");
-    if (!m_version)
+    //url此时跳过了第一个空格或\t字符，但不知道之后是否还有
+    //将url向后偏移，通过查找，继续跳过空格和\t字符，指向请求资源的第一个字符
+    url += strspn(url, " \t");// strspn 检索字符串 str1 中第一个不在字符串 str2 中出现的字符下标 跳过空格和\t字符
+    char *version = strpbrk(url, " \t");
+    if (!version)
         return BAD_REQUEST;
-    *m_version++ = '\0';
-    m_version += strspn(m_version, " \t");
-    if (strcasecmp(m_version, "HTTP/1.1") != 0)
+    *version++ = '\0';
+    version += strspn(version, " \t");
+    if (strcasecmp(version, "HTTP/1.1") != 0)
         return BAD_REQUEST;
-    if (strncasecmp(m_url, "http://", 7) == 0)
-    {
-        m_url += 7;
-        m_url = strchr(m_url, '/');
-    }
+    //绝对形式的目标只保留路径部分
+    if (strncasecmp(url, "http://", 7) == 0)
+        url = strchr(url + 7, '/');
+    else if (strncasecmp(url, "https://", 8) == 0)
+        url = strchr(url + 8, '/');
 
-    if (strncasecmp(m_url, "https://", 8) == 0)
-    {
-        m_url += 8;
-        m_url = strchr(m_url, '/');
-    }
-
-    if (!m_url || m_url[0] != '/')
+    if (!url || url[0] != '/')
         return BAD_REQUEST;
-    //当url为/时，显示判断界面
-    if (strlen(m_url) == 1)
-        strcat(m_url, "judge.html");
+    m_request.method = std::string_view(method, strlen(method));
+    m_request.target = std::string_view(url, strlen(url));
+    m_request.version = std::string_view(version, strlen(version));
+    //查询参数不参与路由
+    m_request.path = m_request.target.substr(0, m_request.target.find('?'));
     m_check_state = CHECK_STATE_HEADER;
     return NO_REQUEST;
 }
 
-//解析http请求的一个头部信息
+//解析http请求的一个头部信息，全部记入m_request，连接相关的头部同时更新状态
 http_conn::HTTP_CODE http_conn::parse_headers(char *text) {
     //判断是空行还是请求头
-    if (text[0] == '\0') {
-        if (m_content_length != 0) {
-            m_check_state = CHECK_STATE_CONTENT;
-            return NO_REQUEST;
+    if (text[0] == '\0')
+        return start_body();
+    char *colon = strchr(text, ':');
+    if (!colon || colon == text)
+        return BAD_REQUEST;
+    char *value = colon + 1;
+    value += strspn(value, " \t");
+    //去掉值末尾的空白，值在缓冲区中仍以'\0'结尾
+    char *end = value + strlen(value);
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+        --end;
+    *end = '\0';
+
+    //请求头过多
+    int id = m_request.add(std::string_view(text, colon - text), std::string_view(value, end - value));
+    if (id < 0)
+        return BAD_REQUEST;
+    if (id == H_CONNECTION) {
+        if (strcasecmp(value, "keep-alive") == 0)
+            m_linger = true;
+    }
+    else if (id == H_CONTENT_LENGTH) {
+        char *end;
+        m_content_length = strtoll(value, &end, 10);
+        if (end == value || *end != '\0' || m_content_length < 0)
+            return BAD_REQUEST;
+    }
+    return NO_REQUEST;
+}
+
+http_conn::HTTP_CODE http_conn::start_body() {
+    //排空期间响应后关闭连接，客户端在新进程上重新连接；长连接上的请求数达到上限时同样关闭
+    int keepalive_requests = m_keepalive_requests.load(std::memory_order_relaxed);
+    if (m_draining.load(std::memory_order_relaxed) || (keepalive_requests > 0 && ++m_requests >= keepalive_requests))
+        m_linger = false;
+    long long max_body_size = m_max_body_size.load(std::memory_order_relaxed);
+    const char *te = m_request.get_cstr(H_TRANSFER_ENCODING);
+    if (te) {
+        //同时带Content-Length可被用来走私请求，直接拒绝
+        if (m_request.has(H_CONTENT_LENGTH) || strcasecmp(te, "chunked") != 0) {
+            m_linger = false;
+            return BAD_REQUEST;
         }
+        m_body.start_chunked(max_body_size);
+    }
+    else if (m_content_length > max_body_size) {
+        //消息体不再读取，回复后关闭连接
+        m_linger = false;
+        return PAYLOAD_TOO_LARGE;
+    }
+    else if (m_content_length > 0)
+        m_body.start_length(m_content_length);
+    else
         return GET_REQUEST;
+
+    m_body_start = m_checked_idx;
+    m_body_len = 0;
+    m_check_state = CHECK_STATE_CONTENT;
+    //客户端等待100 Continue后才发送消息体，响应很短，直接写socket
+    const char *expect = m_request.get_cstr(H_EXPECT);
+    if (expect && strcasecmp(expect, "100-continue") == 0 && m_checked_idx == m_read_idx && m_sockfd >= 0) {
+        static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        struct iovec iv = {(void *)cont, sizeof(cont) - 1};
+        send_iov(&iv, 1);
     }
-    else if (strncasecmp(text, "Connection:", 11) == 0) {
-        text += 11;
-        text += strspn(text, " \t");
-        if (strcasecmp(text, "keep-alive") == 0)
-        {
-            m_linger = true;
+    return NO_REQUEST;
+}
+
+//慢速客户端(slowloris)每隔几秒发一个字节就能一直推迟空闲超时，请求头和消息体按开始接收的时刻计算截止时刻
+void http_conn::update_deadline() {
+    time_t now = time(NULL);
+    if (m_check_state != CHECK_STATE_CONTENT) {
+        if (!m_header_since)
+            m_header_since = now;
+        int header_timeout = m_header_timeout.load(std::memory_order_relaxed);
+        m_deadline = header_timeout > 0 ? m_header_since + header_timeout : 0;
+        return;
+    }
+    if (!m_body_since)
+        m_body_since = now;
+    int body_timeout = m_body_timeout.load(std::memory_order_relaxed);
+    if (body_timeout <= 0) {
+        m_deadline = 0;
+        return;
+    }
+    //达到最低速率的上传不会超时
+    int body_min_rate = m_body_min_rate.load(std::memory_order_relaxed);
+    long long grace = body_min_rate > 0 ? m_body.total() / body_min_rate : 0;
+    m_deadline = m_body_since + body_timeout + grace;
+}
+
+//解码缓冲区中已有的消息体，结束时m_request.body或body_fd指向完整的消息体
+http_conn::HTTP_CODE http_conn::parse_content() {
+    while (m_checked_idx < m_read_idx && !m_body.done()) {
+        char *payload;
+        int len;
+        int used = m_body.decode(m_read_buf + m_checked_idx, m_read_idx - m_checked_idx, &payload, &len);
+        if (used < 0) {
+            m_linger = false;
+            return m_body.status() == body_reader::BODY_TOO_LARGE ? PAYLOAD_TOO_LARGE : BAD_REQUEST;
+        }
+        if (used == 0)
+            break;
+        if (len > 0 && !append_body(payload, len)) {
+            m_linger = false;
+            return INTERNAL_ERROR;
         }
+        m_checked_idx += used;
     }
-    else if (strncasecmp(text, "Content-length:", 15) == 0) {
-        text += 15;
-        text += strspn(text, " \t");
-        m_content_length = atol(text);
+
+    if (m_body.done()) {
+        if (m_request.body_fd < 0) {
+            m_read_buf[m_body_start + m_body_len] = '\0';
+            //POST请求中最后为输入的用户名和密码
+            m_request.body = std::string_view(m_read_buf + m_body_start, m_body_len);
+        }
+        else if (lseek(m_request.body_fd, 0, SEEK_SET) < 0) {
+            m_linger = false;
+            return INTERNAL_ERROR;
+        }
+        m_request.body_length = m_body.total();
+        m_start_line = m_checked_idx;
+        return GET_REQUEST;
     }
-    else if (strncasecmp(text, "Host:", 5) == 0) {
-        text += 5;
-        text += strspn(text, " \t");
-        m_host = text;
+
+    //未解码的数据移到消息体之后，腾出缓冲区继续读
+    int keep = m_request.body_fd < 0 ? m_body_start + m_body_len : m_body_start;
+    if (m_read_idx == READ_BUFFER_SIZE && m_checked_idx == keep && m_request.body_fd < 0) {
+        //内存中的消息体占满了缓冲区，转入临时文件
+        if (!spool_body()) {
+            m_linger = false;
+            return INTERNAL_ERROR;
+        }
+        keep = m_body_start;
     }
-    else {
-        //spdlog::info("oop!unknow header:{0}",text);
-        //LOG_INFO("oop!unknow header: %s", text);
+    memmove(m_read_buf + keep, m_read_buf + m_checked_idx, m_read_idx - m_checked_idx);
+    m_read_idx -= m_checked_idx - keep;
+    m_checked_idx = m_start_line = keep;
+    //一个分块头就占满了缓冲区
+    if (m_read_idx == READ_BUFFER_SIZE) {
+        m_linger = false;
+        return BAD_REQUEST;
     }
     return NO_REQUEST;
 }
 
-//判断http请求是否被完整读入
-http_conn::HTTP_CODE http_conn::parse_content(char *text) {
-    //判断buffer中是否读取了消息体
-    if (m_read_idx >= (m_content_length + m_checked_idx)) {
-        text[m_content_length] = '\0';
-        //POST请求中最后为输入的用户名和密码
-        m_string = text;
-        return GET_REQUEST;
+//data位于m_read_buf中已解码位置之后，可以原地前移
+bool http_conn::append_body(char *data, int len) {
+    if (m_request.body_fd < 0) {
+        //留一个字节放'\0'
+        if (m_body_start + m_body_len + len < READ_BUFFER_SIZE) {
+            memmove(m_read_buf + m_body_start + m_body_len, data, len);
+            m_body_len += len;
+            return true;
+        }
+        if (!spool_body())
+            return false;
+    }
+    while (len > 0) {
+        ssize_t n = ::write(m_request.body_fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool http_conn::spool_body() {
+    //O_TMPFILE的文件没有名字，关闭即删除；不支持时退回mkstemp后立即unlink
+    int fd = open(m_spool_dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        char path[FILENAME_LEN];
+        snprintf(path, sizeof(path), "%s/body.XXXXXX", m_spool_dir.c_str());
+        fd = mkstemp(path);
+        if (fd < 0) {
+            spdlog::error("spool request body in {0} failed: {1}", m_spool_dir, strerror(errno));
+            return false;
+        }
+        unlink(path);
+    }
+    m_request.body_fd = fd;
+    int len = m_body_len;
+    m_body_len = 0;
+    return append_body(m_read_buf + m_body_start, len);
+}
+
+bool http_conn::splice_body() {
+    if (m_spool_pipe[0] < 0 && pipe2(m_spool_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+        return false;
+    while (m_body.remaining() > 0) {
+        size_t want = m_body.remaining() < (1 << 16) ? m_body.remaining() : (1 << 16);
+        ssize_t n = splice(m_sockfd, NULL, m_spool_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0)
+            return false;
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        //管道中的数据全部写入文件后再读socket
+        for (ssize_t left = n; left > 0;) {
+            ssize_t m = splice(m_spool_pipe[0], NULL, m_request.body_fd, NULL, left, SPLICE_F_MOVE);
+            if (m <= 0)
+                return false;
+            left -= m;
+        }
+        m_body.skip(n);
+    }
+    return true;
+}
+
+void http_conn::close_body() {
+    if (m_request.body_fd >= 0) {
+        close(m_request.body_fd);
+        m_request.body_fd = -1;
+    }
+    if (m_spool_pipe[0] >= 0) {
+        close(m_spool_pipe[0]);
+        close(m_spool_pipe[1]);
+        m_spool_pipe[0] = m_spool_pipe[1] = -1;
     }
-    return NO_REQUEST;
 }
 
 http_conn::HTTP_CODE http_conn::process_read() {
@@ -259,6 +832,13 @@ http_conn::HTTP_CODE http_conn::process_read() {
     HTTP_CODE ret = NO_REQUEST;
     char *text = 0;
 
+    //HTTP/2连接前言以PRI开头，须在按行解析之前识别，h2c只用于明文连接
+    if (m_check_state == CHECK_STATE_REQUESTLINE && m_checked_idx == 0 && m_sockfd >= 0 && !m_ssl) {
+        int n = m_read_idx < h2_session::PREFACE_LEN ? m_read_idx : h2_session::PREFACE_LEN;
+        if (n > 0 && memcmp(m_read_buf, h2_session::PREFACE, n) == 0)
+            return n == h2_session::PREFACE_LEN ? H2_PREFACE : NO_REQUEST;
+    }
+
     while ((m_check_state == CHECK_STATE_CONTENT && line_status == LINE_OK) || ((line_status = parse_line()) == LINE_OK)) {
         text = get_line();
         m_start_line = m_checked_idx;
@@ -276,18 +856,20 @@ http_conn::HTTP_CODE http_conn::process_read() {
         case CHECK_STATE_HEADER:
         {
             ret = parse_headers(text);
-            if (ret == BAD_REQUEST)
-                return BAD_REQUEST;
+            if (ret == BAD_REQUEST || ret == PAYLOAD_TOO_LARGE)
+                return ret;
             else if (ret == GET_REQUEST) {
-                return do_request();
+                return m_parse_only ? GET_REQUEST : do_request();
             }
             break;
         }
         case CHECK_STATE_CONTENT:
         {
-            ret = parse_content(text);
+            ret = parse_content();
             if (ret == GET_REQUEST)
-                return do_request();
+                return m_parse_only ? GET_REQUEST : do_request();
+            if (ret != NO_REQUEST)
+                return ret;
             line_status = LINE_OPEN; // 跳出循环
             break;
         }
@@ -298,97 +880,202 @@ http_conn::HTTP_CODE http_conn::process_read() {
     return NO_REQUEST;
 }
 
+const http_conn::route_entry http_conn::m_routes[] = {
+    //页面，表单用POST提交
+    {"/", false, 1 << GET | 1 << POST, "/judge.html", &http_conn::route_page, RATE_NUM},
+    {"/0", false, 1 << GET | 1 << POST, "/register.html", &http_conn::route_page, RATE_NUM},
+    {"/1", false, 1 << GET | 1 << POST, "/log.html", &http_conn::route_page, RATE_NUM},
+    {"/5", false, 1 << GET | 1 << POST, "/picture.html", &http_conn::route_page, RATE_NUM},
+    {"/6", false, 1 << GET | 1 << POST, "/video.html", &http_conn::route_page, RATE_NUM},
+    //登录和注册，访问redis，单独限流
+    {"/2CGISQL.cgi", false, 1 << POST, NULL, &http_conn::route_login, RATE_LOGIN},
+    {"/3CGISQL.cgi", false, 1 << POST, NULL, &http_conn::route_register, RATE_LOGIN},
+    //其余路径为网站目录下的静态文件
+    {"/", true, 1 << GET | 1 << POST, NULL, &http_conn::route_static, RATE_NUM},
+};
+const int http_conn::m_route_count = sizeof(m_routes) / sizeof(m_routes[0]);
+
+const router<http_conn::route_entry> &http_conn::get_router() {
+    static router<route_entry> *table = NULL;
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    struct builder {
+        static void build() {
+            table = new router<route_entry>;
+            for (int i = 0; i < m_route_count; ++i) {
+                if (m_routes[i].prefix)
+                    table->add_prefix(m_routes[i].path, &m_routes[i]);
+                else
+                    table->add(m_routes[i].path, &m_routes[i]);
+            }
+            table->build();
+        }
+    };
+    pthread_once(&once, builder::build);
+    return *table;
+}
+
 http_conn::HTTP_CODE http_conn::do_request() {
-    //将初始化的m_real_file赋值为网站根目录
-    strcpy(m_real_file, doc_root);
-    int len = strlen(doc_root);
-    //找到m_url中/的位置
-    const char *p = strrchr(m_url, '/');
-
-    //处理cgi
-    if (cgi == 1 && (*(p + 1) == '2' || *(p + 1) == '3')) {
-
-        //根据标志判断是登录检测还是注册检测
-        //char flag = m_url[1];
-
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/");
-        strcat(m_url_real, m_url + 2);
-        strncpy(m_real_file + len, m_url_real, FILENAME_LEN - len - 1);
-        free(m_url_real);
-
-        //将用户名和密码提取出来
-        //user=123&passwd=123
-        char name[100], password[100];
-        int i;
-        for (i = 5; m_string[i] != '&'; ++i)
-            name[i - 5] = m_string[i];
-        name[i - 5] = '\0';
-
-        int j = 0;
-        for (i = i + 10; m_string[i] != '\0'; ++i, ++j)
-            password[j] = m_string[i];
-        password[j] = '\0';
-
-        if (*(p + 1) == '3') {
-            //如果是注册，先检测数据库中是否有重名的
-            //没有重名的，进行增加数据
-            redisReply* reply = static_cast<redisReply*>(redisCommand(redis, "GET %s", name));
-            if(reply->str == nullptr) {
-                m_lock.lock();
-                redisCommand(redis, "SET %s %s", name, password);
-                m_lock.unlock();
-                strcpy(m_url, "/log.html");
-            }else
-                strcpy(m_url, "/registerError.html");
-        }
-        //如果是登录，直接判断
-        //若浏览器端输入的用户名和密码在表中可以查找到，返回1，否则返回0
-        else if (*(p + 1) == '2') {
-            redisReply* reply = static_cast<redisReply*>(redisCommand(redis, "GET %s", name));
-            std::string ch = reply->str;
-            std::string passwdStr = password;
-            if(reply->str == passwdStr) {
-                strcpy(m_url, "/welcome.html");
-            }else
-                strcpy(m_url, "/logError.html");
-            
-        }
-    }
-
-    if (*(p + 1) == '0') {
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/register.html");
-        //将网站目录和/register.html进行拼接，更新到m_real_file中
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-
-        free(m_url_real);
-    }
-    else if (*(p + 1) == '1') {
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/log.html");
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-
-        free(m_url_real);
-    }
-    else if (*(p + 1) == '5') {
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/picture.html");
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-
-        free(m_url_real);
-    }
-    else if (*(p + 1) == '6') {
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/video.html");
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-
-        free(m_url_real);
-    }
-    //如果以上均不符合，即不是登录和注册，直接将url与网站目录拼接
-    //这里的情况是welcome界面，请求服务器上的一个图片
-    else strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
+    m_trace.stamp(TP_PARSE);
+    //h2c升级，带消息体的请求仍按HTTP/1.1处理
+    const char *upgrade = m_request.get_cstr(H_UPGRADE);
+    if (upgrade && !m_h2 && !m_ssl && m_sockfd >= 0 && strcasecmp(upgrade, "h2c") == 0 &&
+        m_request.get("HTTP2-Settings").data() && m_content_length == 0 && !m_body.chunked())
+        return H2_UPGRADE;
+    const std::string_view &path = m_request.path;
+    proxy_table *proxies = proxy_table::get_instance();
+    if (!proxies->empty()) {
+        upstream_group *group = proxies->find(path);
+        if (group)
+            return start_proxy(group);
+    }
+    const router<route_entry> &table = get_router();
+    const route_entry *route = table.find(path.data(), path.size());
+    //方法不匹配时按前缀路由处理
+    if (!route || !(route->methods & (1 << m_method)))
+        route = table.find_prefix(path.data(), path.size());
+    if (!route || !(route->methods & (1 << m_method)))
+        return BAD_REQUEST;
+    if (route->limit != RATE_NUM && !rate_limiter::get_instance()->allow(route->limit, m_address.sin_addr.s_addr))
+        return TOO_MANY_REQUESTS;
+    return (this->*route->handler)(*route);
+}
+
+//路径段是否为..，点也可以写成%2e，不解码也拒绝，避免之后增加解码时漏掉
+static bool is_dot_dot(const char *seg, int len) {
+    int dots = 0;
+    for (int i = 0; i < len; ++dots) {
+        if (seg[i] == '.')
+            i += 1;
+        else if (i + 3 <= len && seg[i] == '%' && seg[i + 1] == '2' && (seg[i + 2] == 'e' || seg[i + 2] == 'E'))
+            i += 3;
+        else
+            return false;
+    }
+    return dots == 2;
+}
+
+bool http_conn::set_real_file(const char *path, int len) {
+    //含..的路径可以访问网站目录之外的文件
+    for (int i = 0; i < len;) {
+        int end = i;
+        while (end < len && path[end] != '/')
+            ++end;
+        if (is_dot_dot(path + i, end - i))
+            return false;
+        i = end + 1;
+    }
+    int root_len = strlen(doc_root);
+    if (root_len + len >= FILENAME_LEN)
+        return false;
+    memcpy(m_real_file, doc_root, root_len);
+    memcpy(m_real_file + root_len, path, len);
+    m_real_file[root_len + len] = '\0';
+    return true;
+}
+
+http_conn::HTTP_CODE http_conn::route_page(const route_entry &route) {
+    if (!set_real_file(route.page, strlen(route.page)))
+        return BAD_REQUEST;
+    //普通请求直接发送启动时生成的响应，不再打开和mmap文件
+    //只stat确认页面没有被修改，修改后按当前文件处理，ETag和消息体保持一致
+    size_t idx = &route - m_routes;
+    struct stat st;
+    if (idx < fixed_pages.size() && !fixed_pages[idx].resp[0][0].empty() && !m_request.has(H_RANGE) &&
+        !m_request.has(H_IF_RANGE) && stat(m_real_file, &st) == 0 && fixed_pages[idx].same(st)) {
+        const char *accept = m_request.get_cstr(H_ACCEPT_ENCODING);
+        bool gzip = accept && accepts_encoding(accept, "gzip") && fixed_pages[idx].gzip;
+        //条件请求按将要发送的表示判断，ETag与固定响应中的相同
+        if (m_request.has(H_IF_NONE_MATCH) || m_request.has(H_IF_MODIFIED_SINCE)) {
+            m_mtime = st.st_mtime;
+            make_etag(st, gzip ? "gz" : NULL, m_etag, sizeof(m_etag));
+            m_vary = true;
+            make_validators();
+            if (m_method == GET && not_modified())
+                return NOT_MODIFIED;
+        }
+        m_fixed = &fixed_pages[idx].resp[m_linger][gzip];
+        return FIXED_REQUEST;
+    }
+    return serve_file();
+}
+
+http_conn::HTTP_CODE http_conn::route_static(const route_entry &) {
+    if (!set_real_file(m_request.path.data(), m_request.path.size()))
+        return BAD_REQUEST;
+    return serve_file();
+}
+
+//user=123&password=123
+//用户名和密码从m_arena分配
+bool http_conn::parse_form(char **name, char **password) {
+    const char *body = m_request.body.data();
+    if (!body || strncmp(body, "user=", 5) != 0)
+        return false;
+    const char *p = body + 5;
+    int n = strcspn(p, "&");
+    if (n == 0 || strncmp(p + n, "&password=", 10) != 0)
+        return false;
+    *name = m_arena.strndup(p, n);
+    p += n + 10;
+    *password = m_arena.strndup(p, strlen(p));
+    return true;
+}
+
+http_conn::HTTP_CODE http_conn::route_register(const route_entry &) {
+    char *name, *password;
+    if (!parse_form(&name, &password))
+        return BAD_REQUEST;
 
+    //如果是注册，先检测数据库中是否有重名的
+    //没有重名的，进行增加数据
+    const char *page;
+    m_trace.stamp(TP_REDIS_BEGIN);
+    {
+        replyRAII reply(redisCommand(redis, "GET %s", name));
+        if (!reply.get() || reply.get()->type == REDIS_REPLY_ERROR) {
+            m_trace.stamp(TP_REDIS_END);
+            return INTERNAL_ERROR;
+        }
+        if (reply.get()->type == REDIS_REPLY_NIL) {
+            //SETNX避免两个请求同时注册同一用户名
+            replyRAII set(redisCommand(redis, "SETNX %s %s", name, password));
+            page = set.get() && set.get()->type == REDIS_REPLY_INTEGER && set.get()->integer == 1
+                       ? "/log.html" : "/registerError.html";
+        }
+        else
+            page = "/registerError.html";
+    }
+    m_trace.stamp(TP_REDIS_END);
+
+    set_real_file(page, strlen(page));
+    return serve_file();
+}
+
+//若浏览器端输入的用户名和密码在表中可以查找到，进入欢迎页，否则登录失败
+http_conn::HTTP_CODE http_conn::route_login(const route_entry &) {
+    char *name, *password;
+    if (!parse_form(&name, &password))
+        return BAD_REQUEST;
+
+    const char *page;
+    m_trace.stamp(TP_REDIS_BEGIN);
+    {
+        replyRAII reply(redisCommand(redis, "GET %s", name));
+        if (!reply.get() || reply.get()->type == REDIS_REPLY_ERROR) {
+            m_trace.stamp(TP_REDIS_END);
+            return INTERNAL_ERROR;
+        }
+        //用户不存在时回复为nil
+        const char *stored = reply.str();
+        page = stored && strcmp(stored, password) == 0 ? "/welcome.html" : "/logError.html";
+    }
+    m_trace.stamp(TP_REDIS_END);
+
+    set_real_file(page, strlen(page));
+    return serve_file();
+}
+
+http_conn::HTTP_CODE http_conn::serve_file() {
     //通过stat获取请求资源文件信息，成功则将信息更新到m_file_stat结构体
     if (stat(m_real_file, &m_file_stat) < 0)
         return NO_RESOURCE;//失败返回NO_RESOURCE状态，表示资源不存在
@@ -398,16 +1085,288 @@ http_conn::HTTP_CODE http_conn::do_request() {
         return FORBIDDEN_REQUEST;
     
     //判断文件类型，如果是目录，则返回BAD_REQUEST，表示请求报文有误
-    if (S_ISDIR(m_file_stat.st_mode))
-        return BAD_REQUEST;
+    //开启autoindex时，以/结尾的目录返回目录列表
+    if (S_ISDIR(m_file_stat.st_mode)) {
+        const std::string_view &path = m_request.path;
+        if (!m_autoindex.load(std::memory_order_relaxed) || m_method != GET || path.back() != '/')
+            return BAD_REQUEST;
+        DIR *dir = opendir(m_real_file);
+        if (!dir)
+            return FORBIDDEN_REQUEST;
+        void *mem = m_arena.alloc(sizeof(dir_listing), alignof(dir_listing));
+        return start_stream(new (mem) dir_listing(dir, path.data(), path.size()), "text/html; charset=utf-8");
+    }
+
+    select_encoding();
+
+    //缓存仍然有效时只回复304，不打开文件
+    make_validators();
+    if (m_method == GET && not_modified())
+        return NOT_MODIFIED;
+
+    //Range无法满足时不需要映射文件
+    if (parse_range() == RANGE_NOT_SATISFIABLE)
+        return RANGE_NOT_SATISFIABLE;
 
-    //判断文件类型，如果是目录，则返回BAD_REQUEST，表示请求报文有误
     int fd = open(m_real_file, O_RDONLY);
     m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     close(fd);
     return FILE_REQUEST;
 }
 
+http_conn::HTTP_CODE http_conn::start_stream(response_stream *stream, const char *content_type) {
+    m_stream = stream;
+    m_stream_buf = (char *)m_arena.alloc(STREAM_BUFFER_SIZE, 1);
+    m_stream_end = false;
+    m_content_type = content_type;
+    return STREAM_REQUEST;
+}
+
+//分块格式：长度(十六进制)\r\n 数据 \r\n，最后是 0\r\n\r\n
+//多次produce的小块合并成一个分块，缓冲区满或生成完毕才交给writev
+bool http_conn::fill_stream() {
+    static const int HEAD = 8, TAIL = 7;
+    char *data = m_stream_buf + HEAD;
+    int cap = STREAM_BUFFER_SIZE - HEAD - TAIL;
+    int len = 0;
+    while (len < cap && !m_stream_end) {
+        int n = m_stream->produce(data + len, cap - len);
+        if (n == response_stream::STREAM_END)
+            m_stream_end = true;
+        else if (n == response_stream::STREAM_FULL && len > 0)
+            break;
+        else if (n < 0)
+            return false;
+        else
+            len += n;
+    }
+
+    char *begin = data;
+    int total = 0;
+    if (len > 0) {
+        char head[HEAD];
+        int h = snprintf(head, sizeof(head), "%x\r\n", len);
+        begin -= h;
+        memcpy(begin, head, h);
+        total = h + len;
+        memcpy(begin + total, "\r\n", 2);
+        total += 2;
+    }
+    if (m_stream_end) {
+        memcpy(begin + total, "0\r\n\r\n", 5);
+        total += 5;
+    }
+    m_iv[m_iv_count].iov_base = begin;
+    m_iv[m_iv_count].iov_len = total;
+    ++m_iv_count;
+    bytes_to_send += total;
+    return true;
+}
+
+void http_conn::end_stream() {
+    if (m_stream) {
+        m_stream->~response_stream();
+        m_stream = NULL;
+    }
+}
+
+void http_conn::select_encoding() {
+    const mime_type *mime = find_mime_type(m_real_file);
+    m_mtime = m_file_stat.st_mtime;
+    make_etag(m_file_stat, NULL, m_etag, sizeof(m_etag));
+    m_content_type = mime->type;
+    m_content_encoding = 0;
+    m_vary = mime->compressible;
+    const char *accept = m_request.get_cstr(H_ACCEPT_ENCODING);
+    if (!mime->compressible || m_method != GET || !accept)
+        return;
+
+    //优先使用预压缩的.br/.gz，须比原文件新，按纳秒比较，同一秒内修改的原文件不会被旧的压缩文件覆盖
+    struct stat st;
+    size_t len = strlen(m_real_file);
+    static const char *const codings[][2] = {{"br", ".br"}, {"gzip", ".gz"}};
+    for (int i = 0; i < 2; ++i) {
+        if (len + 3 >= FILENAME_LEN || !accepts_encoding(accept, codings[i][0]))
+            continue;
+        strcpy(m_real_file + len, codings[i][1]);
+        if (stat(m_real_file, &st) == 0 && S_ISREG(st.st_mode) &&
+            (st.st_mtim.tv_sec > m_file_stat.st_mtim.tv_sec ||
+             (st.st_mtim.tv_sec == m_file_stat.st_mtim.tv_sec && st.st_mtim.tv_nsec >= m_file_stat.st_mtim.tv_nsec))) {
+            make_etag(m_file_stat, codings[i][1] + 1, m_etag, sizeof(m_etag));
+            m_file_stat = st;
+            m_content_encoding = codings[i][0];
+            return;
+        }
+        m_real_file[len] = '\0';
+    }
+
+    //没有预压缩文件时查找后台压缩的缓存，未命中则本次发送原文件
+    compressor *gz = compressor::get_instance();
+    if (!gz->enabled() || !accepts_encoding(accept, "gzip"))
+        return;
+    char *path = (char *)m_arena.alloc(FILENAME_LEN, 1);
+    bool queued = false;
+    if (gz->lookup(m_real_file, m_file_stat, path, FILENAME_LEN, st, &queued)) {
+        strcpy(m_real_file, path);
+        make_etag(m_file_stat, "gz", m_etag, sizeof(m_etag));
+        m_file_stat = st;
+        m_content_encoding = "gzip";
+    }
+    //投递压缩任务需要分配内存，不计入热路径
+    m_alloc_exempt = queued;
+}
+
+//ETag已在select_encoding中按原文件生成
+void http_conn::make_validators() {
+    http_date(m_mtime, m_last_modified, sizeof(m_last_modified));
+
+    m_cache_control = m_method == GET ? find_cache_control(m_request.target.data()) : NULL;
+}
+
+//If-None-Match存在时忽略If-Modified-Since
+bool http_conn::not_modified() {
+    const char *if_none_match = m_request.get_cstr(H_IF_NONE_MATCH);
+    const char *if_modified_since = m_request.get_cstr(H_IF_MODIFIED_SINCE);
+    if (if_none_match) {
+        const char *p = if_none_match;
+        size_t etag_len = strlen(m_etag);
+        while (*p) {
+            p += strspn(p, " \t,");
+            if (*p == '*')
+                return true;
+            //If-None-Match使用弱比较，忽略W/前缀
+            if (strncmp(p, "W/", 2) == 0)
+                p += 2;
+            size_t len = strcspn(p, " \t,");
+            if (len == etag_len && strncmp(p, m_etag, len) == 0)
+                return true;
+            p += len;
+        }
+        return false;
+    }
+    if (if_modified_since) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (!end)
+            return false;
+        return m_mtime <= timegm(&tm);
+    }
+    return false;
+}
+
+//解析 bytes=a-b,c-,-n 形式的区间
+//语法错误、区间过多或If-Range不匹配时忽略Range，按整个文件返回
+//所有区间都超出文件长度时返回RANGE_NOT_SATISFIABLE
+http_conn::HTTP_CODE http_conn::parse_range() {
+    m_range_count = 0;
+    const char *range = m_request.get_cstr(H_RANGE);
+    const char *if_range = m_request.get_cstr(H_IF_RANGE);
+    if (!range || m_method != GET)
+        return FILE_REQUEST;
+
+    //If-Range只在与当前文件的ETag(强比较)或Last-Modified一致时才按区间返回
+    if (if_range) {
+        const char *validator = if_range[0] == '"' ? m_etag : m_last_modified;
+        if (strcmp(if_range, validator) != 0)
+            return FILE_REQUEST;
+    }
+
+    if (strncasecmp(range, "bytes=", 6) != 0)
+        return FILE_REQUEST;
+    const char *p = range + 6;
+    off_t size = m_file_stat.st_size;
+    int count = 0;
+    bool any = false;
+    while (*p) {
+        p += strspn(p, " \t");
+        off_t first = -1, last = -1;
+        char *end;
+        if (*p == '-') {
+            //后缀区间：最后n个字节
+            long long n = strtoll(p + 1, &end, 10);
+            if (end == p + 1 || n < 0)
+                return FILE_REQUEST;
+            if (n > 0 && size > 0) {
+                first = n >= size ? 0 : size - n;
+                last = size - 1;
+            }
+        }
+        else {
+            long long a = strtoll(p, &end, 10);
+            if (end == p || a < 0 || *end != '-')
+                return FILE_REQUEST;
+            p = end + 1;
+            long long b = size - 1;
+            if (*p >= '0' && *p <= '9') {
+                b = strtoll(p, &end, 10);
+                if (b < a)
+                    return FILE_REQUEST;
+            }
+            else
+                end = (char *)p;
+            if (a < size) {
+                first = a;
+                last = b >= size ? size - 1 : b;
+            }
+        }
+        p = end + strspn(end, " \t");
+        if (*p == ',')
+            ++p;
+        else if (*p != '\0')
+            return FILE_REQUEST;
+
+        //超出文件长度的区间直接丢弃
+        if (first < 0)
+            continue;
+        any = true;
+        if (count == MAX_RANGES)
+            return FILE_REQUEST;
+        m_ranges[count].first = first;
+        m_ranges[count].last = last;
+        ++count;
+    }
+    if (!any)
+        return RANGE_NOT_SATISFIABLE;
+
+    //按起点排序并合并重叠或相邻的区间，避免重复发送同一段数据
+    for (int i = 1; i < count; ++i) {
+        byte_range r = m_ranges[i];
+        int j = i - 1;
+        for (; j >= 0 && m_ranges[j].first > r.first; --j)
+            m_ranges[j + 1] = m_ranges[j];
+        m_ranges[j + 1] = r;
+    }
+    int merged = 0;
+    for (int i = 1; i < count; ++i) {
+        if (m_ranges[i].first <= m_ranges[merged].last + 1) {
+            if (m_ranges[i].last > m_ranges[merged].last)
+                m_ranges[merged].last = m_ranges[i].last;
+        }
+        else
+            m_ranges[++merged] = m_ranges[i];
+    }
+    m_range_count = merged + 1;
+
+    //只请求整个文件时按200返回
+    if (m_range_count == 1 && m_ranges[0].first == 0 && m_ranges[0].last == size - 1)
+        m_range_count = 0;
+    return FILE_REQUEST;
+}
+
+http_conn::HTTP_CODE http_conn::parse_buffer(const char *data, int len, bool parse_only) {
+    init();
+    if (len > READ_BUFFER_SIZE)
+        len = READ_BUFFER_SIZE;
+    memcpy(m_read_buf, data, len);
+    m_read_idx = len;
+    m_parse_only = parse_only;
+    HTTP_CODE ret = process_read();
+    m_parse_only = false;
+    unmap();
+    return ret;
+}
+
 void http_conn::unmap() {
     if (m_file_address) {
         munmap(m_file_address, m_file_stat.st_size);
@@ -418,6 +1377,25 @@ void http_conn::unmap() {
 bool http_conn::write() {
     int temp = 0;
 
+    if (m_ssl && m_tls_handshake) {
+        if (!tls_handshake())
+            return false;
+        modfd(m_epollfd, m_sockfd, m_tls_handshake && m_tls_want_write ? EPOLLOUT : EPOLLIN);
+        return true;
+    }
+
+    if (m_proxy)
+        return run_proxy();
+
+    if (m_h2) {
+        if (!m_h2->flush(m_sockfd) || m_h2->finished()) {
+            close_h2();
+            return false;
+        }
+        modfd(m_epollfd, m_sockfd, m_h2->want_write() ? EPOLLOUT : EPOLLIN);
+        return true;
+    }
+
     //若要发送的数据长度为0 表示响应报文为空，一般不会出现这种情况
     if (bytes_to_send == 0) {
         modfd(m_epollfd, m_sockfd, EPOLLIN);
@@ -427,7 +1405,7 @@ bool http_conn::write() {
 
     while (1) {
         //将响应报文的状态行、消息头、空行和响应正文发送给浏览器端
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        temp = send_iov(m_iv + m_iv_idx, m_iv_count - m_iv_idx);
 
         if (temp < 0) {
             //判断缓冲区是否满了
@@ -436,27 +1414,39 @@ bool http_conn::write() {
                 return true;
             }
             unmap();
+            end_stream();
             return false;
         }
 
         //正常发送，temp为发送的字节数
         bytes_have_send += temp;
         bytes_to_send -= temp;
-        //第一个iovec头部信息的数据已发送完，发送第二个iovec数据
-        if (bytes_have_send >= m_iv[0].iov_len) {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
+        //跳过已发送完的iovec，部分发送的iovec向后偏移
+        size_t sent = temp;
+        while (m_iv_idx < m_iv_count && sent >= m_iv[m_iv_idx].iov_len) {
+            sent -= m_iv[m_iv_idx].iov_len;
+            ++m_iv_idx;
         }
-        //继续发送第一个iovec头部信息的数据
-        else {
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - bytes_have_send;
+        if (m_iv_idx < m_iv_count) {
+            m_iv[m_iv_idx].iov_base = (char *)m_iv[m_iv_idx].iov_base + sent;
+            m_iv[m_iv_idx].iov_len -= sent;
         }
 
         //判断条件，数据已全部发送完
         if (bytes_to_send <= 0) {
+            //chunked响应还有后续分块，上一块发完后才继续生成
+            if (m_stream && !m_stream_end) {
+                m_iv_count = m_iv_idx = 0;
+                if (!fill_stream()) {
+                    end_stream();
+                    return false;
+                }
+                continue;
+            }
             unmap();
+            end_stream();
+            m_trace.stamp(TP_WRITE);
+            m_trace.finish(m_request.target.data());
             modfd(m_epollfd, m_sockfd, EPOLLIN);
             //浏览器的请求为长连接
             if (m_linger) {
@@ -469,91 +1459,198 @@ bool http_conn::write() {
     }
 }
 
-bool http_conn::add_response(const char *format, ...) {
-    if (m_write_idx >= WRITE_BUFFER_SIZE)
-        return false;
-    va_list arg_list;//定义可变参数列表
-    va_start(arg_list, format);//将变量arg_list初始化为传入参数
-    //将数据format从可变参数列表写入缓冲区写，返回写入数据的长度
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
-    //如果写入的数据长度超过缓冲区剩余空间，则报错
-    if (len >= (WRITE_BUFFER_SIZE - 1 - m_write_idx)) {
-        va_end(arg_list);
-        return false;
-    }
-    //更新m_write_idx位置
-    m_write_idx += len;
-    va_end(arg_list);//清空可变参列表
-    spdlog::info("request:{0}", m_write_buf);
-
-    return true;
-}
-
-//添加状态行
+//添加状态行，随后是缓存的Date和Server
 bool http_conn::add_status_line(int status, const char *title) {
-    return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
+    response_builder b = builder();
+    return b.status_line(status, title) && date_cache::append_to(b);
 }
 //添加消息报头，具体的添加文本长度、连接状态和空行
-bool http_conn::add_headers(int content_len) {
+bool http_conn::add_headers(long long content_len) {
     return add_content_length(content_len) && add_linger() &&
            add_blank_line();
 }
 //添加Content-Length，表示响应报文的长度
-bool http_conn::add_content_length(int content_len) {
-    return add_response("Content-Length:%d\r\n", content_len);
+bool http_conn::add_content_length(long long content_len) {
+    return builder().header(HDR("Content-Length"), content_len);
 }
-//添加文本类型，这里是html
+//添加文本类型及压缩编码
 bool http_conn::add_content_type() {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    response_builder b = builder();
+    if (!b.header(HDR("Content-Type"), m_content_type))
+        return false;
+    return !m_content_encoding || b.header(HDR("Content-Encoding"), m_content_encoding);
+}
+bool http_conn::add_stream_headers() {
+    add_status_line(200, ok_200_title);
+    return add_content_type() && builder().append("Transfer-Encoding:chunked\r\n") && add_linger() &&
+           add_blank_line();
 }
 //添加连接状态，通知浏览器端是保持连接还是关闭
 bool http_conn::add_linger() {
-    return add_response("Connection:%s\r\n", (m_linger == true) ? "keep-alive" : "close");
+    return builder().header(HDR("Connection"), m_linger ? "keep-alive" : "close");
 }
 //添加空行
 bool http_conn::add_blank_line() {
-    return add_response("%s", "\r\n");
+    return builder().blank_line();
 }
 //添加文本content
 bool http_conn::add_content(const char *content) {
-    return add_response("%s", content);
+    return builder().append(content);
+}
+//在状态行之后插入当前的Date和Server，其余部分直接引用固定响应
+bool http_conn::add_fixed(const std::string &response) {
+    const char *data = response.data();
+    size_t line = (const char *)memchr(data, '\n', response.size()) - data + 1;
+    response_builder b = builder();
+    if (!date_cache::append_to(b))
+        return false;
+    m_iv[0].iov_base = (void *)data;
+    m_iv[0].iov_len = line;
+    m_iv[1].iov_base = m_write_buf;
+    m_iv[1].iov_len = m_write_idx;
+    m_iv[2].iov_base = (void *)(data + line);
+    m_iv[2].iov_len = response.size() - line;
+    m_iv_count = 3;
+    bytes_to_send = response.size() + m_write_idx;
+    return true;
+}
+bool http_conn::add_validators() {
+    response_builder b = builder();
+    if (!b.header(HDR("Last-Modified"), m_last_modified) || !b.header(HDR("ETag"), m_etag))
+        return false;
+    if (m_cache_control && !b.header(HDR("Cache-Control"), m_cache_control))
+        return false;
+    return !m_vary || b.header(HDR("Vary"), "Accept-Encoding");
+}
+bool http_conn::add_partial_content() {
+    off_t size = m_file_stat.st_size;
+    response_builder b = builder();
+    add_status_line(206, partial_206_title);
+    if (!add_validators())
+        return false;
+    m_iv[0].iov_base = m_write_buf;
+    m_iv_count = 1;
+    if (m_range_count == 1) {
+        off_t first = m_ranges[0].first, last = m_ranges[0].last;
+        if (!add_content_type() || !b.append("Accept-Ranges:bytes\r\nContent-Range:bytes ") ||
+            !b.append_int(first) || !b.append("-", 1) || !b.append_int(last) || !b.append("/", 1) ||
+            !b.append_int(size) || !b.blank_line() || !add_headers(last - first + 1))
+            return false;
+        m_iv[0].iov_len = m_write_idx;
+        m_iv[1].iov_base = m_file_address + first;
+        m_iv[1].iov_len = last - first + 1;
+        m_iv_count = 2;
+        bytes_to_send = m_write_idx + (last - first + 1);
+        return true;
+    }
+
+    //多区间：每个分段头写入m_part_buf，文件片段直接指向mmap的地址
+    char boundary[40];
+    snprintf(boundary, sizeof(boundary), "%08lx%08lx", (unsigned long)m_file_stat.st_ino,
+             (unsigned long)m_file_stat.st_mtime);
+    int part_idx = 0;
+    long long body_len = 0;
+    for (int i = 0; i < m_range_count; ++i) {
+        off_t first = m_ranges[i].first, last = m_ranges[i].last;
+        int len = snprintf(m_part_buf + part_idx, PART_BUFFER_SIZE - part_idx,
+                           "%s--%s\r\nContent-Type:%s\r\nContent-Range:bytes %lld-%lld/%lld\r\n\r\n",
+                           i == 0 ? "" : "\r\n", boundary, m_content_type, (long long)first,
+                           (long long)last, (long long)size);
+        if (len >= PART_BUFFER_SIZE - part_idx)
+            return false;
+        m_iv[m_iv_count].iov_base = m_part_buf + part_idx;
+        m_iv[m_iv_count].iov_len = len;
+        m_iv[m_iv_count + 1].iov_base = m_file_address + first;
+        m_iv[m_iv_count + 1].iov_len = last - first + 1;
+        m_iv_count += 2;
+        part_idx += len;
+        body_len += len + (last - first + 1);
+    }
+    int len = snprintf(m_part_buf + part_idx, PART_BUFFER_SIZE - part_idx, "\r\n--%s--\r\n", boundary);
+    if (len >= PART_BUFFER_SIZE - part_idx)
+        return false;
+    m_iv[m_iv_count].iov_base = m_part_buf + part_idx;
+    m_iv[m_iv_count].iov_len = len;
+    ++m_iv_count;
+    body_len += len;
+
+    if (!b.append("Accept-Ranges:bytes\r\nContent-Type:multipart/byteranges; boundary=") ||
+        !b.append(boundary) || !b.blank_line() ||
+        (m_content_encoding && !b.header(HDR("Content-Encoding"), m_content_encoding)) ||
+        !add_headers(body_len))
+        return false;
+    m_iv[0].iov_len = m_write_idx;
+    bytes_to_send = m_write_idx + body_len;
+    return true;
 }
 bool http_conn::process_write(HTTP_CODE ret) {
     switch (ret)
     {
+    //错误页和固定路由使用预先生成的响应
     //内部错误，500
     case INTERNAL_ERROR:
+        return add_fixed(fixed_error(FIXED_500, m_linger));
+    //报文语法有误，400
+    case BAD_REQUEST:
+        return add_fixed(fixed_error(FIXED_400, m_linger));
+    //资源不存在，404
+    case NO_RESOURCE:
+        return add_fixed(fixed_error(FIXED_404, m_linger));
+    //资源没有访问权限，403
+    case FORBIDDEN_REQUEST:
+        return add_fixed(fixed_error(FIXED_403, m_linger));
+    //消息体超过上限，413
+    case PAYLOAD_TOO_LARGE:
+        return add_fixed(fixed_error(FIXED_413, m_linger));
+    //后端不可用，502
+    case BAD_GATEWAY:
+        return add_fixed(fixed_error(FIXED_502, m_linger));
+    //超过限流，429
+    case TOO_MANY_REQUESTS:
+        return add_fixed(fixed_error(FIXED_429, m_linger));
+    case FIXED_REQUEST:
+        return add_fixed(*m_fixed);
+    //动态生成的内容，chunked
+    case STREAM_REQUEST:
     {
-        add_status_line(500, error_500_title);
-        add_headers(strlen(error_500_form));
-        if (!add_content(error_500_form))
+        if (!add_stream_headers())
             return false;
-        break;
+        m_iv[0].iov_base = m_write_buf;
+        m_iv[0].iov_len = m_write_idx;
+        m_iv_count = 1;
+        bytes_to_send = m_write_idx;
+        return fill_stream();
     }
-    //报文语法有误，404
-    case BAD_REQUEST:
+    //缓存有效，304，只有头部
+    case NOT_MODIFIED:
     {
-        add_status_line(404, error_404_title);
-        add_headers(strlen(error_404_form));
-        if (!add_content(error_404_form))
+        add_status_line(304, not_modified_304_title);
+        if (!add_validators() || !add_linger() || !add_blank_line())
             return false;
         break;
     }
-    //资源没有访问权限，403
-    case FORBIDDEN_REQUEST:
+    //区间超出文件长度，416
+    case RANGE_NOT_SATISFIABLE:
     {
-        add_status_line(403, error_403_title);
-        add_headers(strlen(error_403_form));
-        if (!add_content(error_403_form))
+        add_status_line(416, error_416_title);
+        response_builder b = builder();
+        b.append("Content-Range:bytes */") && b.append_int(m_file_stat.st_size) && b.blank_line();
+        add_headers(strlen(error_416_form));
+        if (!add_content(error_416_form))
             return false;
         break;
     }
-    //文件存在，200
+    //文件存在，200，带Range时为206
     case FILE_REQUEST:
     {
+        if (m_range_count > 0)
+            return add_partial_content();
         add_status_line(200, ok_200_title);
         //如果请求的资源存在
         if (m_file_stat.st_size != 0) {
+            add_validators();
+            add_content_type();
+            builder().append("Accept-Ranges:bytes\r\n");
             add_headers(m_file_stat.st_size);
             //第一个iovec指针指向响应报文缓冲区，长度指向m_write_idx
             m_iv[0].iov_base = m_write_buf;
@@ -588,17 +1685,282 @@ bool http_conn::process_write(HTTP_CODE ret) {
 //子线程通过process函数对任务进行处理
 //调用process_read函数和process_write函数分别完成报文解析与报文响应两个任务
 void http_conn::process() {
+#ifdef ALLOC_COUNT
+    uint64_t allocs = alloc_counter::count();
+#endif
+    if (m_proxy) {
+        if (!run_proxy())
+            close_conn();
+        return;
+    }
+    if (m_h2) {
+        process_h2();
+        return;
+    }
+    //握手未完成，等待对方的数据或socket可写；握手和请求头共用一个截止时刻
+    if (m_ssl && m_tls_handshake) {
+        update_deadline();
+        modfd(m_epollfd, m_sockfd, m_tls_want_write ? EPOLLOUT : EPOLLIN);
+        return;
+    }
     HTTP_CODE read_ret = process_read();
+    //TLS库中已解密、未读出的数据不会再触发EPOLLIN
+    while (read_ret == NO_REQUEST && m_ssl && SSL_pending(m_ssl) > 0 && m_read_idx < READ_BUFFER_SIZE) {
+        if (!read_once()) {
+            close_conn();
+            return;
+        }
+        read_ret = process_read();
+    }
+    //未进入do_request的请求(如报文错误)在这里记录解析完成
+    m_trace.stamp_once(TP_PARSE);
     //NO_REQUEST，表示请求不完整，需要继续接收请求数据
     if (read_ret == NO_REQUEST) {
+        update_deadline();
         //注册并监听读事件
         modfd(m_epollfd, m_sockfd, EPOLLIN);
         return;
     }
+    if (read_ret == H2_PREFACE || read_ret == H2_UPGRADE) {
+        start_h2(read_ret == H2_UPGRADE);
+        return;
+    }
+    if (read_ret == PROXY_REQUEST) {
+        if (!run_proxy())
+            close_conn();
+        return;
+    }
     bool write_ret = process_write(read_ret);
+    //处理函数已用完消息体，临时文件不必等到连接关闭
+    close_body();
+    m_trace.stamp(TP_PROCESS);
+#ifdef ALLOC_COUNT
+    //静态文件的GET从解析到生成响应都不应调用malloc
+    if (m_method == GET && !m_alloc_exempt &&
+        (read_ret == FILE_REQUEST || read_ret == FIXED_REQUEST || read_ret == NOT_MODIFIED)) {
+        uint64_t n = alloc_counter::count() - allocs;
+        if (n != 0)
+            spdlog::error("{0} malloc calls on static path {1}", n, m_request.target.data());
+        assert(n == 0);
+    }
+#endif
     if (!write_ret) {
         close_conn();
     }
     //注册并监听写事件
     modfd(m_epollfd, m_sockfd, EPOLLOUT);
-}
\ No newline at end of file
+}
+
+void http_conn::start_h2(bool upgrade) {
+    //升级时客户端在收到101后才发送连接前言
+    m_h2 = new h2_session(this, !upgrade);
+    int rest = upgrade ? m_checked_idx : h2_session::PREFACE_LEN;
+    if (upgrade) {
+        static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection:Upgrade\r\nUpgrade:h2c\r\n\r\n";
+        m_h2->queue_raw(switching, sizeof(switching) - 1);
+    }
+    m_h2->start();
+    if (upgrade) {
+        //原请求转换为流1的头部，去掉逐跳的头部
+        std::string headers;
+        headers.append(":method").push_back('\0');
+        headers.append(m_request.method).push_back('\0');
+        headers.append(":path").push_back('\0');
+        headers.append(m_request.target).push_back('\0');
+        for (int i = 0; i < m_request.header_count(); ++i) {
+            const http_request::header &h = m_request.header_at(i);
+            if (http_request::equals(h.name, "connection") || http_request::equals(h.name, "upgrade") ||
+                http_request::equals(h.name, "http2-settings") || http_request::equals(h.name, "keep-alive") ||
+                http_request::equals(h.name, "te"))
+                continue;
+            for (size_t k = 0; k < h.name.size(); ++k)
+                headers.push_back(tolower(h.name[k]));
+            headers.push_back('\0');
+            headers.append(h.value).push_back('\0');
+        }
+        if (!m_h2->apply_upgrade_settings(m_request.get("HTTP2-Settings").data())) {
+            close_h2();
+            close_conn();
+            return;
+        }
+        m_h2->upgrade_stream(headers);
+    }
+    //请求之后已读入的字节属于HTTP/2
+    m_h2->feed(m_read_buf + rest, m_read_idx - rest);
+    process_h2();
+}
+
+void http_conn::process_h2() {
+    if (!m_h2->process() || !m_h2->flush(m_sockfd) || m_h2->finished()) {
+        close_conn();
+        return;
+    }
+    //写满时等待EPOLLOUT，写完前不再读取新的请求
+    modfd(m_epollfd, m_sockfd, m_h2->want_write() ? EPOLLOUT : EPOLLIN);
+}
+
+void http_conn::close_h2() {
+    delete m_h2;
+    m_h2 = NULL;
+}
+
+//请求头为 name\0value\0...，直接作为m_request的视图
+void http_conn::handle_h2(h2_stream &s) {
+    init_request();
+    m_linger = true;
+    bool bad = false;
+    std::string_view authority;
+    const char *p = s.headers.c_str(), *end = p + s.headers.size();
+    while (p < end) {
+        std::string_view name(p, strlen(p));
+        const char *v = p + name.size() + 1;
+        std::string_view value(v, strlen(v));
+        p = v + value.size() + 1;
+        if (name.empty())
+            bad = true;
+        else if (name == ":method")
+            m_request.method = value;
+        else if (name == ":path")
+            m_request.target = value;
+        else if (name == ":authority")
+            authority = value;
+        else if (name[0] != ':' && m_request.add(name, value) < 0)
+            bad = true;
+    }
+    if (authority.data() && !m_request.has(H_HOST))
+        m_request.add("host", authority);
+    m_request.version = "HTTP/2.0";
+    m_request.path = m_request.target.substr(0, m_request.target.find('?'));
+    m_request.body = std::string_view(s.body);
+    m_content_length = s.body.size();
+    if (m_request.method == "GET")
+        m_method = GET;
+    else if (m_request.method == "POST") {
+        m_method = POST;
+        cgi = 1;
+    }
+    else
+        bad = true;
+    if (m_request.target.empty() || m_request.target[0] != '/')
+        bad = true;
+
+    HTTP_CODE ret = bad ? BAD_REQUEST : s.body_too_large ? PAYLOAD_TOO_LARGE : do_request();
+    if (ret == STREAM_REQUEST) {
+        //目录列表等动态内容一次生成完，带Content-Length发送
+        std::string body;
+        int n;
+        while ((n = m_stream->produce(m_stream_buf, STREAM_BUFFER_SIZE)) > 0)
+            body.append(m_stream_buf, n);
+        end_stream();
+        if (n == response_stream::STREAM_END) {
+            hpack_encoder::status(200, s.resp_headers);
+            char len[24];
+            int l = snprintf(len, sizeof(len), "%zu", body.size());
+            hpack_encoder::header("content-type", 12, m_content_type, strlen(m_content_type), s.resp_headers);
+            hpack_encoder::header("content-length", 14, len, l, s.resp_headers);
+            s.add_body(body.data(), body.size(), false);
+            return;
+        }
+        ret = INTERNAL_ERROR;
+    }
+    if (!process_write(ret)) {
+        unmap();
+        m_write_idx = 0;
+        process_write(INTERNAL_ERROR);
+    }
+    convert_h2(s);
+    close_body();
+}
+
+void http_conn::convert_h2(h2_stream &s) {
+    //响应头可能跨多个iovec(固定响应)，拼接到空行为止，之后的部分是消息体
+    std::string head;
+    int i = 0;
+    size_t body_off = 0;
+    for (; i < m_iv_count; ++i) {
+        const char *base = (const char *)m_iv[i].iov_base;
+        size_t prev = head.size();
+        head.append(base, m_iv[i].iov_len);
+        size_t pos = head.find("\r\n\r\n", prev < 3 ? 0 : prev - 3);
+        if (pos != std::string::npos) {
+            body_off = pos + 4 - prev;
+            head.resize(pos + 2);
+            break;
+        }
+    }
+
+    //状态行 HTTP/1.1 200 OK
+    hpack_encoder::status(head.size() > 12 ? atoi(head.c_str() + 9) : 500, s.resp_headers);
+    size_t line = head.find("\r\n");
+    while (line != std::string::npos && line + 2 < head.size()) {
+        size_t start = line + 2;
+        line = head.find("\r\n", start);
+        size_t colon = head.find(':', start);
+        if (colon == std::string::npos || colon > line)
+            continue;
+        for (size_t k = start; k < colon; ++k)
+            head[k] = tolower(head[k]);
+        std::string_view name(head.data() + start, colon - start);
+        //HTTP/2中禁止逐跳的头部
+        if (name == "connection" || name == "keep-alive" || name == "transfer-encoding")
+            continue;
+        size_t v = colon + 1;
+        while (v < line && (head[v] == ' ' || head[v] == '\t'))
+            ++v;
+        hpack_encoder::header(name.data(), name.size(), head.data() + v, line - v, s.resp_headers);
+    }
+
+    //文件映射和固定响应直接引用，写缓冲区中的内容拷贝
+    for (; i < m_iv_count; ++i) {
+        const char *base = (const char *)m_iv[i].iov_base + body_off;
+        size_t len = m_iv[i].iov_len - body_off;
+        body_off = 0;
+        bool copy = (base >= m_write_buf && base < m_write_buf + WRITE_BUFFER_SIZE) ||
+                    (base >= m_part_buf && base < m_part_buf + PART_BUFFER_SIZE);
+        s.add_body(base, len, !copy);
+    }
+    if (m_file_address) {
+        s.map_addr = m_file_address;
+        s.map_len = m_file_stat.st_size;
+        m_file_address = 0;
+    }
+}
+
+http_conn::HTTP_CODE http_conn::start_proxy(upstream_group *group) {
+    //HTTP/2的流和离线解析不转发
+    if (m_h2 || m_sockfd < 0)
+        return BAD_GATEWAY;
+    m_alloc_exempt = true;
+    proxy_relay::client c = {m_sockfd, m_epollfd, m_ssl, m_spool_pipe, m_address};
+    m_proxy = proxy_relay::create(m_arena, group, m_request, m_body.chunked(), m_linger, c);
+    return m_proxy ? PROXY_REQUEST : INTERNAL_ERROR;
+}
+
+bool http_conn::run_proxy() {
+    proxy_relay::RESULT ret = m_proxy->run();
+    if (ret == proxy_relay::R_WAIT)
+        return true;
+    if (ret == proxy_relay::R_WAIT_CLIENT) {
+        modfd(m_epollfd, m_sockfd, EPOLLOUT);
+        return true;
+    }
+    //其余结果后端连接都已归还
+    m_linger = m_proxy->linger();
+    m_proxy = NULL;
+    if (ret == proxy_relay::R_ERROR)
+        return false;
+    close_body();
+    if (ret == proxy_relay::R_GATEWAY) {
+        if (!process_write(BAD_GATEWAY))
+            return false;
+        modfd(m_epollfd, m_sockfd, EPOLLOUT);
+        return true;
+    }
+    m_trace.stamp(TP_WRITE);
+    m_trace.finish(m_request.target.data());
+    if (!m_linger)
+        return false;
+    init_request();
+    modfd(m_epollfd, m_sockfd, EPOLLIN);
+    return true;
+}
@@ -21,10 +21,27 @@
 #include <sys/wait.h>
 #include <sys/uio.h>
 #include <map>
+#include <atomic>
+#include <string>
+#include <vector>
 #include "../log/log.h"
 #include "../locker.h"
 #include "../CGIredis/redis.h"
 #include "../timer/lst_timer.h"
+#include "../trace/req_trace.h"
+#include "../trace/traffic_capture.h"
+#include "../compress/compressor.h"
+#include "response_builder.h"
+#include "router.h"
+#include "req_arena.h"
+#include "http_request.h"
+#include "body_reader.h"
+#include "response_stream.h"
+#include "h2_session.h"
+#include "../tls/tls_context.h"
+#include "../proxy/proxy_relay.h"
+#include "../ratelimit/rate_limiter.h"
+#include "../trace/alloc_counter.h"
 
 //主状态机在内部调用从状态机,从状态机将处理状态和数据传给主状态机
 //客户端发出http连接请求
@@ -40,6 +57,16 @@ public:
     static const int READ_BUFFER_SIZE = 2048;
     //设置写缓冲区m_write_buf大小
     static const int WRITE_BUFFER_SIZE = 1024;
+    //一个请求最多支持的Range区间数，超过则忽略Range返回整个文件
+    static const int MAX_RANGES = 8;
+    //multipart/byteranges各分段头部的缓冲区大小
+    static const int PART_BUFFER_SIZE = 2048;
+    //iovec个数：响应头 + 每个区间的分段头和文件片段 + 结束边界
+    static const int MAX_IOV = 2 * MAX_RANGES + 2;
+    //chunked响应每次合并发送的最大分块，从m_arena分配
+    static const int STREAM_BUFFER_SIZE = 16384;
+    //过载时503和限流时429响应的Retry-After(秒)
+    static const int RETRY_AFTER = 1;
     //报文的请求方法，目前只有GET和POST
     enum METHOD {
         GET = 0,
@@ -67,7 +94,17 @@ public:
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
         INTERNAL_ERROR,
-        CLOSED_CONNECTION
+        CLOSED_CONNECTION,
+        RANGE_NOT_SATISFIABLE,
+        NOT_MODIFIED,
+        FIXED_REQUEST,
+        PAYLOAD_TOO_LARGE,
+        STREAM_REQUEST,
+        H2_PREFACE,      //HTTP/2连接前言(prior knowledge)
+        H2_UPGRADE,      //Upgrade: h2c
+        PROXY_REQUEST,   //转发到后端，见run_proxy
+        BAD_GATEWAY,     //后端不可用，502
+        TOO_MANY_REQUESTS //超过限流，429
     };
     //从状态机的状态
     enum LINE_STATUS {
@@ -76,6 +113,16 @@ public:
         LINE_OPEN    //不完整行
     };
 
+    //路由表的一项，新的接口只需在m_routes中添加一行
+    struct route_entry {
+        const char *path;
+        bool prefix;        //为真时按最长前缀匹配，否则精确匹配
+        int methods;        //允许的请求方法，1 << METHOD 的组合
+        const char *page;   //页面路由对应的文件，其他为空
+        HTTP_CODE (http_conn::*handler)(const route_entry &route);
+        RATE_CLASS limit;   //进入handler之前按客户端IP检查的限流类别，RATE_NUM为不限流
+    };
+
 public:
     http_conn() = default;
     ~http_conn() = default;
@@ -83,20 +130,58 @@ public:
 public:
     //初始化套接字地址，函数内部会调用私有方法init
     void init(int sockfd, const sockaddr_in &addr, char *);
+    //HTTPS监听上的连接，init之后调用，开始非阻塞握手
+    bool start_tls();
     //关闭http连接
     void close_conn(bool real_close = true);
+    //释放后端连接、TLS和HTTP/2会话、临时文件、流式响应和文件映射，不关闭socket；可重复调用
+    //定时器关闭连接时failed为真，等待中的后端计入失败
+    void release(bool failed);
     void process();
     bool read_once();//读取浏览器端发来的全部数据
     bool write();
+    //不经过socket，只设置网站根目录，用于基准测试
+    void init_offline(char *root);
+    //将内存中的请求报文拷入读缓冲区并运行主状态机，parse_only为真时不进入do_request
+    HTTP_CODE parse_buffer(const char *data, int len, bool parse_only);
+    //按路径前缀配置Cache-Control，rule形如 /static/=max-age=86400，最长前缀优先
+    static bool add_cache_control(const char *rule);
+    //请求体上限，超出READ_BUFFER_SIZE的部分写入spool_dir下的临时文件，spool_dir为NULL时不变(运行中修改上限)
+    static void set_body_limit(long long max_size, const char *spool_dir);
+    //目录请求(以/结尾)返回目录列表，默认关闭
+    static void set_autoindex(bool on) { m_autoindex.store(on, std::memory_order_relaxed); }
+    //平滑升级时旧进程排空连接：之后的HTTP/1.1响应都带Connection: close
+    static void set_draining(bool on) { m_draining.store(on, std::memory_order_relaxed); }
+    //请求头须在header_timeout秒内收完，消息体在body_timeout秒之外每收到body_min_rate字节多给1秒，0为不限
+    //一个长连接最多处理keepalive_requests个请求，最后一个响应带Connection: close，0为不限
+    static void set_deadlines(int header_timeout, int body_timeout, int body_min_rate, int keepalive_requests);
+    //当前请求的截止时刻，不随新到的数据后延；0表示只按空闲超时，由主线程在调整定时器时读取
+    time_t deadline() const { return m_deadline; }
+    //没有进行中的请求、待发送的数据和未读的输入，或对方已关闭，可以直接关闭；由主线程调用
+    bool idle();
+    //HTTP/1.1连接上一个请求已结束、下一个请求还没有开始读取，过载时只在这里拒绝
+    bool between_requests() const;
+    //过载或限流时由主线程调用：丢弃已到达的请求，写出503(limited为真时429)，之后由调用者关闭连接
+    void reject(bool limited);
+    //新连接超过上限或限流时，在init之前直接回复503或429
+    static void reject_fd(int fd, bool limited);
+    //启动时读取固定路由的页面，生成完整响应，须在add_cache_control之后调用
+    static bool init_fixed_responses(const char *root);
+    //处理一个HTTP/2流的请求，复用路由和静态文件处理，结果写入s的响应
+    void handle_h2(h2_stream &s);
     sockaddr_in *get_address() {
         return &m_address;
     }
 
     int timer_flag;
     int improv;
+    //请求各阶段打点
+    req_trace m_trace;
 
 private:
     void init();
+    //只重置请求相关的状态，HTTP/2的每个流调用
+    void init_request();
     //从m_read_buf读取，并处理请求报文
     HTTP_CODE process_read();
     //向m_write_buf写入响应报文数据
@@ -105,10 +190,61 @@ private:
     HTTP_CODE parse_request_line(char *text);
     //主状态机解析报文中的请求头数据
     HTTP_CODE parse_headers(char *text);
-    //主状态机解析报文中的请求内容
-    HTTP_CODE parse_content(char *text);
-    //生成响应报文
+    //请求头结束，根据Content-Length或chunked准备读取消息体
+    HTTP_CODE start_body();
+    //请求不完整时按解析进度更新m_deadline
+    void update_deadline();
+    //解码读缓冲区中的消息体，小的留在m_read_buf，大的写入临时文件
+    HTTP_CODE parse_content();
+    bool append_body(char *data, int len);
+    //把已在内存中的消息体转入临时文件
+    bool spool_body();
+    //Content-Length的剩余部分经管道从socket直接splice到临时文件
+    bool splice_body();
+    //关闭临时文件和管道
+    void close_body();
+    //按路由表分发请求
     HTTP_CODE do_request();
+    //路由处理函数
+    HTTP_CODE route_page(const route_entry &route);
+    HTTP_CODE route_login(const route_entry &route);
+    HTTP_CODE route_register(const route_entry &route);
+    HTTP_CODE route_static(const route_entry &route);
+    //取出表单 user=xx&password=xx 中的用户名和密码
+    bool parse_form(char **name, char **password);
+    //m_real_file设为网站根目录加path，过长或含..路径段时返回false
+    bool set_real_file(const char *path, int len);
+    //stat、协商编码、条件请求和Range，最后映射文件
+    HTTP_CODE serve_file();
+    //解析Range和If-Range，结果保存在m_ranges中
+    HTTP_CODE parse_range();
+    //按扩展名确定Content-Type，可压缩的文件根据Accept-Encoding换成.br/.gz或压缩缓存
+    void select_encoding();
+    //根据m_file_stat生成ETag、Last-Modified，并查找Cache-Control
+    void make_validators();
+    //If-None-Match或If-Modified-Since命中时返回真
+    bool not_modified();
+    //以chunked发送stream生成的响应体，stream从m_arena分配
+    HTTP_CODE start_stream(response_stream *stream, const char *content_type);
+    //从m_stream拉取数据，合并成一个分块追加到m_iv，出错返回false
+    bool fill_stream();
+    void end_stream();
+    //切换到HTTP/2，upgrade为真时先回复101，原请求作为流1
+    void start_h2(bool upgrade);
+    //处理HTTP/2输入并写出，出错或连接结束时关闭
+    void process_h2();
+    //把process_write生成的HTTP/1.1响应转换为HPACK头部和消息体片段
+    void convert_h2(h2_stream &s);
+    void close_h2();
+    //命中代理前缀的请求：生成转发的请求头，之后由run_proxy推进
+    HTTP_CODE start_proxy(upstream_group *group);
+    //推进转发，等待的socket注册后返回true；返回false时关闭客户连接
+    bool run_proxy();
+    //继续TLS握手，失败返回false
+    bool tls_handshake();
+    void close_tls();
+    //TLS连接经过tls_context，返回值与writev一致
+    ssize_t send_iov(const struct iovec *iov, int count);
     //m_start_line是已经解析的字符
     //get_line用于将指针向后偏移，指向未处理的字符
     char *get_line() { return m_read_buf + m_start_line; };
@@ -117,14 +253,25 @@ private:
     void unmap();
 
     //根据响应报文格式，生成对应8个部分，以下函数均由do_request调用
-    bool add_response(const char *format, ...);
+    //写入m_write_buf的构造器
+    response_builder builder() { return response_builder(m_write_buf, WRITE_BUFFER_SIZE, &m_write_idx); }
     bool add_content(const char *content);
     bool add_status_line(int status, const char *title);
-    bool add_headers(int content_length);
+    bool add_headers(long long content_length);
     bool add_content_type();
-    bool add_content_length(int content_length);
+    bool add_content_length(long long content_length);
     bool add_linger();
     bool add_blank_line();
+    //生成206响应，单区间直接指向文件片段，多区间为multipart/byteranges
+    bool add_partial_content();
+    //添加Last-Modified、ETag、Cache-Control和Vary
+    bool add_validators();
+    //chunked响应的头部
+    bool add_stream_headers();
+    //发送启动时生成的固定响应，不经过m_write_buf
+    bool add_fixed(const std::string &response);
+    //url命中的Cache-Control，未配置时返回空
+    static const char *find_cache_control(const char *url);
 
 public:
     static int m_epollfd;
@@ -155,21 +302,72 @@ private:
     //以下为解析请求报文中对应的6个变量
     //存储读取文件的名称
     char m_real_file[FILENAME_LEN];
-    char *m_url; 
-    char *m_version;
-    char *m_host;
-    int m_content_length;
+    //请求行和全部请求头，指向m_read_buf
+    http_request m_request;
+    long long m_content_length;
+    //消息体的分帧解码
+    body_reader m_body;
+    //内存中的消息体在m_read_buf中的起始位置和长度
+    int m_body_start;
+    int m_body_len;
+    //splice消息体用的管道，按需创建
+    int m_spool_pipe[2] = {-1, -1};
     bool m_linger;
+    //收到请求头和消息体第一批数据的时刻，用于计算m_deadline
+    time_t m_header_since;
+    time_t m_body_since;
+    time_t m_deadline;
+    //该连接已开始的请求数
+    int m_requests;
     //读取服务器上的文件地址
-    char *m_file_address;
+    char *m_file_address = NULL;
     struct stat m_file_stat;
     //io向量机制iovec
-    struct iovec m_iv[2];
+    struct iovec m_iv[MAX_IOV];
     int m_iv_count;
+    //m_iv中第一个未发送完的iovec
+    int m_iv_idx;
+    //原文件的强校验值 "inode-size-mtime"，压缩的响应带-gz/-br后缀，和修改时间
+    char m_etag[64];
+    char m_last_modified[40];
+    //命中的Cache-Control，未配置时为空
+    const char *m_cache_control;
+    //响应的Content-Type和Content-Encoding，未压缩时编码为空
+    const char *m_content_type;
+    const char *m_content_encoding;
+    //可压缩类型的响应随Accept-Encoding变化，需要Vary
+    bool m_vary;
+    //原文件的修改时间，换成压缩文件后Last-Modified仍以原文件为准
+    time_t m_mtime;
+    //命中的固定响应，见init_fixed_responses
+    const std::string *m_fixed;
+    //请求内的临时内存，init时释放
+    req_arena m_arena;
+    //本次请求走了需要分配内存的冷路径，ALLOC_COUNT检查时跳过
+    bool m_alloc_exempt;
+    //解析后的区间，闭区间[first, last]，已排序合并
+    struct byte_range {
+        off_t first;
+        off_t last;
+    };
+    byte_range m_ranges[MAX_RANGES];
+    int m_range_count;
+    //multipart各分段头和结束边界
+    char m_part_buf[PART_BUFFER_SIZE];
+    //chunked响应的生成者和分块缓冲区，生成完毕后m_stream_end为真
+    response_stream *m_stream = NULL;
+    char *m_stream_buf;
+    bool m_stream_end;
+    //切换到HTTP/2后的会话，之后读写都由它处理
+    h2_session *m_h2 = NULL;
+    //反向代理请求，从m_arena分配
+    proxy_relay *m_proxy = NULL;
+    //HTTPS连接，握手完成前m_tls_handshake为真，m_tls_want_write表示等待可写
+    SSL *m_ssl = NULL;
+    bool m_tls_handshake;
+    bool m_tls_want_write;
     //是否启用的POST
     int cgi;   
-    //存储请求头数据
-    char *m_string; 
     //剩余发送字节数
     int bytes_to_send;
     //已发送字节数
@@ -177,6 +375,27 @@ private:
     char *doc_root;
 
     int m_close_log;
+    //只解析不生成响应，见parse_buffer
+    bool m_parse_only;
+    //抓包时该连接的编号，0表示未被采样
+    uint32_t m_capture_id;
+
+    //以下可在运行中由主线程修改，工作线程读取
+    static std::atomic<long long> m_max_body_size;
+    static std::atomic<bool> m_autoindex;
+    static std::atomic<bool> m_draining;
+    static std::atomic<int> m_header_timeout;
+    static std::atomic<int> m_body_timeout;
+    static std::atomic<int> m_body_min_rate;
+    static std::atomic<int> m_keepalive_requests;
+    static std::string m_spool_dir;
+    //Cache-Control配置，按前缀长度降序
+    static std::vector<std::pair<std::string, std::string> > m_cache_rules;
+    //路由表，精确路径和前缀
+    static const route_entry m_routes[];
+    static const int m_route_count;
+    //由m_routes生成的查找表，首次使用时构建
+    static const router<route_entry> &get_router();
 };
 
 #endif
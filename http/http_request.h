@@ -0,0 +1,153 @@
+#ifndef M_HTTP_REQUEST_H
+#define M_HTTP_REQUEST_H
+
+#include <stdint.h>
+#include <strings.h>
+#include <string_view>
+
+//常用请求头，解析时按名称哈希识别，之后按编号直接取值
+enum HEADER_ID {
+    H_HOST = 0,
+    H_CONNECTION,
+    H_CONTENT_LENGTH,
+    H_CONTENT_TYPE,
+    H_TRANSFER_ENCODING,
+    H_EXPECT,
+    H_UPGRADE,
+    H_ACCEPT_ENCODING,
+    H_RANGE,
+    H_IF_RANGE,
+    H_IF_NONE_MATCH,
+    H_IF_MODIFIED_SINCE,
+    H_COOKIE,
+    H_USER_AGENT,
+    H_X_FORWARDED_FOR,
+    H_KNOWN_COUNT,
+    H_OTHER = H_KNOWN_COUNT
+};
+
+//忽略大小写的FNV-1a，constexpr，常用头部的哈希在编译期算出
+constexpr uint32_t header_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        char c = s[i];
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        h = (h ^ (unsigned char)c) * 16777619u;
+    }
+    return h;
+}
+constexpr uint32_t header_hash(std::string_view s) {
+    return header_hash(s.data(), s.size());
+}
+
+//一个请求的请求行和全部请求头，string_view均指向连接的读缓冲区，不拷贝、不分配内存
+//解析器保证每个值在缓冲区中以'\0'结尾，可用data()当作C字符串
+class http_request {
+public:
+    static const int MAX_HEADERS = 48;
+
+    struct header {
+        std::string_view name;
+        std::string_view value;
+        uint32_t hash;
+    };
+
+    http_request() { reset(); }
+
+    void reset() {
+        method = target = path = version = body = std::string_view();
+        body_fd = -1;
+        body_length = 0;
+        m_count = 0;
+        for (int i = 0; i < H_KNOWN_COUNT; ++i)
+            m_known[i] = -1;
+    }
+
+    //返回头部编号，超过MAX_HEADERS时返回-1
+    int add(std::string_view name, std::string_view value) {
+        if (m_count == MAX_HEADERS)
+            return -1;
+        uint32_t hash = header_hash(name);
+        HEADER_ID id = known_id(hash, name);
+        m_headers[m_count].name = name;
+        m_headers[m_count].value = value;
+        m_headers[m_count].hash = hash;
+        if (id != H_OTHER && m_known[id] < 0)
+            m_known[id] = m_count;
+        ++m_count;
+        return id;
+    }
+
+    //常用头部，O(1)，同名头部取第一个，不存在时返回空的view(data()为NULL)
+    std::string_view get(HEADER_ID id) const {
+        return m_known[id] < 0 ? std::string_view() : m_headers[m_known[id]].value;
+    }
+    //任意头部，先比较哈希再忽略大小写比较名称
+    std::string_view get(std::string_view name) const {
+        uint32_t hash = header_hash(name);
+        for (int i = 0; i < m_count; ++i) {
+            if (m_headers[i].hash == hash && equals(m_headers[i].name, name))
+                return m_headers[i].value;
+        }
+        return std::string_view();
+    }
+    //以C字符串返回常用头部，不存在时为NULL
+    const char *get_cstr(HEADER_ID id) const { return get(id).data(); }
+    bool has(HEADER_ID id) const { return m_known[id] >= 0; }
+
+    int header_count() const { return m_count; }
+    const header &header_at(int i) const { return m_headers[i]; }
+    //头部名称不区分大小写比较
+    static bool equals(std::string_view a, std::string_view b) {
+        return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+    }
+
+    std::string_view method;
+    std::string_view target;    //含查询参数
+    std::string_view path;      //target中?之前的部分，用于路由
+    std::string_view version;
+    std::string_view body;      //消息体在内存中时有效，以'\0'结尾
+    int body_fd;                //消息体较大时写入的临时文件，已定位到开头，否则为-1
+    long long body_length;
+
+private:
+    static HEADER_ID known_id(uint32_t hash, std::string_view name) {
+        HEADER_ID id;
+        switch (hash) {
+        case header_hash("host", 4): id = H_HOST; break;
+        case header_hash("connection", 10): id = H_CONNECTION; break;
+        case header_hash("content-length", 14): id = H_CONTENT_LENGTH; break;
+        case header_hash("content-type", 12): id = H_CONTENT_TYPE; break;
+        case header_hash("transfer-encoding", 17): id = H_TRANSFER_ENCODING; break;
+        case header_hash("expect", 6): id = H_EXPECT; break;
+        case header_hash("upgrade", 7): id = H_UPGRADE; break;
+        case header_hash("accept-encoding", 15): id = H_ACCEPT_ENCODING; break;
+        case header_hash("range", 5): id = H_RANGE; break;
+        case header_hash("if-range", 8): id = H_IF_RANGE; break;
+        case header_hash("if-none-match", 13): id = H_IF_NONE_MATCH; break;
+        case header_hash("if-modified-since", 17): id = H_IF_MODIFIED_SINCE; break;
+        case header_hash("cookie", 6): id = H_COOKIE; break;
+        case header_hash("user-agent", 10): id = H_USER_AGENT; break;
+        case header_hash("x-forwarded-for", 15): id = H_X_FORWARDED_FOR; break;
+        default: return H_OTHER;
+        }
+        //哈希相同但名称不同
+        return equals(name, known_names()[id]) ? id : H_OTHER;
+    }
+
+    static const std::string_view *known_names() {
+        static const std::string_view names[H_KNOWN_COUNT] = {
+            "host", "connection", "content-length", "content-type", "transfer-encoding",
+            "expect", "upgrade", "accept-encoding", "range", "if-range",
+            "if-none-match", "if-modified-since", "cookie", "user-agent", "x-forwarded-for",
+        };
+        return names;
+    }
+
+    header m_headers[MAX_HEADERS];
+    int m_count;
+    int8_t m_known[H_KNOWN_COUNT];
+};
+
+#endif
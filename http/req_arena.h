@@ -0,0 +1,73 @@
+#ifndef M_REQ_ARENA_H
+#define M_REQ_ARENA_H
+
+#include <stdlib.h>
+#include <string.h>
+
+//每个连接一个的线性分配器，请求中的临时数据从这里分配，请求结束时reset整体释放
+//内联空间用完后才malloc新块，正常请求不会调用malloc
+class req_arena {
+public:
+    static const size_t INLINE_SIZE = 1024;
+
+    req_arena() : m_used(0), m_blocks(NULL), m_block_end(NULL), m_block_used(NULL) {}
+    ~req_arena() { reset(); }
+
+    void *alloc(size_t size, size_t align = 8) {
+        size_t off = (m_used + align - 1) & ~(align - 1);
+        if (off + size <= INLINE_SIZE) {
+            m_used = off + size;
+            return m_buf + off;
+        }
+        return alloc_slow(size, align);
+    }
+    //拷贝len个字符并补'\0'
+    char *strndup(const char *s, size_t len) {
+        char *p = (char *)alloc(len + 1, 1);
+        memcpy(p, s, len);
+        p[len] = '\0';
+        return p;
+    }
+    void reset() {
+        m_used = 0;
+        while (m_blocks) {
+            block *next = m_blocks->next;
+            free(m_blocks);
+            m_blocks = next;
+        }
+        m_block_end = m_block_used = NULL;
+    }
+    //已使用的内联空间，用于观察arena是否够用
+    size_t used() const { return m_used; }
+
+private:
+    struct block {
+        block *next;
+    };
+    static const size_t BLOCK_SIZE = 8192;
+
+    void *alloc_slow(size_t size, size_t align) {
+        if (m_block_used) {
+            size_t off = ((size_t)m_block_used + align - 1) & ~(align - 1);
+            if (off + size <= (size_t)m_block_end) {
+                m_block_used = (char *)(off + size);
+                return (void *)off;
+            }
+        }
+        size_t cap = size + align + sizeof(block) > BLOCK_SIZE ? size + align + sizeof(block) : BLOCK_SIZE;
+        block *b = (block *)malloc(cap);
+        b->next = m_blocks;
+        m_blocks = b;
+        m_block_end = (char *)b + cap;
+        m_block_used = (char *)(b + 1);
+        return alloc_slow(size, align);
+    }
+
+    char m_buf[INLINE_SIZE];
+    size_t m_used;
+    block *m_blocks;
+    char *m_block_end;
+    char *m_block_used;
+};
+
+#endif
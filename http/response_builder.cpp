@@ -0,0 +1,19 @@
+#include "response_builder.h"
+
+char date_cache::m_buf[2][64];
+int date_cache::m_len[2];
+std::atomic<int> date_cache::m_idx(0);
+time_t date_cache::m_sec = 0;
+
+void date_cache::refresh() {
+    time_t now = time(NULL);
+    if (now == m_sec)
+        return;
+    m_sec = now;
+    int next = m_idx.load(std::memory_order_relaxed) ^ 1;
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    m_len[next] = strftime(m_buf[next], sizeof(m_buf[next]),
+                           "Date:%a, %d %b %Y %H:%M:%S GMT\r\nServer:PoorWebServer\r\n", &tm);
+    m_idx.store(next, std::memory_order_release);
+}
@@ -0,0 +1,86 @@
+#ifndef M_RESPONSE_BUILDER_H
+#define M_RESPONSE_BUILDER_H
+
+#include <string.h>
+#include <time.h>
+#include <atomic>
+
+//向连接的写缓冲区追加响应头，memcpy和手写整数转换，不解析格式串
+//任意一步空间不足返回false，之后的追加都会失败
+class response_builder {
+public:
+    response_builder(char *buf, int size, int *idx) : m_buf(buf), m_size(size), m_idx(idx) {}
+
+    bool append(const char *s, int len) {
+        if (len > m_size - 1 - *m_idx)
+            return false;
+        memcpy(m_buf + *m_idx, s, len);
+        *m_idx += len;
+        return true;
+    }
+    bool append(const char *s) { return append(s, strlen(s)); }
+    bool append_int(long long v) {
+        char tmp[24];
+        return append(tmp, itoa(v, tmp));
+    }
+
+    //HTTP/1.1 200 OK\r\n
+    bool status_line(int status, const char *title) {
+        return append("HTTP/1.1 ", 9) && append_int(status) && append(" ", 1) && append(title) &&
+               append("\r\n", 2);
+    }
+    //name:value\r\n
+    bool header(const char *name, int name_len, const char *value) {
+        return append(name, name_len) && append(":", 1) && append(value) && append("\r\n", 2);
+    }
+    bool header(const char *name, int name_len, long long value) {
+        return append(name, name_len) && append(":", 1) && append_int(value) && append("\r\n", 2);
+    }
+    bool blank_line() { return append("\r\n", 2); }
+
+    //十进制写入out，返回长度，out至少20字节
+    static int itoa(long long v, char *out) {
+        char tmp[24];
+        int n = 0;
+        unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : v;
+        do {
+            tmp[n++] = '0' + u % 10;
+            u /= 10;
+        } while (u);
+        int len = 0;
+        if (v < 0)
+            out[len++] = '-';
+        while (n)
+            out[len++] = tmp[--n];
+        return len;
+    }
+
+private:
+    char *m_buf;
+    int m_size;
+    int *m_idx;
+};
+
+//头部名称带长度，避免strlen
+#define HDR(name) name, (int)sizeof(name) - 1
+
+//缓存的Date和Server头部，由主线程的事件循环每秒刷新
+//双缓冲，工作线程读取当前一份，刷新写另一份后再切换
+class date_cache {
+public:
+    //已是当前秒时直接返回，只能由一个线程调用
+    static void refresh();
+    //"Date:...\r\nServer:...\r\n"，未刷新过时为空
+    static bool append_to(response_builder &b) {
+        int idx = m_idx.load(std::memory_order_acquire);
+        return b.append(m_buf[idx], m_len[idx]);
+    }
+
+private:
+    static char m_buf[2][64];
+    static int m_len[2];
+    static std::atomic<int> m_idx;
+    static time_t m_sec;
+};
+
+#endif
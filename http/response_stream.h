@@ -0,0 +1,19 @@
+#ifndef M_RESPONSE_STREAM_H
+#define M_RESPONSE_STREAM_H
+
+//动态生成、长度事先未知的响应体，按Transfer-Encoding: chunked发送
+//写循环在socket可写且上一批数据发完后才拉取，多次produce的结果合并成一个分块
+class response_stream {
+public:
+    enum {
+        STREAM_END = 0,      //没有更多数据
+        STREAM_ERROR = -1,   //生成出错，连接将被关闭
+        STREAM_FULL = -2     //下一段数据放不进剩余空间，先发送已有的数据
+    };
+
+    virtual ~response_stream() {}
+    //向buf写入不超过size字节，返回写入的字节数或以上状态
+    virtual int produce(char *buf, int size) = 0;
+};
+
+#endif
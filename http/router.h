@@ -0,0 +1,123 @@
+#ifndef M_ROUTER_H
+#define M_ROUTER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+//路由表：精确路径用完美哈希，目录前缀用字典树
+//启动时add后调用build，之后只读，查找不分配内存，可被多个线程同时使用
+template <typename T>
+class router {
+public:
+    router() : m_seed(0), m_mask(0) {
+        m_nodes.push_back(trie_node());
+    }
+
+    void add(const char *path, const T *entry) {
+        m_exact.push_back(std::make_pair(std::string(path), entry));
+    }
+    //prefix一般以/结尾，匹配最长的前缀
+    void add_prefix(const char *prefix, const T *entry) {
+        int node = 0;
+        for (const char *p = prefix; *p; ++p) {
+            int next = child(node, *p);
+            if (next < 0) {
+                next = m_nodes.size();
+                m_nodes.push_back(trie_node());
+                m_nodes[node].next.push_back(std::make_pair(*p, next));
+            }
+            node = next;
+        }
+        m_nodes[node].entry = entry;
+    }
+
+    //为精确路径寻找无冲突的种子，槽数为路径数的2倍以上
+    bool build() {
+        size_t size = 1;
+        while (size < m_exact.size() * 2)
+            size <<= 1;
+        for (; size <= (1u << 16); size <<= 1) {
+            m_mask = size - 1;
+            for (uint32_t seed = 1; seed < 4096; ++seed) {
+                m_slots.assign(size, -1);
+                bool ok = true;
+                for (size_t i = 0; i < m_exact.size() && ok; ++i) {
+                    const std::string &path = m_exact[i].first;
+                    int &slot = m_slots[hash(path.data(), path.size(), seed) & m_mask];
+                    if (slot >= 0)
+                        ok = false;
+                    slot = i;
+                }
+                if (ok) {
+                    m_seed = seed;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    //精确匹配，一次哈希加一次比较
+    const T *find(const char *path, int len) const {
+        if (m_slots.empty())
+            return NULL;
+        int slot = m_slots[hash(path, len, m_seed) & m_mask];
+        if (slot < 0)
+            return NULL;
+        const std::string &key = m_exact[slot].first;
+        if ((int)key.size() != len || memcmp(key.data(), path, len) != 0)
+            return NULL;
+        return m_exact[slot].second;
+    }
+
+    //最长前缀匹配
+    const T *find_prefix(const char *path, int len) const {
+        const T *found = m_nodes[0].entry;
+        int node = 0;
+        for (int i = 0; i < len; ++i) {
+            node = child(node, path[i]);
+            if (node < 0)
+                break;
+            if (m_nodes[node].entry)
+                found = m_nodes[node].entry;
+        }
+        return found;
+    }
+
+private:
+    struct trie_node {
+        trie_node() : entry(NULL) {}
+        std::vector<std::pair<char, int> > next;
+        const T *entry;
+    };
+
+    int child(int node, char c) const {
+        const std::vector<std::pair<char, int> > &next = m_nodes[node].next;
+        for (size_t i = 0; i < next.size(); ++i) {
+            if (next[i].first == c)
+                return next[i].second;
+        }
+        return -1;
+    }
+
+    //带种子的FNV-1a
+    static uint32_t hash(const char *s, size_t len, uint32_t seed) {
+        uint32_t h = 2166136261u ^ (seed * 16777619u);
+        for (size_t i = 0; i < len; ++i) {
+            h ^= (unsigned char)s[i];
+            h *= 16777619u;
+        }
+        return h ^ (h >> 15);
+    }
+
+    std::vector<std::pair<std::string, const T *> > m_exact;
+    std::vector<int> m_slots;
+    uint32_t m_seed;
+    uint32_t m_mask;
+    std::vector<trie_node> m_nodes;
+};
+
+#endif
@@ -33,6 +33,10 @@ public:
         //以原子操作方式将信号量加一,信号量大于0时,唤醒调用sem_post的线程
         return sem_post(&m_sem) == 0;
     }
+    //信号量为0时不阻塞，直接返回false
+    bool trywait() {
+        return sem_trywait(&m_sem) == 0;
+    }
 
 private:
     sem_t m_sem;
@@ -82,6 +86,12 @@ public:
         return ret == 0;
     }
 
+    bool timewait(pthread_mutex_t *m_mutex, struct timespec t) {
+        int ret = 0;
+        ret = pthread_cond_timedwait(&m_cond, m_mutex, &t);
+        return ret == 0;
+    }
+
     bool signal() {
         return pthread_cond_signal(&m_cond) == 0;
     }
@@ -1,14 +1,16 @@
 #include "configure/configure.h"
+#include "webserver/webserver.h"
 
 int main(int argc, char *argv[])
 {
-    //命令行解析
+    //命令行解析，-f指定的配置文件先于其他选项读取
     Config config;
-    config.parse_arg(argc, argv);
+    if (!config.parse_arg(argc, argv))
+        return 1;
 
     WebServer server;
-    //初始化  端口号, 数据库连接池数量 redis_num, 线程池内的线程数量 thread_num
-    server.init(config.PORT, config.redis_num, config.thread_num);
+    //初始化  端口号, 数据库连接池, 线程池, 请求打点, 抓包, Cache-Control规则, gzip缓存目录, 请求体上限, 目录列表, HTTPS, 反向代理, 连接数和超时等
+    server.init(config);
     
     //数据库
     server.redis_pool();
@@ -23,4 +25,4 @@ int main(int argc, char *argv[])
     server.eventLoop();
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,503 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <new>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "proxy_relay.h"
+#include "../http/response_builder.h"
+
+//run各阶段的结果
+enum PROXY_RESULT {
+    PR_NEXT = 0,   //进入下一阶段
+    PR_WAIT,       //已注册等待的socket
+    PR_WAIT_CLIENT,//客户端写满
+    PR_DONE,       //响应转发完毕
+    PR_RETRY,      //收到响应之前后端连接失败
+    PR_GATEWAY,    //没有可用的后端或响应无效，回复502
+    PR_ERROR       //已开始转发响应后出错，关闭客户连接
+};
+
+//请求中不转发的逐跳头部，以及由代理重新生成的头部
+static const std::string_view proxy_skip_headers[] = {
+    "connection", "keep-alive", "proxy-connection", "te", "trailer", "transfer-encoding",
+    "upgrade", "content-length", "expect", "x-forwarded-for", "x-forwarded-proto",
+};
+
+//逗号分隔的值中是否有token，不区分大小写
+static bool has_token(std::string_view value, const char *token) {
+    size_t len = strlen(token);
+    size_t i = 0;
+    while (i < value.size()) {
+        while (i < value.size() && (value[i] == ' ' || value[i] == '\t' || value[i] == ','))
+            ++i;
+        size_t start = i;
+        while (i < value.size() && value[i] != ',' && value[i] != ' ' && value[i] != '\t' && value[i] != ';')
+            ++i;
+        if (i - start == len && strncasecmp(value.data() + start, token, len) == 0)
+            return true;
+        while (i < value.size() && value[i] != ',')
+            ++i;
+    }
+    return false;
+}
+
+proxy_relay *proxy_relay::create(req_arena &arena, upstream_group *group, const http_request &req,
+                                 bool chunked_body, bool linger, const client &c) {
+    proxy_relay *p = new (arena.alloc(sizeof(proxy_relay))) proxy_relay();
+    p->m_client = c;
+    p->m_req = &req;
+    p->m_arena = &arena;
+    p->m_head_only = req.method == "HEAD";
+    p->m_post = req.method == "POST";
+    p->m_linger = linger;
+    p->m_group = group;
+    p->m_fd = -1;
+    p->m_step = P_CONNECT;
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &c.address.sin_addr, ip, sizeof(ip));
+    std::string_view forwarded = req.get(H_X_FORWARDED_FOR);
+    int cap = req.method.size() + req.target.size() + forwarded.size() + 256;
+    for (int i = 0; i < req.header_count(); ++i)
+        cap += req.header_at(i).name.size() + req.header_at(i).value.size() + 4;
+    p->m_head = (char *)arena.alloc(cap, 1);
+
+    //请求行统一为HTTP/1.1，后端连接保持长连接，消息体已解码，按Content-Length发送
+    response_builder b(p->m_head, cap, &p->m_head_len);
+    b.append(req.method.data(), req.method.size());
+    b.append(" ", 1);
+    b.append(req.target.data(), req.target.size());
+    b.append(" HTTP/1.1\r\n");
+    for (int i = 0; i < req.header_count(); ++i) {
+        const http_request::header &h = req.header_at(i);
+        bool skip = false;
+        for (size_t k = 0; k < sizeof(proxy_skip_headers) / sizeof(proxy_skip_headers[0]) && !skip; ++k)
+            skip = http_request::equals(h.name, proxy_skip_headers[k]);
+        if (skip)
+            continue;
+        b.append(h.name.data(), h.name.size());
+        b.append(":", 1);
+        b.append(h.value.data(), h.value.size());
+        b.append("\r\n", 2);
+    }
+    b.append("X-Forwarded-For:");
+    if (forwarded.data()) {
+        b.append(forwarded.data(), forwarded.size());
+        b.append(", ", 2);
+    }
+    b.append(ip);
+    b.append("\r\n", 2);
+    b.header("X-Forwarded-Proto", 17, c.ssl ? "https" : "http");
+    if (req.body_length > 0 || req.has(H_CONTENT_LENGTH) || chunked_body)
+        b.header("Content-Length", 14, req.body_length);
+    b.header("Connection", 10, "keep-alive");
+    if (!b.blank_line())
+        return NULL;
+
+    p->m_buf = (char *)arena.alloc(BUFFER_SIZE, 1);
+    return p;
+}
+
+proxy_relay::RESULT proxy_relay::run() {
+    while (true) {
+        int ret;
+        switch (m_step) {
+        case P_CONNECT:
+            ret = connect_upstream();
+            break;
+        case P_SEND:
+            ret = send_request();
+            break;
+        case P_HEAD:
+            ret = read_head();
+            break;
+        default:
+            ret = relay();
+            break;
+        }
+        switch (ret) {
+        case PR_NEXT:
+            continue;
+        case PR_WAIT:
+            return R_WAIT;
+        case PR_WAIT_CLIENT:
+            return R_WAIT_CLIENT;
+        case PR_DONE:
+            //放回空闲连接前从epoll删除，之后由其他客户连接重新注册
+            if (m_upstream_keep_alive && m_registered)
+                epoll_ctl(m_client.epollfd, EPOLL_CTL_DEL, m_fd, 0);
+            release(m_upstream_keep_alive);
+            return R_DONE;
+        case PR_RETRY:
+            if (retry())
+                continue;
+            release(false);
+            return m_client_sent ? R_ERROR : R_GATEWAY;
+        case PR_GATEWAY:
+            release(false);
+            return m_client_sent ? R_ERROR : R_GATEWAY;
+        default:
+            release(false);
+            return R_ERROR;
+        }
+    }
+}
+
+int proxy_relay::connect_upstream() {
+    if (m_fd < 0) {
+        if (m_tries++ == MAX_TRIES)
+            return PR_GATEWAY;
+        bool connecting;
+        m_fd = m_group->acquire(m_tried, &m_server, &m_reused, &connecting);
+        if (m_fd < 0)
+            return PR_GATEWAY;
+        m_registered = false;
+        if (!proxy_table::get_instance()->bind(m_client.fd, m_fd, m_group, m_server)) {
+            m_group->release(m_server, m_fd, false);
+            m_fd = -1;
+            return PR_GATEWAY;
+        }
+        if (connecting) {
+            arm_upstream(EPOLLOUT);
+            return PR_WAIT;
+        }
+    }
+    else {
+        //非阻塞connect完成，检查结果
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            errno = err;
+            return PR_RETRY;
+        }
+    }
+    m_step = P_SEND;
+    return PR_NEXT;
+}
+
+int proxy_relay::send_request() {
+    const http_request &req = *m_req;
+    long long total = m_head_len + req.body_length;
+    while (m_sent < total) {
+        ssize_t n;
+        if (m_sent < m_head_len || req.body_fd < 0) {
+            struct iovec iv[2];
+            int count = 0;
+            if (m_sent < m_head_len) {
+                iv[count].iov_base = m_head + m_sent;
+                iv[count++].iov_len = m_head_len - m_sent;
+            }
+            long long body_off = m_sent < m_head_len ? 0 : m_sent - m_head_len;
+            if (req.body_fd < 0 && body_off < req.body_length) {
+                iv[count].iov_base = (char *)req.body.data() + body_off;
+                iv[count++].iov_len = req.body_length - body_off;
+            }
+            n = writev(m_fd, iv, count);
+        }
+        else {
+            //临时文件中的消息体由内核直接发往后端
+            off_t off = m_sent - m_head_len;
+            n = sendfile(m_fd, req.body_fd, &off, total - m_sent);
+            if (n == 0)
+                return PR_GATEWAY;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                arm_upstream(EPOLLOUT);
+                return PR_WAIT;
+            }
+            return PR_RETRY;
+        }
+        m_sent += n;
+    }
+    m_step = P_HEAD;
+    arm_upstream(EPOLLIN);
+    return PR_WAIT;
+}
+
+int proxy_relay::read_head() {
+    while (true) {
+        if (m_buf_len == BUFFER_SIZE) {
+            spdlog::warn("upstream {0}: response header too large", m_group->name(m_server));
+            return PR_GATEWAY;
+        }
+        ssize_t n = recv(m_fd, m_buf + m_buf_len, BUFFER_SIZE - m_buf_len, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            arm_upstream(EPOLLIN);
+            return PR_WAIT;
+        }
+        if (n <= 0) {
+            if (n == 0)
+                errno = ECONNRESET;
+            return PR_RETRY;
+        }
+        int from = m_buf_len < 3 ? 0 : m_buf_len - 3;
+        m_buf_len += n;
+        char *end = (char *)memmem(m_buf + from, m_buf_len - from, "\r\n\r\n", 4);
+        if (!end)
+            continue;
+        int head_end = end + 4 - m_buf;
+        if (!parse_head(head_end)) {
+            spdlog::warn("upstream {0}: invalid response", m_group->name(m_server));
+            m_group->fail(m_server);
+            return PR_GATEWAY;
+        }
+        //1xx为中间响应，丢弃后继续等待最终响应
+        if (!m_resp_head) {
+            memmove(m_buf, m_buf + head_end, m_buf_len - head_end);
+            m_buf_len -= head_end;
+            continue;
+        }
+        m_group->success(m_server);
+        m_step = P_BODY;
+        m_out_start = m_out_end = m_decoded = head_end;
+        return account(head_end, m_buf_len) ? PR_NEXT : PR_ERROR;
+    }
+}
+
+bool proxy_relay::parse_head(int head_end) {
+    char *line = m_buf;
+    char *end = m_buf + head_end;
+    char *eol = (char *)memchr(line, '\n', end - line);
+    //HTTP/1.x 200 OK
+    if (eol - line < 12 || memcmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ')
+        return false;
+    bool close = line[7] == '0';
+    int status = 0;
+    for (int i = 9; i < 12; ++i) {
+        if (line[i] < '0' || line[i] > '9')
+            return false;
+        status = status * 10 + line[i] - '0';
+    }
+    if (status == 101)
+        return false;
+    m_resp_head = NULL;
+    if (status < 200)
+        return true;
+
+    int cap = head_end + 64;
+    m_resp_head = (char *)m_arena->alloc(cap, 1);
+    m_resp_head_len = m_resp_head_sent = 0;
+    response_builder b(m_resp_head, cap, &m_resp_head_len);
+    int len = eol - line;
+    if (line[len - 1] == '\r')
+        --len;
+    b.append("HTTP/1.1", 8);
+    b.append(line + 8, len - 8);
+    b.append("\r\n", 2);
+
+    long long length = -1;
+    bool chunked = false;
+    for (line = eol + 1; line < end; line = eol + 1) {
+        eol = (char *)memchr(line, '\n', end - line);
+        len = eol - line;
+        if (len > 0 && line[len - 1] == '\r')
+            --len;
+        if (len == 0)
+            break;
+        char *colon = (char *)memchr(line, ':', len);
+        if (!colon)
+            return false;
+        std::string_view name(line, colon - line);
+        const char *v = colon + 1;
+        while (v < line + len && (*v == ' ' || *v == '\t'))
+            ++v;
+        std::string_view value(v, line + len - v);
+        if (http_request::equals(name, "connection")) {
+            if (has_token(value, "close"))
+                close = true;
+            else if (has_token(value, "keep-alive"))
+                close = false;
+            continue;
+        }
+        if (http_request::equals(name, "keep-alive") || http_request::equals(name, "proxy-connection"))
+            continue;
+        if (http_request::equals(name, "content-length"))
+            length = atoll(std::string(value).c_str());
+        else if (http_request::equals(name, "transfer-encoding"))
+            chunked = has_token(value, "chunked");
+        b.append(line, len);
+        b.append("\r\n", 2);
+    }
+
+    if (m_head_only || status == 204 || status == 304) {
+        m_mode = BODY_NONE;
+    }
+    else if (chunked) {
+        m_mode = BODY_CHUNKED;
+        m_chunks.start_chunked(1LL << 62);
+    }
+    else if (length >= 0) {
+        m_mode = BODY_LENGTH;
+        m_body_left = length;
+    }
+    else {
+        //没有长度的响应以后端关闭连接结束，客户连接也只能随后关闭
+        m_mode = BODY_UNTIL_CLOSE;
+        m_linger = false;
+    }
+    m_upstream_keep_alive = !close && m_mode != BODY_UNTIL_CLOSE;
+    return b.header("Connection", 10, m_linger ? "keep-alive" : "close") && b.blank_line();
+}
+
+bool proxy_relay::account(int from, int to) {
+    switch (m_mode) {
+    case BODY_NONE:
+        to = from;
+        break;
+    case BODY_LENGTH:
+        if (to - from > m_body_left)
+            to = from + m_body_left;
+        m_body_left -= to - from;
+        break;
+    case BODY_CHUNKED:
+        while (m_decoded < to && !m_chunks.done()) {
+            char *payload;
+            int payload_len;
+            int used = m_chunks.decode(m_buf + m_decoded, to - m_decoded, &payload, &payload_len);
+            if (used < 0)
+                return false;
+            if (used == 0)
+                break;
+            m_decoded += used;
+        }
+        if (m_chunks.done())
+            to = m_decoded;
+        break;
+    default:
+        break;
+    }
+    //超出响应的多余字节说明后端连接的状态不对，不再复用
+    if (to < m_buf_len)
+        m_upstream_keep_alive = false;
+    m_buf_len = to;
+    m_out_end = to;
+    return true;
+}
+
+int proxy_relay::relay() {
+    SSL *ssl = m_client.ssl;
+    int *pipe = m_client.pipe;
+    //kTLS或明文连接上，Content-Length和到关闭为止的消息体经管道在socket之间splice
+    bool use_splice = m_mode != BODY_CHUNKED && (!ssl || tls_context::ktls_send(ssl));
+    while (true) {
+        if (m_resp_head_sent < m_resp_head_len || m_out_start < m_out_end) {
+            struct iovec iv[2];
+            int count = 0;
+            if (m_resp_head_sent < m_resp_head_len) {
+                iv[count].iov_base = m_resp_head + m_resp_head_sent;
+                iv[count++].iov_len = m_resp_head_len - m_resp_head_sent;
+            }
+            if (m_out_start < m_out_end) {
+                iv[count].iov_base = m_buf + m_out_start;
+                iv[count++].iov_len = m_out_end - m_out_start;
+            }
+            ssize_t n = ssl ? tls_context::writev(ssl, m_client.fd, iv, count) : writev(m_client.fd, iv, count);
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    return PR_ERROR;
+                return PR_WAIT_CLIENT;
+            }
+            m_client_sent = true;
+            int head = m_resp_head_len - m_resp_head_sent;
+            if (n < head)
+                head = n;
+            m_resp_head_sent += head;
+            m_out_start += n - head;
+            continue;
+        }
+        if (m_pipe_bytes > 0) {
+            ssize_t n = splice(pipe[0], NULL, m_client.fd, NULL, m_pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n <= 0) {
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    return PR_ERROR;
+                return PR_WAIT_CLIENT;
+            }
+            m_client_sent = true;
+            m_pipe_bytes -= n;
+            continue;
+        }
+
+        //缓冲区中的数据都已发出，只留下不完整的分块头
+        int keep = m_mode == BODY_CHUNKED ? m_decoded : m_buf_len;
+        memmove(m_buf, m_buf + keep, m_buf_len - keep);
+        m_buf_len -= keep;
+        m_decoded = 0;
+        m_out_start = m_out_end = m_buf_len;
+
+        if (m_mode == BODY_NONE || m_eof ||
+            (m_mode == BODY_LENGTH && m_body_left == 0) ||
+            (m_mode == BODY_CHUNKED && m_chunks.done()))
+            return PR_DONE;
+
+        ssize_t n;
+        if (use_splice) {
+            if (pipe[0] < 0 && pipe2(pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+                return PR_ERROR;
+            size_t want = 1 << 16;
+            if (m_mode == BODY_LENGTH && m_body_left < (long long)want)
+                want = m_body_left;
+            n = splice(m_fd, NULL, pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+        else
+            n = recv(m_fd, m_buf + m_buf_len, BUFFER_SIZE - m_buf_len, 0);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return PR_ERROR;
+            arm_upstream(EPOLLIN);
+            return PR_WAIT;
+        }
+        if (n == 0) {
+            //只有到关闭为止的消息体可以这样结束，其余为响应被截断
+            if (m_mode != BODY_UNTIL_CLOSE)
+                return PR_ERROR;
+            m_eof = true;
+            continue;
+        }
+        if (use_splice) {
+            m_pipe_bytes += n;
+            if (m_mode == BODY_LENGTH)
+                m_body_left -= n;
+        }
+        else if (!account(m_buf_len, m_buf_len + n))
+            return PR_ERROR;
+    }
+}
+
+bool proxy_relay::retry() {
+    //失效的空闲连接不算后端故障；请求已发出后POST不重试，以免重复执行
+    bool real = !m_reused;
+    bool again = m_step == P_CONNECT || m_reused || !m_post;
+    spdlog::warn("upstream {0}: {1}{2}", m_group->name(m_server), strerror(errno), again ? ", retry" : "");
+    proxy_table::get_instance()->unbind(m_client.fd, false, real);
+    m_fd = -1;
+    if (real)
+        m_tried |= 1ULL << m_server;
+    if (!again)
+        return false;
+    m_step = P_CONNECT;
+    m_sent = 0;
+    m_buf_len = 0;
+    return true;
+}
+
+void proxy_relay::arm_upstream(int ev) {
+    epoll_event event;
+    event.data.fd = m_fd;
+    event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+    int op = m_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    m_registered = true;
+    epoll_ctl(m_client.epollfd, op, m_fd, &event);
+}
+
+void proxy_relay::release(bool keep_alive) {
+    //定时器关闭连接时已经归还，这里什么也不做
+    proxy_table::get_instance()->unbind(m_client.fd, keep_alive, false);
+}
@@ -0,0 +1,121 @@
+#ifndef M_PROXY_RELAY_H
+#define M_PROXY_RELAY_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "upstream.h"
+#include "../http/http_request.h"
+#include "../http/body_reader.h"
+#include "../http/req_arena.h"
+#include "../tls/tls_context.h"
+
+//一次反向代理请求：取得后端连接、发送请求、接收响应头，再把响应转发给客户端
+//全部非阻塞，后端socket以EPOLLONESHOT注册到客户连接所在的epoll，内存从请求的arena分配
+class proxy_relay {
+public:
+    //响应缓冲区，响应头须能放下
+    static const int BUFFER_SIZE = 16384;
+    //一个请求最多尝试的后端连接数，包括失效的空闲连接
+    static const int MAX_TRIES = 3;
+
+    enum RESULT {
+        R_WAIT = 0,      //已注册等待的后端socket
+        R_WAIT_CLIENT,   //客户端写满，须注册EPOLLOUT
+        R_DONE,          //响应转发完毕，后端连接已归还
+        R_GATEWAY,       //没有可用的后端或响应无效，还未向客户端发出字节，可以回复502
+        R_ERROR          //已开始转发响应后出错，只能关闭客户连接
+    };
+
+    //客户连接一侧，pipe为客户连接的管道，splice转发时按需创建
+    struct client {
+        int fd;
+        int epollfd;
+        SSL *ssl;
+        int *pipe;
+        sockaddr_in address;
+    };
+
+    //生成转发的请求头，失败返回NULL；req须在请求结束前保持有效
+    //linger为客户连接是否保持，chunked_body表示消息体原为chunked，已解码
+    static proxy_relay *create(req_arena &arena, upstream_group *group, const http_request &req,
+                               bool chunked_body, bool linger, const client &c);
+
+    //非阻塞地推进各个阶段，R_DONE/R_GATEWAY/R_ERROR时后端连接已归还或关闭
+    RESULT run();
+    //响应以后端关闭结束时客户连接也须随后关闭
+    bool linger() const { return m_linger; }
+
+private:
+    enum STEP {
+        P_CONNECT = 0,  //取得后端连接，等待connect完成
+        P_SEND,         //发送请求头和消息体
+        P_HEAD,         //接收响应头
+        P_BODY          //转发响应头和消息体
+    };
+    enum MODE {
+        BODY_NONE = 0,   //HEAD、204、304
+        BODY_LENGTH,
+        BODY_CHUNKED,    //原样转发，只跟踪分块找出结束位置
+        BODY_UNTIL_CLOSE
+    };
+
+    int connect_upstream();
+    int send_request();
+    int read_head();
+    int relay();
+    //解析后端响应头，生成发给客户端的响应头
+    bool parse_head(int head_end);
+    //统计m_buf中[from, to)新到的消息体，确定可以转发的部分
+    bool account(int from, int to);
+    //收到响应之前失败，换一个连接重试，不能重试时返回false
+    bool retry();
+    //后端socket以EPOLLONESHOT注册，须是本次处理的最后一个动作
+    void arm_upstream(int ev);
+    //归还后端连接
+    void release(bool keep_alive);
+
+    client m_client;
+    const http_request *m_req;
+    req_arena *m_arena;
+    bool m_head_only;
+    bool m_post;
+    bool m_linger;
+
+    upstream_group *m_group;
+    int m_server;
+    int m_fd;
+    //复用的空闲连接失败不计入后端的失败次数
+    bool m_reused;
+    //已注册到epoll，放回空闲连接前须删除
+    bool m_registered;
+    int m_tries;
+    //已失败的后端，重试时跳过
+    uint64_t m_tried;
+    STEP m_step;
+    //发给后端的请求头，m_sent包括请求头和消息体
+    char *m_head;
+    int m_head_len;
+    long long m_sent;
+    //后端响应，[m_out_start, m_out_end)待发给客户端
+    char *m_buf;
+    int m_buf_len;
+    int m_out_start;
+    int m_out_end;
+    //chunked已解码到的位置，之后不完整的分块头留在缓冲区
+    int m_decoded;
+    //发给客户端的响应头
+    char *m_resp_head;
+    int m_resp_head_len;
+    int m_resp_head_sent;
+    MODE m_mode;
+    long long m_body_left;
+    body_reader m_chunks;
+    bool m_eof;
+    bool m_upstream_keep_alive;
+    //已向客户端发出字节，之后出错只能关闭连接
+    bool m_client_sent;
+    //管道中还未splice到客户端的字节
+    long long m_pipe_bytes;
+};
+
+#endif
@@ -0,0 +1,254 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "upstream.h"
+
+std::atomic<int> upstream_group::m_max_idle(32);
+
+//host:port，host可以是IP或主机名，启动时解析一次
+static bool resolve(const std::string &spec, sockaddr_in *addr) {
+    size_t colon = spec.rfind(':');
+    if (colon == std::string::npos || colon == 0)
+        return false;
+    std::string host = spec.substr(0, colon);
+    int port = atoi(spec.c_str() + colon + 1);
+    if (port <= 0 || port > 65535)
+        return false;
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr->sin_addr) == 1)
+        return true;
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), NULL, &hints, &res) != 0)
+        return false;
+    addr->sin_addr = ((sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return true;
+}
+
+bool upstream_group::parse(const char *servers) {
+    std::string list = servers;
+    m_policy = ROUND_ROBIN;
+    m_next = 0;
+    size_t semi = list.find(';');
+    if (semi != std::string::npos) {
+        std::string policy = list.substr(semi + 1);
+        if (policy == "lc")
+            m_policy = LEAST_CONN;
+        else if (policy != "rr")
+            return false;
+        list.resize(semi);
+    }
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t comma = list.find(',', start);
+        if (comma == std::string::npos)
+            comma = list.size();
+        server s;
+        s.name = list.substr(start, comma - start);
+        if (!resolve(s.name, &s.addr) || (int)m_servers.size() == MAX_SERVERS)
+            return false;
+        s.active = 0;
+        s.fails = 0;
+        s.down_until = 0;
+        m_servers.push_back(s);
+        start = comma + 1;
+    }
+    return !m_servers.empty();
+}
+
+int upstream_group::pick(uint64_t exclude, time_t now) {
+    int n = m_servers.size();
+    int best = -1;
+    for (int k = 0; k < n; ++k) {
+        int i = (m_next + k) % n;
+        server &s = m_servers[i];
+        if ((exclude >> i & 1) || s.down_until > now)
+            continue;
+        if (m_policy == ROUND_ROBIN) {
+            best = i;
+            break;
+        }
+        //最少连接，相同时从轮询位置开始取第一个
+        if (best < 0 || s.active < m_servers[best].active)
+            best = i;
+    }
+    if (best >= 0)
+        m_next = best + 1;
+    return best;
+}
+
+int upstream_group::take_idle(server &s, time_t now) {
+    while (!s.idle.empty()) {
+        std::pair<int, time_t> conn = s.idle.back();
+        s.idle.pop_back();
+        //后端关闭了空闲连接时可读(EOF)，有数据也说明连接状态不对
+        char c;
+        if (conn.second + IDLE_TIMEOUT > now && recv(conn.first, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK))
+            return conn.first;
+        close(conn.first);
+    }
+    return -1;
+}
+
+int upstream_group::acquire(uint64_t exclude, int *server_idx, bool *reused, bool *connecting) {
+    time_t now = time(NULL);
+    m_lock.lock();
+    while (true) {
+        int i = pick(exclude, now);
+        if (i < 0) {
+            m_lock.unlock();
+            return -1;
+        }
+        server &s = m_servers[i];
+        int fd = take_idle(s, now);
+        *reused = fd >= 0;
+        *connecting = false;
+        if (fd < 0) {
+            fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                m_lock.unlock();
+                return -1;
+            }
+            int flag = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+            if (connect(fd, (struct sockaddr *)&s.addr, sizeof(s.addr)) < 0) {
+                if (errno != EINPROGRESS) {
+                    //本机的后端拒绝连接时立即失败，换下一个
+                    close(fd);
+                    exclude |= 1ULL << i;
+                    fail_locked(i);
+                    continue;
+                }
+                *connecting = true;
+            }
+        }
+        ++s.active;
+        *server_idx = i;
+        m_lock.unlock();
+        return fd;
+    }
+}
+
+void upstream_group::release(int server_idx, int fd, bool keep_alive) {
+    m_lock.lock();
+    server &s = m_servers[server_idx];
+    --s.active;
+    if (keep_alive && (int)s.idle.size() < m_max_idle.load(std::memory_order_relaxed)) {
+        s.idle.push_back(std::make_pair(fd, time(NULL)));
+        fd = -1;
+    }
+    m_lock.unlock();
+    if (fd >= 0)
+        close(fd);
+}
+
+void upstream_group::fail(int server_idx) {
+    m_lock.lock();
+    fail_locked(server_idx);
+    m_lock.unlock();
+}
+
+void upstream_group::fail_locked(int server_idx) {
+    server &s = m_servers[server_idx];
+    if (++s.fails >= MAX_FAILS) {
+        s.fails = 0;
+        s.down_until = time(NULL) + FAIL_TIMEOUT;
+        spdlog::warn("upstream {0} down for {1}s", s.name, (int)FAIL_TIMEOUT);
+        //空闲连接也不再可信
+        for (size_t k = 0; k < s.idle.size(); ++k)
+            close(s.idle[k].first);
+        s.idle.clear();
+    }
+}
+
+void upstream_group::success(int server_idx) {
+    m_lock.lock();
+    m_servers[server_idx].fails = 0;
+    m_lock.unlock();
+}
+
+proxy_table::proxy_table() : m_bindings(MAX_FD_COUNT), m_owner(MAX_FD_COUNT, 0) {
+    for (size_t i = 0; i < m_bindings.size(); ++i)
+        m_bindings[i].fd = -1;
+}
+
+proxy_table::~proxy_table() {
+    for (size_t i = 0; i < m_routes.size(); ++i)
+        delete m_routes[i].second;
+}
+
+bool proxy_table::add(const char *rule) {
+    const char *eq = strchr(rule, '=');
+    if (!eq || eq == rule || rule[0] != '/')
+        return false;
+    upstream_group *group = new upstream_group;
+    if (!group->parse(eq + 1)) {
+        delete group;
+        return false;
+    }
+    m_routes.push_back(std::make_pair(std::string(rule, eq - rule), group));
+    std::stable_sort(m_routes.begin(), m_routes.end(),
+                     [](const std::pair<std::string, upstream_group *> &a,
+                        const std::pair<std::string, upstream_group *> &b) { return a.first.size() > b.first.size(); });
+    spdlog::info("proxy {0} -> {1}", m_routes.back().first, eq + 1);
+    return true;
+}
+
+upstream_group *proxy_table::find(std::string_view path) const {
+    for (size_t i = 0; i < m_routes.size(); ++i) {
+        const std::string &prefix = m_routes[i].first;
+        if (path.size() >= prefix.size() && path.compare(0, prefix.size(), prefix) == 0)
+            return m_routes[i].second;
+    }
+    return NULL;
+}
+
+bool proxy_table::bind(int client, int fd, upstream_group *group, int server) {
+    if (client < 0 || client >= MAX_FD_COUNT || fd < 0 || fd >= MAX_FD_COUNT)
+        return false;
+    m_lock.lock();
+    binding &b = m_bindings[client];
+    b.group = group;
+    b.server = server;
+    b.fd = fd;
+    m_owner[fd] = client + 1;
+    m_lock.unlock();
+    return true;
+}
+
+void proxy_table::unbind(int client, bool keep_alive, bool failed) {
+    if (client < 0 || client >= MAX_FD_COUNT)
+        return;
+    m_lock.lock();
+    binding b = m_bindings[client];
+    if (b.fd < 0) {
+        m_lock.unlock();
+        return;
+    }
+    m_bindings[client].fd = -1;
+    m_owner[b.fd] = 0;
+    m_lock.unlock();
+    if (failed)
+        b.group->fail(b.server);
+    b.group->release(b.server, b.fd, keep_alive && !failed);
+}
+
+int proxy_table::owner(int fd) const {
+    //主线程每个事件都要查，不加锁：绑定在后端socket注册到epoll之前完成
+    if (fd < 0 || fd >= MAX_FD_COUNT)
+        return -1;
+    return m_owner[fd] - 1;
+}
@@ -0,0 +1,114 @@
+#ifndef M_UPSTREAM_H
+#define M_UPSTREAM_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <atomic>
+#include "../locker.h"
+
+//一组后端：按轮询或最少连接选择，每个后端保留空闲的长连接
+//被动健康检查：连续失败MAX_FAILS次后在FAIL_TIMEOUT秒内不再选择
+class upstream_group {
+public:
+    enum POLICY {
+        ROUND_ROBIN = 0,
+        LEAST_CONN
+    };
+    //空闲超过该秒数的连接不再复用
+    static const int IDLE_TIMEOUT = 60;
+    static const int MAX_FAILS = 3;
+    static const int FAIL_TIMEOUT = 10;
+    //exclude按位表示后端，最多64个
+    static const int MAX_SERVERS = 64;
+
+    //servers形如 127.0.0.1:8081,127.0.0.1:8082;lc，默认轮询
+    bool parse(const char *servers);
+
+    //选择一个不在exclude中的后端并取得连接，优先复用空闲连接
+    //返回非阻塞的socket，*connecting为真时connect尚未完成；全部不可用时返回-1
+    int acquire(uint64_t exclude, int *server, bool *reused, bool *connecting);
+    //keep_alive为真时放回空闲连接，否则关闭
+    void release(int server, int fd, bool keep_alive);
+    //连接、发送或等待响应失败/收到响应
+    void fail(int server);
+    void success(int server);
+
+    const std::string &name(int server) const { return m_servers[server].name; }
+    //每个后端最多保留的空闲连接，默认32，可在运行中修改
+    static void set_max_idle(int n) { m_max_idle.store(n, std::memory_order_relaxed); }
+    int size() const { return m_servers.size(); }
+
+private:
+    struct server {
+        sockaddr_in addr;
+        std::string name;
+        //正在使用的连接数，最少连接按它选择
+        int active;
+        int fails;
+        time_t down_until;
+        //空闲连接和放入的时间
+        std::vector<std::pair<int, time_t> > idle;
+    };
+
+    //以下加锁后调用
+    void fail_locked(int server);
+    //返回-1表示没有可用的后端
+    int pick(uint64_t exclude, time_t now);
+    //取出一个仍然可用的空闲连接，没有时返回-1
+    int take_idle(server &s, time_t now);
+
+    static std::atomic<int> m_max_idle;
+    POLICY m_policy;
+    std::vector<server> m_servers;
+    unsigned m_next;
+    locker m_lock;
+};
+
+//反向代理的路由：路径前缀到后端组，以及正在转发的连接
+//后端socket与客户连接一起挂在同一个epoll上，owner找出事件所属的客户连接
+class proxy_table {
+public:
+    static proxy_table *get_instance() {
+        static proxy_table instance;
+        return &instance;
+    }
+
+    //rule形如 /api/=127.0.0.1:8081,127.0.0.1:8082;lc，最长前缀优先
+    bool add(const char *rule);
+    bool empty() const { return m_routes.empty(); }
+    upstream_group *find(std::string_view path) const;
+
+    //客户连接client开始使用后端连接fd，fd超出范围时返回false
+    bool bind(int client, int fd, upstream_group *group, int server);
+    //归还client的后端连接，failed为真时计入该后端的失败次数；没有绑定时什么也不做
+    void unbind(int client, bool keep_alive, bool failed);
+    //fd为后端连接时返回所属的客户连接，否则返回-1
+    int owner(int fd) const;
+
+private:
+    static const int MAX_FD_COUNT = 65536;
+
+    proxy_table();
+    ~proxy_table();
+
+    struct binding {
+        upstream_group *group;
+        int server;
+        int fd;
+    };
+
+    //按前缀长度降序
+    std::vector<std::pair<std::string, upstream_group *> > m_routes;
+    //按客户连接的fd
+    std::vector<binding> m_bindings;
+    //按后端连接的fd，存放客户连接fd加1，0表示不是后端连接
+    std::vector<int> m_owner;
+    locker m_lock;
+};
+
+#endif
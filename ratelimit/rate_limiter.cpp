@@ -0,0 +1,78 @@
+#include <time.h>
+#include <string.h>
+#include "rate_limiter.h"
+#include "spdlog/spdlog.h"
+
+rate_limiter::rate_limiter() {
+    for (int i = 0; i < RATE_NUM; ++i) {
+        m_interval[i] = 0;
+        m_burst[i] = 0;
+        m_rejected[i] = 0;
+    }
+    for (int i = 0; i < SHARDS; ++i)
+        memset(m_shards[i].slots, 0, sizeof(m_shards[i].slots));
+}
+
+void rate_limiter::set_rate(RATE_CLASS cls, int rate, int burst) {
+    if (rate <= 0) {
+        m_interval[cls].store(0, std::memory_order_relaxed);
+        return;
+    }
+    uint64_t interval = 1000000000ULL / rate;
+    m_burst[cls].store(interval * (burst > 0 ? burst : rate), std::memory_order_relaxed);
+    m_interval[cls].store(interval, std::memory_order_relaxed);
+}
+
+//粗粒度时钟只读vDSO中的变量，精度为一个tick，对每秒数百个以内的限流足够
+static inline uint64_t coarse_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool rate_limiter::allow(RATE_CLASS cls, uint32_t ip) {
+    uint64_t interval = m_interval[cls].load(std::memory_order_relaxed);
+    if (interval == 0)
+        return true;
+    uint64_t burst = m_burst[cls].load(std::memory_order_relaxed);
+    uint64_t now = coarse_ns();
+    uint64_t key = (uint64_t)(cls + 1) << 32 | ip;
+    //乘法哈希，高位选分片，其后的位选起始槽
+    uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+    shard &s = m_shards[h >> (64 - SHARD_BITS)];
+    uint32_t start = (uint32_t)(h >> 32);
+
+    s.lock.lock();
+    entry *hit = NULL, *reuse = NULL, *oldest = NULL;
+    for (int i = 0; i < PROBE; ++i) {
+        entry &e = s.slots[(start + i) & (SLOTS - 1)];
+        if (e.key == key) {
+            hit = &e;
+            break;
+        }
+        if (!reuse && (e.key == 0 || e.tat <= now))
+            reuse = &e;
+        if (!oldest || e.tat < oldest->tat)
+            oldest = &e;
+    }
+    //没有空槽时挤掉最早回满的项，它被遗忘只会让那个IP多得一些令牌
+    if (!hit) {
+        hit = reuse ? reuse : oldest;
+        hit->key = key;
+        hit->tat = now;
+    }
+    uint64_t tat = hit->tat > now ? hit->tat : now;
+    bool ok = tat + interval - now <= burst;
+    if (ok)
+        hit->tat = tat + interval;
+    s.lock.unlock();
+
+    if (!ok)
+        m_rejected[cls].fetch_add(1, std::memory_order_relaxed);
+    return ok;
+}
+
+void rate_limiter::dump() {
+    spdlog::info("rate limited conn={0} request={1} login={2}", rejected(RATE_CONN), rejected(RATE_REQUEST),
+                 rejected(RATE_LOGIN));
+}
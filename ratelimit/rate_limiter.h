@@ -0,0 +1,60 @@
+#ifndef M_RATE_LIMITER_H
+#define M_RATE_LIMITER_H
+
+#include <stdint.h>
+#include <atomic>
+#include "../locker.h"
+
+//按客户端IP限流：每个IP在每个类别上一个令牌桶，超出时回复429
+//令牌桶用GCRA表示，每项只存下一个令牌的理论到达时刻(tat)，不需要定时补充
+//表按哈希分片，每片一把锁、开放寻址，查找只探测相邻的PROBE个槽；桶已回满的项视为过期，插入时直接复用
+
+enum RATE_CLASS {
+    RATE_CONN = 0,   //新连接，accept时检查
+    RATE_REQUEST,    //每个请求，主线程派发前检查
+    RATE_LOGIN,      //登录和注册，访问redis之前检查
+    RATE_NUM
+};
+
+class rate_limiter {
+public:
+    static rate_limiter *get_instance() {
+        static rate_limiter instance;
+        return &instance;
+    }
+
+    //每秒rate个，最多积攒burst个(0时等于rate)；rate为0关闭该类限流，可在运行中修改
+    void set_rate(RATE_CLASS cls, int rate, int burst);
+    //ip为网络字节序，令牌不足时返回false
+    bool allow(RATE_CLASS cls, uint32_t ip);
+
+    uint64_t rejected(RATE_CLASS cls) const { return m_rejected[cls].load(std::memory_order_relaxed); }
+    //输出各类别的拒绝次数
+    void dump();
+
+private:
+    rate_limiter();
+
+    static const int SHARD_BITS = 6;
+    static const int SHARDS = 1 << SHARD_BITS;
+    static const int SLOTS = 1024;
+    static const int PROBE = 8;
+
+    struct entry {
+        uint64_t key;   //(类别+1)<<32 | ip，0为空槽
+        uint64_t tat;   //ns，不晚于当前时刻时桶已满
+    };
+    //分片独占缓存行，不同分片的锁互不干扰
+    struct alignas(64) shard {
+        locker lock;
+        entry slots[SLOTS];
+    };
+
+    //两次令牌之间的间隔和可积攒的时长(ns)，间隔为0表示不限流
+    std::atomic<uint64_t> m_interval[RATE_NUM];
+    std::atomic<uint64_t> m_burst[RATE_NUM];
+    std::atomic<uint64_t> m_rejected[RATE_NUM];
+    shard m_shards[SHARDS];
+};
+
+#endif
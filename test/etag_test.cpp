@@ -0,0 +1,107 @@
+//条件请求：固定响应和普通路径(预压缩文件、后台压缩缓存)生成的ETag一致，If-None-Match能得到304
+//make test 编译并运行，在仓库根目录下执行，网站目录为./root
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <zlib.h>
+#include "../http/http_conn.h"
+#include "../compress/compressor.h"
+
+static char g_root[] = "./root";
+static int g_failed = 0;
+
+//与服务器约定的格式："inode-size-mtime"，压缩的表示加-gz
+static std::string etag_of(const std::string &file, bool gz) {
+    struct stat st;
+    if (stat(file.c_str(), &st) < 0)
+        return "\"missing\"";
+    char buf[64];
+    snprintf(buf, sizeof(buf), "\"%lx-%llx-%llx%s\"", (unsigned long)st.st_ino, (unsigned long long)st.st_size,
+             (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec, gz ? "-gz" : "");
+    return buf;
+}
+
+static http_conn::HTTP_CODE get(http_conn *conn, const char *url, bool gzip, const std::string &etag) {
+    std::string req = std::string("GET ") + url + " HTTP/1.1\r\nHost: localhost\r\n";
+    if (gzip)
+        req += "Accept-Encoding: gzip\r\n";
+    if (!etag.empty())
+        req += "If-None-Match: " + etag + "\r\n";
+    req += "\r\n";
+    return conn->parse_buffer(req.data(), req.size(), false);
+}
+
+static void expect(const char *what, http_conn::HTTP_CODE got, http_conn::HTTP_CODE want) {
+    if (got != want) {
+        printf("FAIL %s: got %d, want %d\n", what, got, want);
+        ++g_failed;
+    }
+}
+
+static bool write_file(const std::string &path, const std::string &data) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+int main() {
+    char tmp[] = "/tmp/etag_test.XXXXXX";
+    if (!mkdtemp(tmp)) {
+        printf("mkdtemp failed\n");
+        return 1;
+    }
+    std::string dir = tmp;
+    http_conn::init_fixed_responses(g_root);
+    compressor::get_instance()->init((dir + "/gz").c_str());
+
+    http_conn *conn = new http_conn;
+    conn->init_offline(g_root);
+
+    //固定响应：/ 对应judge.html，重新验证时不离开固定响应
+    std::string page = std::string(g_root) + "/judge.html";
+    expect("fixed gzip", get(conn, "/", true, etag_of(page, true)), http_conn::NOT_MODIFIED);
+    expect("fixed identity", get(conn, "/", false, etag_of(page, false)), http_conn::NOT_MODIFIED);
+    expect("fixed gzip etag, no gzip", get(conn, "/", false, etag_of(page, true)), http_conn::FIXED_REQUEST);
+    expect("fixed stale etag", get(conn, "/", true, "\"0-0-0-gz\""), http_conn::FIXED_REQUEST);
+
+    //普通路径，后台压缩缓存：压缩完成前发送原文件，之后压缩的响应与固定响应的ETag相同
+    expect("static identity", get(conn, "/judge.html", false, etag_of(page, false)), http_conn::NOT_MODIFIED);
+    http_conn::HTTP_CODE ret = http_conn::FILE_REQUEST;
+    for (int i = 0; i < 200 && ret != http_conn::NOT_MODIFIED; ++i) {
+        ret = get(conn, "/judge.html", true, etag_of(page, true));
+        if (ret != http_conn::NOT_MODIFIED)
+            usleep(10000);
+    }
+    expect("static gzip cache", ret, http_conn::NOT_MODIFIED);
+
+    //普通路径，同目录的预压缩文件：ETag仍取自原文件
+    std::string body(1024, 'a');
+    std::string gz_body;
+    compressor::gzip(body, gz_body);
+    if (!write_file(dir + "/a.html", body) || !write_file(dir + "/a.html.gz", gz_body)) {
+        printf("cannot write %s\n", dir.c_str());
+        return 1;
+    }
+    http_conn *sib = new http_conn;
+    std::string sib_root = dir;
+    sib->init_offline(&sib_root[0]);
+    expect("sibling gzip", get(sib, "/a.html", true, etag_of(dir + "/a.html", true)), http_conn::NOT_MODIFIED);
+    expect("sibling identity", get(sib, "/a.html", false, etag_of(dir + "/a.html", false)), http_conn::NOT_MODIFIED);
+    expect("sibling .gz etag", get(sib, "/a.html", true, etag_of(dir + "/a.html.gz", false)), http_conn::FILE_REQUEST);
+
+    delete sib;
+    delete conn;
+    std::string cmd = "rm -rf " + dir;
+    if (system(cmd.c_str()) != 0)
+        printf("cannot remove %s\n", dir.c_str());
+    if (g_failed) {
+        printf("%d failed\n", g_failed);
+        return 1;
+    }
+    printf("etag_test ok\n");
+    return 0;
+}
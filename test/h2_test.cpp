@@ -0,0 +1,119 @@
+//HTTP/2帧序列的回归测试：已重置的流上收到跨CONTINUATION的trailer不能访问已释放的流
+//make test 编译并运行
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <string>
+#include "../http/http_conn.h"
+#include "../http/h2_session.h"
+
+static char g_root[] = "./root";
+static int g_failed = 0;
+
+static void frame(std::string &out, uint8_t type, uint8_t flags, uint32_t stream_id, const std::string &payload) {
+    uint32_t len = payload.size();
+    out.push_back((char)(len >> 16));
+    out.push_back((char)(len >> 8));
+    out.push_back((char)len);
+    out.push_back((char)type);
+    out.push_back((char)flags);
+    out.push_back((char)(stream_id >> 24));
+    out.push_back((char)(stream_id >> 16));
+    out.push_back((char)(stream_id >> 8));
+    out.push_back((char)stream_id);
+    out += payload;
+}
+
+static void check(const char *what, bool ok) {
+    if (!ok) {
+        printf("FAIL %s\n", what);
+        ++g_failed;
+    }
+}
+
+//对端收到的帧中是否有指定类型的帧，code不为负时还须带该错误码
+static bool has_frame(const std::string &in, uint8_t type, uint32_t stream_id, int code) {
+    size_t off = 0;
+    while (off + 9 <= in.size()) {
+        const uint8_t *p = (const uint8_t *)in.data() + off;
+        uint32_t len = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+        uint32_t id = ((uint32_t)p[5] << 24 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 8 | p[8]) & 0x7fffffff;
+        if (off + 9 + len > in.size())
+            break;
+        if (p[3] == type && id == stream_id) {
+            if (code < 0)
+                return true;
+            //RST_STREAM的错误码在开头，GOAWAY的在最后一个流号之后
+            const uint8_t *c = p + 9 + (type == 7 ? 4 : 0);
+            if (len >= 4 && ((uint32_t)c[0] << 24 | (uint32_t)c[1] << 16 | (uint32_t)c[2] << 8 | c[3]) == (uint32_t)code)
+                return true;
+        }
+        off += 9 + len;
+    }
+    return false;
+}
+
+static std::string drain(int fd) {
+    std::string out;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        out.append(buf, n);
+    return out;
+}
+
+int main() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        printf("socketpair failed\n");
+        return 1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    http_conn *conn = new http_conn;
+    conn->init_offline(g_root);
+    h2_session *h2 = new h2_session(conn, true);
+
+    const uint8_t HEADERS = 1, RST_STREAM = 3, PING = 6, GOAWAY = 7, CONTINUATION = 9;
+    const uint8_t END_STREAM = 0x1, END_HEADERS = 0x4;
+    //GET / http，静态表索引
+    std::string request("\x82\x84\x86", 3);
+    //字面量 x: y，不加入动态表，分成两段
+    std::string trailer("\x00\x01x\x01y", 5);
+
+    //流1的请求头未带END_STREAM，随后被对方重置，又在其上发送跨CONTINUATION的trailer
+    std::string in;
+    frame(in, HEADERS, END_HEADERS, 1, request);
+    frame(in, RST_STREAM, 0, 1, std::string("\0\0\0\x08", 4));
+    frame(in, HEADERS, END_STREAM, 1, trailer.substr(0, 2));
+    check("feed", h2->feed(in.data(), in.size()));
+    check("process trailer headers", h2->process());
+    //写出一批后释放已重置的流
+    check("flush", h2->flush(fds[0]));
+
+    in.clear();
+    frame(in, CONTINUATION, END_HEADERS, 1, trailer.substr(2));
+    frame(in, PING, 0, 0, std::string(8, 'p'));
+    check("feed continuation", h2->feed(in.data(), in.size()));
+    check("process continuation", h2->process());
+    check("flush continuation", h2->flush(fds[0]));
+
+    std::string out = drain(fds[1]);
+    check("stream 1 closed", has_frame(out, RST_STREAM, 1, 5));
+    check("connection still usable", has_frame(out, PING, 0, -1));
+    check("no goaway", !has_frame(out, GOAWAY, 0, -1));
+
+    delete h2;
+    delete conn;
+    close(fds[0]);
+    close(fds[1]);
+    if (g_failed) {
+        printf("%d failed\n", g_failed);
+        return 1;
+    }
+    printf("h2_test ok\n");
+    return 0;
+}
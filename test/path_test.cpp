@@ -0,0 +1,42 @@
+//静态文件路径检查：含..(包括%2e编码)的请求不能访问网站目录之外的文件
+//make test 编译并运行，在仓库根目录下执行，网站目录为./root
+#include <stdio.h>
+#include <string>
+#include "../http/http_conn.h"
+
+static char g_root[] = "./root";
+static int g_failed = 0;
+
+static void expect(http_conn *conn, const char *url, http_conn::HTTP_CODE want) {
+    std::string req = std::string("GET ") + url + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    http_conn::HTTP_CODE got = conn->parse_buffer(req.data(), req.size(), false);
+    if (got != want) {
+        printf("FAIL %s: got %d, want %d\n", url, got, want);
+        ++g_failed;
+    }
+}
+
+int main() {
+    http_conn *conn = new http_conn;
+    conn->init_offline(g_root);
+    http_conn::set_autoindex(true);
+
+    expect(conn, "/judge.html", http_conn::FILE_REQUEST);
+    expect(conn, "/../../../../etc/passwd", http_conn::BAD_REQUEST);
+    expect(conn, "/%2e%2e/%2e%2e/etc/passwd", http_conn::BAD_REQUEST);
+    expect(conn, "/.%2E/.%2E/etc/passwd", http_conn::BAD_REQUEST);
+    //目录列表同样不能越过网站目录
+    expect(conn, "/../", http_conn::BAD_REQUEST);
+    expect(conn, "/a/../../", http_conn::BAD_REQUEST);
+    //只有整段为..时拒绝
+    expect(conn, "/..foo", http_conn::NO_RESOURCE);
+    expect(conn, "/foo..", http_conn::NO_RESOURCE);
+
+    delete conn;
+    if (g_failed) {
+        printf("%d failed\n", g_failed);
+        return 1;
+    }
+    printf("path_test ok\n");
+    return 0;
+}
@@ -2,10 +2,15 @@
 #define M_THREADPOOL_H
 
 #include <deque>
+#include <vector>
+#include <algorithm>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <atomic>
 #include "CGIredis/redis.h"
+#include "admission/admission.h"
+#include "trace/req_trace.h"
 #include "locker.h"
 
 //使用一个工作队列完全解除了主线程和工作线程的耦合关系：主线程往工作队列中插入任务，工作线程通过竞争来取得任务并执行它。
@@ -17,19 +22,33 @@ public:
     // thread_number是线程池中线程的数量 max_requests是请求队列中最多允许的、等待处理的请求的数量
     threadpool(connection_pool *connPool, int thread_number = 8, int max_request = 10000);
     ~threadpool();
-    bool append(T *request, int state);
+    //ready_us为事件就绪的时刻，排队时延从此算起；0表示从入队算起
+    bool append(T *request, int state, uint64_t ready_us = 0);
     bool append_p(T *request);
+    //运行中调整线程数和队列长度，多出的线程处理完手上的任务后退出
+    void resize(int thread_number, int max_requests);
+    //停止接受新任务，队列中的任务处理完后全部线程退出，等待它们结束；析构时也会调用
+    void shutdown();
+    //有工作线程在等待任务，新任务入队后可以立即开始
+    bool has_idle() const { return m_idle.load(std::memory_order_relaxed) > 0; }
 
 private:
     //工作线程运行的函数，它不断从工作队列中取出任务并执行之，必须为静态函数，否则 this指针不能带入 pthread_creat的第三个参数
     static void *worker(void *arg);
     void run();
 
+private:
+    //创建一个工作线程，shutdown时等待它结束
+    bool spawn();
+
 private:
     int m_thread_number;          //线程池中的线程数
     int m_max_requests;           //请求队列中允许的最大请求数
-    pthread_t *m_threads;         //描述线程池的数组，其大小为m_thread_number
-    std::deque<T *> m_workqueue;  //deque请求队列 不用vector 因为在头部更改效率差
+    int m_exit_number;            //缩小线程池时待退出的线程数
+    bool m_stop;                  //shutdown之后不再接受任务
+    std::vector<pthread_t> m_threads;  //运行中的工作线程
+    std::deque<std::pair<T *, uint64_t> > m_workqueue;  //deque请求队列和入队时间(us) 不用vector 因为在头部更改效率差
+    std::atomic<int> m_idle;      //等待任务的线程数
     locker m_queuelocker;         //保护请求队列的互斥锁
     sem m_queuestat;              //是否有任务需要处理
     connection_pool *m_connPool;  //数据库连接池
@@ -38,43 +57,95 @@ private:
 //构造函数中创建线程池,pthread_create函数中将类的对象作为参数传递给静态函数(worker),在静态函数中引用这个对象,并调用其动态方法(run)
 //类对象传递时用this指针，传递给静态函数后，将其转换为线程池类，并调用私有成员函数run
 template <typename T>
-threadpool<T>::threadpool(connection_pool *connPool, int thread_number, int max_requests) : m_thread_number(thread_number), m_max_requests(max_requests), m_threads(NULL),m_connPool(connPool) {
+threadpool<T>::threadpool(connection_pool *connPool, int thread_number, int max_requests) : m_thread_number(thread_number), m_max_requests(max_requests), m_exit_number(0), m_stop(false), m_idle(0), m_connPool(connPool) {
     if (thread_number <= 0 || max_requests <= 0)
         throw std::exception();
-    m_threads = new pthread_t[m_thread_number];
-    if (!m_threads) //分配内存失败
-        throw std::exception();
     //循环创建线程，并将工作线程按要求进行运行
     for (int i = 0; i < thread_number; ++i) {
-        //m_threads+i 变量地址名 ， NULL 默认属性的线程
-        if (pthread_create(m_threads + i, NULL, worker, this) != 0) {
-            delete[] m_threads;
-            throw std::exception();
-        }
-        //将线程进行分离后，不用单独对工作线程进行回收
-        if (pthread_detach(m_threads[i])) {
-            delete[] m_threads;
+        if (!spawn())
             throw std::exception();
-        }
     }
 }
 
 template <typename T>
 threadpool<T>::~threadpool() {
-    delete[] m_threads;
+    shutdown();
+}
+
+template <typename T>
+bool threadpool<T>::spawn() {
+    pthread_t tid;
+    // NULL 默认属性的线程
+    m_queuelocker.lock();
+    if (pthread_create(&tid, NULL, worker, this) != 0) {
+        m_queuelocker.unlock();
+        return false;
+    }
+    m_threads.push_back(tid);
+    m_queuelocker.unlock();
+    return true;
+}
+
+template <typename T>
+void threadpool<T>::shutdown() {
+    m_queuelocker.lock();
+    if (m_stop) {
+        m_queuelocker.unlock();
+        return;
+    }
+    m_stop = true;
+    //之后不会再有线程因缩小线程池而自行分离，m_threads不再变化
+    std::vector<pthread_t> threads = m_threads;
+    m_queuelocker.unlock();
+    //每个线程一次post，处理完队列后领到时退出
+    for (size_t i = 0; i < threads.size(); ++i)
+        m_queuestat.post();
+    for (size_t i = 0; i < threads.size(); ++i)
+        pthread_join(threads[i], NULL);
+}
+
+template <typename T>
+void threadpool<T>::resize(int thread_number, int max_requests) {
+    if (thread_number <= 0 || max_requests <= 0)
+        return;
+    m_queuelocker.lock();
+    m_max_requests = max_requests;
+    int diff = thread_number - m_thread_number;
+    //先抵消尚未退出的线程
+    while (diff > 0 && m_exit_number > 0) {
+        --m_exit_number;
+        --diff;
+        ++m_thread_number;
+    }
+    m_queuelocker.unlock();
+    for (; diff > 0; --diff) {
+        if (!spawn())
+            return;
+        m_queuelocker.lock();
+        ++m_thread_number;
+        m_queuelocker.unlock();
+    }
+    //每个退出名额对应一次post，由空闲的线程领取
+    for (; diff < 0; ++diff) {
+        m_queuelocker.lock();
+        ++m_exit_number;
+        --m_thread_number;
+        m_queuelocker.unlock();
+        m_queuestat.post();
+    }
 }
 
 //通过deque容器创建请求队列，向队列中添加时，通过互斥锁保证线程安全，添加完成后通过信号量提醒有任务要处理，最后注意线程同步。
 template <typename T>
-bool threadpool<T>::append(T *request, int state) {
+bool threadpool<T>::append(T *request, int state, uint64_t ready_us) {
     m_queuelocker.lock();
     //根据硬件，预先设置请求队列的最大值
-    if (m_workqueue.size() >= m_max_requests) {
+    if (m_stop || m_workqueue.size() >= m_max_requests) {
         m_queuelocker.unlock();
         return false;
     }
     request->m_state = state;
-    m_workqueue.push_back(request);
+    m_workqueue.push_back(std::make_pair(request, ready_us ? ready_us : admission::now_us()));
     m_queuelocker.unlock();
     m_queuestat.post(); //append以后信号量 post    run-> work
     return true;
@@ -83,11 +154,11 @@ bool threadpool<T>::append(T *request, int state) {
 template <typename T>
 bool threadpool<T>::append_p(T *request) {
     m_queuelocker.lock();
-    if (m_workqueue.size() >= m_max_requests) {
+    if (m_stop || m_workqueue.size() >= m_max_requests) {
         m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.push_back(request);
+    m_workqueue.push_back(std::make_pair(request, admission::now_us()));
     m_queuelocker.unlock();
     m_queuestat.post();
     return true;
@@ -105,23 +176,42 @@ template <typename T>
 void threadpool<T>::run() {
     while (true) {
         //信号量等待
+        ++m_idle;
         m_queuestat.wait();
+        --m_idle;
         //被唤醒后先加互斥锁
         m_queuelocker.lock();
+        if (m_exit_number > 0 && !m_stop) {
+            --m_exit_number;
+            //缩小线程池时退出的线程不再由shutdown等待
+            m_threads.erase(std::find(m_threads.begin(), m_threads.end(), pthread_self()));
+            pthread_detach(pthread_self());
+            m_queuelocker.unlock();
+            return;
+        }
         if (m_workqueue.empty()) {
+            bool stop = m_stop;
             m_queuelocker.unlock();
+            if (stop)
+                return;
             continue;
         }
-        T *request = m_workqueue.front();//从请求队列中取出第一个任务
+        T *request = m_workqueue.front().first;//从请求队列中取出第一个任务
+        uint64_t enqueued = m_workqueue.front().second;
         m_workqueue.pop_front();//将任务从请求队列删除
         m_queuelocker.unlock();
+        //排队时延供过载判断
+        admission::get_instance()->record_sojourn(admission::now_us() - enqueued);
         if (!request)
             continue;
         //reactor模式中，主线程(I/O处理单元)只负责监听文件描述符上是否有事件发生
         //有的话立即通知工作线程(逻辑单元 )，读写数据、接受新连接及处理客户请求均在工作线程中完成 通常由同步I/O实现
         //state 读为0, 写为1
         if (request->m_state == 0) {
-            if (request->read_once()) {
+            request->m_trace.stamp(TP_DEQUEUE);
+            bool read_ok = request->read_once();
+            request->m_trace.stamp(TP_READ);
+            if (read_ok) {
                 request->improv = 1;
                 connectionRAII myrediscon(&request->redis, m_connPool);
                 request->process();
@@ -36,6 +36,17 @@ void sort_timer_lst::adjust_timer(util_timer *timer) {
     if (!timer) {
         return;
     }
+    //超时时间提前(请求截止时刻早于空闲超时)时，取下后从链表头重新插入
+    if (timer->prev && timer->expire < timer->prev->expire) {
+        timer->prev->next = timer->next;
+        if (timer->next)
+            timer->next->prev = timer->prev;
+        else
+            tail = timer->prev;
+        timer->prev = timer->next = NULL;
+        add_timer(timer);
+        return;
+    }
     util_timer *tmp = timer->next;
     if (!tmp || (timer->expire < tmp->expire)) {
         return;
@@ -184,8 +195,11 @@ int Utils::u_epollfd = 0;
 
 class Utils;
 void cb_func(client_data *user_data) {
-    epoll_ctl(Utils::u_epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
     assert(user_data);
+    epoll_ctl(Utils::u_epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
+    //等待后端超时时关闭后端连接并计入失败次数，TLS和HTTP/2会话、临时文件、文件映射一并释放
+    if (user_data->conn)
+        user_data->conn->release(true);
     close(user_data->sockfd);
     --http_conn::m_user_count;
 }
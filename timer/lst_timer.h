@@ -25,11 +25,14 @@
 #include "spdlog/spdlog.h"
 
 class util_timer;
+class http_conn;
 
 struct client_data {
     sockaddr_in address;
     int sockfd;
     util_timer *timer;
+    //超时关闭时释放连接持有的资源
+    http_conn *conn;
 };
 
 class util_timer {
@@ -54,6 +57,8 @@ public:
     void adjust_timer(util_timer *timer);
     void del_timer(util_timer *timer);
     void tick();
+    //按超时时间排序的第一个定时器，用于遍历全部连接
+    util_timer *front() const { return head; }
 
 private:
     void add_timer(util_timer *timer, util_timer *lst_head);
@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <atomic>
+#include <openssl/err.h>
+#include "tls_context.h"
+#include "spdlog/spdlog.h"
+
+tls_context::tls_context() : m_ctx(NULL), m_cache_size(20480) {
+}
+
+void tls_context::set_cache_size(long size) {
+    m_cache_size = size;
+    if (m_ctx)
+        SSL_CTX_sess_set_cache_size(m_ctx, size);
+}
+
+tls_context::~tls_context() {
+    if (m_ctx)
+        SSL_CTX_free(m_ctx);
+}
+
+bool tls_context::init(const char *cert_file, const char *key_file) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+        return false;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    //内核或密码套件不支持kTLS时OpenSSL自动留在用户态加密
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    //writev一次可能只写出一部分，重试时缓冲区地址会变化
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+    //会话恢复：TLS1.2的会话ID查服务端缓存，会话票据由OpenSSL生成的密钥加密，进程内有效
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, m_cache_size);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"PoorWebServer", 13);
+    SSL_CTX_set_timeout(ctx, 3600);
+    SSL_CTX_set_num_tickets(ctx, 1);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1) {
+        char err[256];
+        ERR_error_string_n(ERR_get_error(), err, sizeof(err));
+        spdlog::error("tls: cannot load {0} / {1}: {2}", cert_file, key_file, err);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    m_ctx = ctx;
+    return true;
+}
+
+SSL *tls_context::accept(int fd) {
+    SSL *ssl = SSL_new(m_ctx);
+    if (!ssl)
+        return NULL;
+    if (SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+int tls_context::handshake(SSL *ssl, bool *want_write) {
+    ERR_clear_error();
+    int ret = SSL_do_handshake(ssl);
+    if (ret == 1)
+        return 1;
+    int err = SSL_get_error(ssl, ret);
+    *want_write = err == SSL_ERROR_WANT_WRITE;
+    return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+}
+
+ssize_t tls_context::recv(SSL *ssl, void *buf, size_t len) {
+    ERR_clear_error();
+    int n = SSL_read(ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+    if (n > 0)
+        return n;
+    int err = SSL_get_error(ssl, n);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN)
+        return 0;
+    errno = ECONNRESET;
+    return -1;
+}
+
+//kTLS生效时直接writev，否则SSL_write
+//响应头等小片段拼成一个记录再写，避免多个小记录被Nagle延迟
+//EAGAIN后调用方从未发送的位置重试，拼出的内容和长度与失败时相同
+ssize_t tls_context::writev(SSL *ssl, int fd, const struct iovec *iov, int count) {
+    if (ktls_send(ssl))
+        return ::writev(fd, iov, count);
+    char record[MAX_RECORD];
+    ssize_t total = 0;
+    int i = 0;
+    size_t off = 0;
+    while (i < count) {
+        if (off == iov[i].iov_len) {
+            ++i;
+            off = 0;
+            continue;
+        }
+        const char *data = (const char *)iov[i].iov_base + off;
+        size_t len = iov[i].iov_len - off;
+        if (len < MAX_RECORD) {
+            len = 0;
+            for (int k = i; k < count && len < MAX_RECORD; ++k) {
+                size_t from = k == i ? off : 0;
+                size_t n = iov[k].iov_len - from;
+                if (n > MAX_RECORD - len)
+                    n = MAX_RECORD - len;
+                memcpy(record + len, (const char *)iov[k].iov_base + from, n);
+                len += n;
+            }
+            data = record;
+        }
+        ERR_clear_error();
+        int n = SSL_write(ssl, data, len > INT_MAX ? INT_MAX : (int)len);
+        if (n <= 0) {
+            if (total > 0)
+                return total;
+            int err = SSL_get_error(ssl, n);
+            errno = err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ ? EAGAIN : EPIPE;
+            return -1;
+        }
+        total += n;
+        //跳过已写出的n字节
+        for (size_t left = n; left > 0;) {
+            size_t k = iov[i].iov_len - off < left ? iov[i].iov_len - off : left;
+            off += k;
+            left -= k;
+            if (off == iov[i].iov_len && left > 0) {
+                ++i;
+                off = 0;
+            }
+        }
+    }
+    return total;
+}
+
+bool tls_context::ktls_send(SSL *ssl) {
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+void tls_context::log_ktls(SSL *ssl) {
+    static std::atomic<bool> logged(false);
+    if (logged.exchange(true))
+        return;
+    spdlog::info("tls: {0} {1}, kTLS send {2} recv {3}", SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+                 ktls_send(ssl) ? "on" : "off", BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? "on" : "off");
+}
@@ -0,0 +1,48 @@
+#ifndef M_TLS_CONTEXT_H
+#define M_TLS_CONTEXT_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+
+//HTTPS监听共用的SSL_CTX：服务端会话缓存和会话票据用于会话恢复
+//握手完成后由OpenSSL开启内核TLS(kTLS)，发送方向生效时响应仍用writev写socket，
+//由内核加密，mmap的文件内容不经过用户态拷贝；内核不支持时退回SSL_write
+
+class tls_context {
+public:
+    static tls_context *get_instance() {
+        static tls_context instance;
+        return &instance;
+    }
+
+    //加载证书链和私钥，失败时不启用HTTPS监听
+    bool init(const char *cert_file, const char *key_file);
+    bool enabled() const { return m_ctx != NULL; }
+    //服务端会话缓存的条目数，可在运行中修改
+    void set_cache_size(long size);
+    //为新连接创建SSL对象，进入服务端握手状态
+    SSL *accept(int fd);
+
+    //非阻塞握手，返回1完成，0等待socket可读或可写(*want_write)，-1失败
+    static int handshake(SSL *ssl, bool *want_write);
+    //以下返回值和errno与recv/writev一致，WANT_READ/WANT_WRITE对应EAGAIN
+    static ssize_t recv(SSL *ssl, void *buf, size_t len);
+    static ssize_t writev(SSL *ssl, int fd, const struct iovec *iov, int count);
+    //发送方向的kTLS是否生效
+    static bool ktls_send(SSL *ssl);
+    //第一个完成握手的连接打印kTLS状态
+    static void log_ktls(SSL *ssl);
+
+private:
+    //TLS记录的最大明文长度
+    static const size_t MAX_RECORD = 16384;
+
+    tls_context();
+    ~tls_context();
+
+    SSL_CTX *m_ctx;
+    long m_cache_size;
+};
+
+#endif
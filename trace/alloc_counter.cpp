@@ -0,0 +1,53 @@
+#include <errno.h>
+#include <stddef.h>
+#include "alloc_counter.h"
+
+#ifdef ALLOC_COUNT
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+void __libc_free(void *ptr);
+}
+
+static __thread uint64_t t_allocs = 0;
+
+uint64_t alloc_counter::count() {
+    return t_allocs;
+}
+
+//operator new也经过malloc，一并计入
+extern "C" {
+void *malloc(size_t size) {
+    ++t_allocs;
+    return __libc_malloc(size);
+}
+void *calloc(size_t n, size_t size) {
+    ++t_allocs;
+    return __libc_calloc(n, size);
+}
+void *realloc(void *ptr, size_t size) {
+    ++t_allocs;
+    return __libc_realloc(ptr, size);
+}
+void *memalign(size_t align, size_t size) {
+    ++t_allocs;
+    return __libc_memalign(align, size);
+}
+int posix_memalign(void **ptr, size_t align, size_t size) {
+    ++t_allocs;
+    *ptr = __libc_memalign(align, size);
+    return *ptr ? 0 : ENOMEM;
+}
+void *aligned_alloc(size_t align, size_t size) {
+    ++t_allocs;
+    return __libc_memalign(align, size);
+}
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef M_ALLOC_COUNTER_H
+#define M_ALLOC_COUNTER_H
+
+#include <stdint.h>
+
+//调试用：统计当前线程调用malloc/calloc/realloc的次数
+//make DEBUG=0 ALLOC_COUNT=1 时链接alloc_counter.cpp替换malloc，与ASan不能同时使用
+class alloc_counter {
+public:
+#ifdef ALLOC_COUNT
+    static uint64_t count();
+#else
+    static uint64_t count() { return 0; }
+#endif
+};
+
+#endif
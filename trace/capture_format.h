@@ -0,0 +1,22 @@
+#ifndef M_CAPTURE_FORMAT_H
+#define M_CAPTURE_FORMAT_H
+
+#include <stdint.h>
+
+//抓包文件格式(本机字节序):
+//  文件头 magic[8]="PWSCAP01", uint64 开始时的CLOCK_REALTIME纳秒
+//  记录   uint64 相对开始的纳秒, uint32 连接编号, uint32 长度, 随后为原始字节
+#define CAPTURE_MAGIC "PWSCAP01"
+
+struct capture_file_header {
+    char magic[8];
+    uint64_t start_realtime_ns;
+};
+
+struct capture_record_header {
+    uint64_t ts_ns;
+    uint32_t conn_id;
+    uint32_t len;
+};
+
+#endif
@@ -0,0 +1,123 @@
+#include <unistd.h>
+#include "req_trace.h"
+#include "spdlog/spdlog.h"
+
+static const char *stage_name[ST_NUM] = {
+    "reactor", "queue", "read", "parse", "redis", "process", "write", "total"
+};
+
+bool req_trace::m_enabled = false;
+uint64_t req_trace::m_ns_per_tick_q32 = 1ULL << 32;
+uint64_t req_trace::m_slow_ns = 0;
+int req_trace::m_sample = 1;
+std::atomic<uint64_t> req_trace::m_slow_count(0);
+req_trace::hist req_trace::m_hist[ST_NUM];
+
+void req_trace::init(int slow_us, int sample) {
+    m_enabled = slow_us >= 0;
+    m_slow_ns = slow_us > 0 ? (uint64_t)slow_us * 1000 : 0;
+    m_sample = sample > 0 ? sample : 1;
+    if (!m_enabled)
+        return;
+
+#if defined(__x86_64__)
+    //用CLOCK_MONOTONIC校准rdtsc频率，约20ms
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t c0 = now();
+    usleep(20000);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t c1 = now();
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    if (c1 > c0)
+        m_ns_per_tick_q32 = (uint64_t)(ns / (double)(c1 - c0) * 4294967296.0);
+#endif
+    spdlog::info("request trace on, slow threshold {0}us, sample 1/{1}", slow_us, m_sample);
+}
+
+void req_trace::record(int stage, uint64_t ticks) {
+    if (!m_enabled)
+        return;
+    uint64_t ns = to_ns(ticks);
+    int idx = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (idx >= HIST_BUCKETS)
+        idx = HIST_BUCKETS - 1;
+
+    hist &h = m_hist[stage];
+    h.count.fetch_add(1, std::memory_order_relaxed);
+    h.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    h.bucket[idx].fetch_add(1, std::memory_order_relaxed);
+    uint64_t old = h.max_ns.load(std::memory_order_relaxed);
+    while (ns > old && !h.max_ns.compare_exchange_weak(old, ns, std::memory_order_relaxed)) {
+    }
+}
+
+void req_trace::finish(const char *url) {
+    if (!m_enabled || m_tp[TP_WRITE] == 0)
+        return;
+
+    uint64_t st[ST_NUM] = {0};
+    st[ST_QUEUE] = span(m_tp[TP_EVENT], m_tp[TP_DEQUEUE]);
+    st[ST_READ] = span(m_tp[TP_DEQUEUE], m_tp[TP_READ]);
+    st[ST_PARSE] = span(m_tp[TP_READ], m_tp[TP_PARSE]);
+    st[ST_REDIS] = span(m_tp[TP_REDIS_BEGIN], m_tp[TP_REDIS_END]);
+    st[ST_PROCESS] = span(m_tp[TP_PARSE], m_tp[TP_PROCESS]);
+    if (st[ST_PROCESS] > st[ST_REDIS])
+        st[ST_PROCESS] -= st[ST_REDIS];
+    st[ST_WRITE] = span(m_tp[TP_PROCESS], m_tp[TP_WRITE]);
+    st[ST_TOTAL] = span(m_tp[TP_EVENT], m_tp[TP_WRITE]);
+
+    for (int i = ST_QUEUE; i < ST_NUM; ++i) {
+        //redis阶段只统计访问了redis的请求
+        if (i == ST_REDIS && m_tp[TP_REDIS_BEGIN] == 0)
+            continue;
+        record(i, st[i]);
+    }
+
+    uint64_t total_ns = to_ns(st[ST_TOTAL]);
+    if (m_slow_ns == 0 || total_ns < m_slow_ns)
+        return;
+    if (m_slow_count.fetch_add(1, std::memory_order_relaxed) % m_sample != 0)
+        return;
+    spdlog::warn("slow request {0} total {1}us: queue {2}us read {3}us parse {4}us redis {5}us process {6}us write {7}us",
+                 url ? url : "-", total_ns / 1000,
+                 to_ns(st[ST_QUEUE]) / 1000, to_ns(st[ST_READ]) / 1000,
+                 to_ns(st[ST_PARSE]) / 1000, to_ns(st[ST_REDIS]) / 1000,
+                 to_ns(st[ST_PROCESS]) / 1000, to_ns(st[ST_WRITE]) / 1000);
+}
+
+//按桶估算分位数，返回所在桶的上界
+uint64_t req_trace::percentile(const uint64_t *bucket, uint64_t count, double p) {
+    uint64_t target = (uint64_t)(count * p);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += bucket[i];
+        if (seen > target)
+            return 2ULL << i;
+    }
+    return 2ULL << (HIST_BUCKETS - 1);
+}
+
+void req_trace::dump() {
+    if (!m_enabled)
+        return;
+    for (int i = 0; i < ST_NUM; ++i) {
+        hist &h = m_hist[i];
+        uint64_t bucket[HIST_BUCKETS];
+        uint64_t count = 0;
+        for (int j = 0; j < HIST_BUCKETS; ++j) {
+            bucket[j] = h.bucket[j].load(std::memory_order_relaxed);
+            count += bucket[j];
+        }
+        if (count == 0)
+            continue;
+        spdlog::info("trace {0:<8} n={1} avg={2}us p50<{3}us p99<{4}us p999<{5}us max={6}us",
+                     stage_name[i], count,
+                     h.sum_ns.load(std::memory_order_relaxed) / count / 1000,
+                     percentile(bucket, count, 0.5) / 1000,
+                     percentile(bucket, count, 0.99) / 1000,
+                     percentile(bucket, count, 0.999) / 1000,
+                     h.max_ns.load(std::memory_order_relaxed) / 1000);
+    }
+    spdlog::info("trace slow requests {0}", m_slow_count.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,104 @@
+#ifndef M_REQ_TRACE_H
+#define M_REQ_TRACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+
+//请求各阶段的打点，用于定位尾延迟
+//x86_64下时间源使用rdtsc，启动时用CLOCK_MONOTONIC校准，其余平台退化为CLOCK_MONOTONIC
+enum TRACE_POINT {
+    TP_EVENT = 0,    //主线程dealwithread收到读事件
+    TP_DEQUEUE,      //工作线程从请求队列取出任务
+    TP_READ,         //read_once读取完成
+    TP_PARSE,        //process_read解析完成
+    TP_REDIS_BEGIN,  //do_request开始访问redis
+    TP_REDIS_END,    //redis访问结束
+    TP_PROCESS,      //process_write生成响应完成
+    TP_WRITE,        //write发送完毕
+    TP_NUM
+};
+
+//直方图统计的阶段，由相邻打点相减得到
+enum TRACE_STAGE {
+    ST_REACTOR = 0,  //主线程在dealwithread/dealwithwrite中自旋等待improv
+    ST_QUEUE,        //请求队列中等待
+    ST_READ,         //read_once
+    ST_PARSE,        //process_read
+    ST_REDIS,        //do_request中的redis访问
+    ST_PROCESS,      //do_request和process_write，扣除redis
+    ST_WRITE,        //响应就绪到发送完毕，包含EPOLLOUT往返
+    ST_TOTAL,        //收到读事件到发送完毕
+    ST_NUM
+};
+
+class req_trace {
+public:
+    //对数直方图，第i个桶统计[2^i, 2^(i+1)) ns
+    static const int HIST_BUCKETS = 40;
+
+    //slow_us: 慢请求阈值(微秒)，小于0关闭打点，等于0只统计直方图
+    //sample: 超过阈值的请求每sample个打印一次
+    static void init(int slow_us, int sample);
+
+    static inline uint64_t now() {
+#if defined(__x86_64__)
+        uint32_t lo, hi;
+        __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+        return ((uint64_t)hi << 32) | lo;
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+    static uint64_t to_ns(uint64_t ticks) {
+        return (uint64_t)(((unsigned __int128)ticks * m_ns_per_tick_q32) >> 32);
+    }
+
+    //直接向某个阶段的直方图记录一次耗时(时钟周期)
+    static void record(int stage, uint64_t ticks);
+    //输出各阶段的直方图统计
+    static void dump();
+
+    void reset() {
+        memset(m_tp, 0, sizeof(m_tp));
+    }
+    void stamp(int tp) {
+        if (m_enabled)
+            m_tp[tp] = now();
+    }
+    //只记录第一次，一个请求分多次读入时保留首个读事件
+    void stamp_once(int tp) {
+        if (m_enabled && m_tp[tp] == 0)
+            m_tp[tp] = now();
+    }
+    //请求结束，汇总到直方图，超过阈值的按采样率打印完整耗时分解
+    void finish(const char *url);
+
+    static bool m_enabled;
+
+private:
+    struct hist {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum_ns;
+        std::atomic<uint64_t> max_ns;
+        std::atomic<uint64_t> bucket[HIST_BUCKETS];
+    };
+
+    static uint64_t span(uint64_t from, uint64_t to) {
+        return (from && to > from) ? to - from : 0;
+    }
+    static uint64_t percentile(const uint64_t *bucket, uint64_t count, double p);
+
+    uint64_t m_tp[TP_NUM];
+
+    static uint64_t m_ns_per_tick_q32;  //每个时钟周期的纳秒数，32.32定点
+    static uint64_t m_slow_ns;
+    static int m_sample;
+    static std::atomic<uint64_t> m_slow_count;
+    static hist m_hist[ST_NUM];
+};
+
+#endif
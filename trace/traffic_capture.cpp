@@ -0,0 +1,76 @@
+#include <string.h>
+#include <time.h>
+#include "traffic_capture.h"
+#include "spdlog/spdlog.h"
+
+static uint64_t clock_ns(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+traffic_capture::traffic_capture()
+    : m_fp(NULL), m_sample_rate(1), m_max_bytes(0), m_bytes(0), m_start_ns(0), m_conn_seq(0), m_next_id(0) {
+}
+
+traffic_capture::~traffic_capture() {
+    if (m_fp != NULL) {
+        fclose(m_fp);
+    }
+}
+
+bool traffic_capture::init(const char *path, int sample_rate, uint64_t max_bytes) {
+    if (path == NULL || path[0] == '\0')
+        return false;
+    m_fp = fopen(path, "wb");
+    if (m_fp == NULL) {
+        spdlog::error("capture: cannot open {0}", path);
+        return false;
+    }
+    //大缓冲，减少工作线程持锁写文件的次数
+    setvbuf(m_fp, NULL, _IOFBF, 1 << 20);
+    m_sample_rate = sample_rate > 0 ? sample_rate : 1;
+    m_max_bytes = max_bytes;
+    m_start_ns = clock_ns(CLOCK_MONOTONIC);
+
+    capture_file_header header;
+    memcpy(header.magic, CAPTURE_MAGIC, 8);
+    header.start_realtime_ns = clock_ns(CLOCK_REALTIME);
+    fwrite(&header, sizeof(header), 1, m_fp);
+    m_bytes = sizeof(header);
+    spdlog::info("capture requests to {0}, 1/{1} connections", path, m_sample_rate);
+    return true;
+}
+
+uint32_t traffic_capture::sample() {
+    if (m_fp == NULL)
+        return 0;
+    if (m_conn_seq.fetch_add(1, std::memory_order_relaxed) % m_sample_rate != 0)
+        return 0;
+    return m_next_id.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+void traffic_capture::record(uint32_t conn_id, const char *data, int len) {
+    if (m_fp == NULL || conn_id == 0 || len <= 0)
+        return;
+    capture_record_header rec;
+    rec.ts_ns = clock_ns(CLOCK_MONOTONIC) - m_start_ns;
+    rec.conn_id = conn_id;
+    rec.len = len;
+
+    m_mutex.lock();
+    if (m_bytes + sizeof(rec) + len <= m_max_bytes) {
+        fwrite(&rec, sizeof(rec), 1, m_fp);
+        fwrite(data, 1, len, m_fp);
+        m_bytes += sizeof(rec) + len;
+    }
+    m_mutex.unlock();
+}
+
+void traffic_capture::flush() {
+    if (m_fp == NULL)
+        return;
+    m_mutex.lock();
+    fflush(m_fp);
+    m_mutex.unlock();
+}
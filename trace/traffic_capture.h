@@ -0,0 +1,42 @@
+#ifndef M_TRAFFIC_CAPTURE_H
+#define M_TRAFFIC_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include "../locker.h"
+#include "capture_format.h"
+
+//按连接采样记录read_once收到的原始请求字节，供bench/replay回放，格式见capture_format.h
+
+class traffic_capture {
+public:
+    static traffic_capture *get_instance() {
+        static traffic_capture instance;
+        return &instance;
+    }
+
+    //path为空时不抓包，sample_rate为每n个连接抓1个，max_bytes为文件大小上限
+    bool init(const char *path, int sample_rate, uint64_t max_bytes = 1ULL << 30);
+    //新连接调用，返回0表示不抓取，否则为该连接的编号
+    uint32_t sample();
+    void record(uint32_t conn_id, const char *data, int len);
+    void flush();
+
+    bool enabled() const { return m_fp != NULL; }
+
+private:
+    traffic_capture();
+    ~traffic_capture();
+
+    FILE *m_fp;
+    int m_sample_rate;
+    uint64_t m_max_bytes;
+    uint64_t m_bytes;
+    uint64_t m_start_ns;
+    std::atomic<uint32_t> m_conn_seq;
+    std::atomic<uint32_t> m_next_id;
+    locker m_mutex;
+};
+
+#endif
@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <vector>
+#include "handoff.h"
+
+//新进程从环境变量得知与旧进程相连的socket
+static const char ENV_NAME[] = "POORWEB_HANDOFF_FD";
+//exec前把socket固定到3，其余描述符全部关闭
+static const int CHILD_FD = 3;
+
+int handoff::m_fd = -1;
+
+//端口作为数据，监听socket作为SCM_RIGHTS辅助数据，一条消息发出
+static bool send_fds(int sock, const int *ports, const int *fds, int n) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    struct iovec iov;
+    iov.iov_base = (void *)ports;
+    iov.iov_len = n * sizeof(int);
+    char control[CMSG_SPACE(sizeof(int) * handoff::MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len;
+}
+
+pid_t handoff::spawn(char *const argv[], const int *ports, const int *fds, int n, int *ctrl) {
+    if (n <= 0 || n > MAX_FDS)
+        return -1;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+
+    //fork之后子进程只能调用异步信号安全的函数，环境变量事先准备好
+    char fd_env[64];
+    snprintf(fd_env, sizeof(fd_env), "%s=%d", ENV_NAME, CHILD_FD);
+    std::vector<char *> envp;
+    for (char **e = environ; *e; ++e) {
+        if (strncmp(*e, ENV_NAME, sizeof(ENV_NAME) - 1) != 0 || (*e)[sizeof(ENV_NAME) - 1] != '=')
+            envp.push_back(*e);
+    }
+    envp.push_back(fd_env);
+    envp.push_back(NULL);
+    long max_fd = sysconf(_SC_OPEN_MAX);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        //客户连接、epoll和后端连接都不能带进新进程，否则旧进程关闭后连接不会断开
+        if (sv[1] == CHILD_FD)
+            fcntl(CHILD_FD, F_SETFD, 0);
+        else if (dup2(sv[1], CHILD_FD) < 0)
+            _exit(127);
+        bool closed = false;
+#ifdef SYS_close_range
+        closed = syscall(SYS_close_range, CHILD_FD + 1, ~0U, 0) == 0;
+#endif
+        for (long fd = CHILD_FD + 1; !closed && fd < max_fd; ++fd)
+            close(fd);
+        execvpe(argv[0], argv, envp.data());
+        _exit(127);
+    }
+
+    close(sv[1]);
+    //新进程exec期间消息留在socket缓冲区中
+    if (!send_fds(sv[0], ports, fds, n)) {
+        close(sv[0]);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    *ctrl = sv[0];
+    return pid;
+}
+
+int handoff::receive(int *ports, int *fds, int max) {
+    const char *env = getenv(ENV_NAME);
+    if (!env)
+        return 0;
+    m_fd = atoi(env);
+    unsetenv(ENV_NAME);
+    fcntl(m_fd, F_SETFD, FD_CLOEXEC);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    struct iovec iov;
+    iov.iov_base = ports;
+    iov.iov_len = max * sizeof(int);
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t ret;
+    do {
+        ret = recvmsg(m_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0)
+        return -1;
+
+    int n = 0;
+    int received[MAX_FDS];
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(received, CMSG_DATA(cmsg), sizeof(int) * n);
+    }
+    //端口和描述符个数对不上时放弃交接
+    if (n == 0 || n > max || n * sizeof(int) != (size_t)ret) {
+        for (int i = 0; i < n; ++i)
+            close(received[i]);
+        return -1;
+    }
+    memcpy(fds, received, sizeof(int) * n);
+    return n;
+}
+
+void handoff::ready() {
+    if (m_fd < 0)
+        return;
+    char c = 1;
+    send(m_fd, &c, 1, MSG_NOSIGNAL);
+    close(m_fd);
+    m_fd = -1;
+}
@@ -0,0 +1,29 @@
+#ifndef M_HANDOFF_H
+#define M_HANDOFF_H
+
+#include <sys/types.h>
+
+//平滑升级：旧进程fork并exec新的可执行文件，经Unix socket(SCM_RIGHTS)把监听socket交给它
+//新进程在同一个监听socket上开始accept后通知旧进程，旧进程停止accept，处理完已有连接后退出
+//两个进程共用内核中的同一个监听队列，交接期间不会拒绝或丢失连接
+
+class handoff {
+public:
+    //最多传递的监听socket数
+    static const int MAX_FDS = 4;
+
+    //旧进程：以argv启动新进程并发出fds及对应的端口，*ctrl为与新进程相连的socket
+    //新进程就绪时ctrl上可读到一个字节，读到EOF表示新进程已退出；失败时返回-1
+    static pid_t spawn(char *const argv[], const int *ports, const int *fds, int n, int *ctrl);
+
+    //新进程：接收旧进程的监听socket，返回个数；不是由spawn启动时返回0
+    static int receive(int *ports, int *fds, int max);
+    //新进程：监听socket已加入epoll，通知旧进程停止accept
+    static void ready();
+
+private:
+    //新进程中与旧进程相连的socket
+    static int m_fd;
+};
+
+#endif
@@ -1,8 +1,13 @@
+#include <netinet/tcp.h>
 #include "webserver.h"
 
 WebServer::WebServer() {
-    //http_conn类对象
-    users = new http_conn[MAX_FD];
+    //http_conn类对象和定时器按配置的最大连接数在init中分配
+    users = NULL;
+    users_timer = NULL;
+    events = NULL;
+    m_connPool = NULL;
+    m_pool = NULL;
 
     //root文件夹路径
     char server_path[200];
@@ -12,71 +17,293 @@ WebServer::WebServer() {
     strcpy(m_root, server_path);
     strcat(m_root, root);
 
-    //定时器
-    users_timer = new client_data[MAX_FD];
+    m_tls_port = 0;
+    m_tls_listenfd = -1;
+
+    m_upgrade_pid = -1;
+    m_upgrade_fd = -1;
+    m_drain_deadline = 0;
+    m_last_sweep = 0;
+    m_ready_us = 0;
+
+    //预留一个fd，文件描述符耗尽时用它腾出位置接受并关闭连接
+    m_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    m_accept_err_time = 0;
+    m_accept_err_count = 0;
 }
 
 WebServer::~WebServer() {
     close(m_epollfd);
-    close(m_listenfd);
+    if (m_listenfd >= 0)
+        close(m_listenfd);
+    if (m_upgrade_fd >= 0)
+        close(m_upgrade_fd);
+    if (m_tls_listenfd >= 0)
+        close(m_tls_listenfd);
+    if (m_spare_fd >= 0)
+        close(m_spare_fd);
     close(m_pipefd[1]);
     close(m_pipefd[0]);
     delete[] users;
     delete[] users_timer;
+    delete[] events;
     delete m_pool;
 }
 
-void WebServer::init(int port, int redis_num, int thread_num) {
-    m_port = port;
-    m_redis_num = redis_num;
-    m_thread_num = thread_num;
+void WebServer::init(const Config &config) {
+    m_config = config;
+    m_port = config.PORT;
+
+    users = new http_conn[config.max_fd];
+    users_timer = new client_data[config.max_fd];
+    events = new epoll_event[config.max_events];
+
+    //请求打点，校准时钟
+    req_trace::init(config.trace_slow_us, config.trace_sample);
+
+    //按连接采样抓取原始请求
+    traffic_capture::get_instance()->init(config.capture_file.c_str(), config.capture_rate);
+
+    //静态文件的Cache-Control
+    for (size_t i = 0; i < config.cache_rules.size(); ++i) {
+        if (!http_conn::add_cache_control(config.cache_rules[i].c_str()))
+            spdlog::warn("invalid cache rule: {}", config.cache_rules[i]);
+    }
+
+    //可压缩文件的gzip缓存，由后台线程生成
+    compressor::get_instance()->init(config.gzip_cache.c_str());
+
+    //超出读缓冲区的请求体写入临时文件
+    http_conn::set_body_limit(config.max_body_size, config.spool_dir.c_str());
+
+    //HTTPS，证书加载失败时只开HTTP
+    if (config.tls_port > 0) {
+        if (tls_context::get_instance()->init(config.tls_cert.c_str(), config.tls_key.c_str()))
+            m_tls_port = config.tls_port;
+        else
+            spdlog::error("https disabled");
+    }
+
+    //反向代理，按路径前缀转发到后端
+    for (size_t i = 0; i < config.proxy_rules.size(); ++i) {
+        if (!proxy_table::get_instance()->add(config.proxy_rules[i].c_str()))
+            spdlog::warn("invalid proxy rule: {}", config.proxy_rules[i]);
+    }
+
+    apply_runtime(config);
+
+    //固定路由的页面和错误页在启动时生成完整响应
+    http_conn::init_fixed_responses(m_root);
+    date_cache::refresh();
+}
+
+void WebServer::apply_runtime(const Config &config) {
+    spdlog::level::level_enum level = spdlog::level::from_str(config.log_level);
+    if (level == spdlog::level::off && config.log_level != "off")
+        spdlog::warn("invalid log level: {}", config.log_level);
+    else
+        spdlog::set_level(level);
+    //定时器下次触发时按新的间隔，已有连接的超时在下次活动时按新值调整
+    utils.m_TIMESLOT = config.timeslot;
+    m_config.timeslot = config.timeslot;
+    m_config.idle_timeout = config.idle_timeout;
+    m_config.sndbuf = config.sndbuf;
+    m_config.rcvbuf = config.rcvbuf;
+    m_config.log_level = config.log_level;
+    m_config.drain_timeout = config.drain_timeout;
+    //过载保护的连接数上限不超过max_fd，max_fd只在启动时生效
+    int max_conns = config.max_conns > 0 && config.max_conns < m_config.max_fd ? config.max_conns : m_config.max_fd;
+    admission::get_instance()->init(max_conns, config.queue_target * 1000, config.queue_interval);
+    m_config.max_conns = config.max_conns;
+    m_config.accept_batch = config.accept_batch;
+    m_config.queue_target = config.queue_target;
+    m_config.queue_interval = config.queue_interval;
+    rate_limiter *limiter = rate_limiter::get_instance();
+    limiter->set_rate(RATE_CONN, config.conn_rate, config.conn_burst);
+    limiter->set_rate(RATE_REQUEST, config.req_rate, config.req_burst);
+    limiter->set_rate(RATE_LOGIN, config.login_rate, config.login_burst);
+    m_config.conn_rate = config.conn_rate;
+    m_config.conn_burst = config.conn_burst;
+    m_config.req_rate = config.req_rate;
+    m_config.req_burst = config.req_burst;
+    m_config.login_rate = config.login_rate;
+    m_config.login_burst = config.login_burst;
+    //请求体上限、目录列表、TLS会话缓存和代理的空闲连接数
+    http_conn::set_body_limit(config.max_body_size, NULL);
+    http_conn::set_autoindex(config.autoindex);
+    http_conn::set_deadlines(config.header_timeout, config.body_timeout, config.body_min_rate,
+                             config.keepalive_requests);
+    m_config.header_timeout = config.header_timeout;
+    m_config.body_timeout = config.body_timeout;
+    m_config.body_min_rate = config.body_min_rate;
+    m_config.keepalive_requests = config.keepalive_requests;
+    tls_context::get_instance()->set_cache_size(config.tls_session_cache);
+    upstream_group::set_max_idle(config.proxy_idle);
+    m_config.max_body_size = config.max_body_size;
+    m_config.autoindex = config.autoindex;
+    m_config.tls_session_cache = config.tls_session_cache;
+    m_config.proxy_idle = config.proxy_idle;
+    //线程池和redis连接池，启动时由thread_pool/redis_pool创建
+    if (m_pool && (config.thread_num != m_config.thread_num || config.max_requests != m_config.max_requests)) {
+        m_pool->resize(config.thread_num, config.max_requests);
+        spdlog::info("thread pool: {0} threads, queue {1}", config.thread_num, config.max_requests);
+    }
+    if (m_connPool && config.redis_num != m_config.redis_num) {
+        m_connPool->resize(config.redis_num);
+        spdlog::info("redis pool: {0} connections", config.redis_num);
+    }
+    m_config.thread_num = config.thread_num;
+    m_config.max_requests = config.max_requests;
+    m_config.redis_num = config.redis_num;
+}
+
+void WebServer::reload() {
+    Config next;
+    if (!m_config.reload(next)) {
+        spdlog::error("reload {0} failed, keep current config", m_config.config_file);
+        return;
+    }
+    //只在启动时生效的配置
+    const struct {
+        const char *name;
+        bool changed;
+    } fixed[] = {
+        {"port", next.PORT != m_config.PORT},
+        {"redis", next.redis_host != m_config.redis_host || next.redis_port != m_config.redis_port},
+        {"trace", next.trace_slow_us != m_config.trace_slow_us || next.trace_sample != m_config.trace_sample},
+        {"capture", next.capture_file != m_config.capture_file || next.capture_rate != m_config.capture_rate},
+        {"cache_control", next.cache_rules != m_config.cache_rules},
+        {"gzip_cache", next.gzip_cache != m_config.gzip_cache},
+        {"spool_dir", next.spool_dir != m_config.spool_dir},
+        {"tls", next.tls_port != m_config.tls_port || next.tls_cert != m_config.tls_cert ||
+                    next.tls_key != m_config.tls_key},
+        {"proxy", next.proxy_rules != m_config.proxy_rules},
+        {"max_fd", next.max_fd != m_config.max_fd},
+        {"max_events", next.max_events != m_config.max_events},
+        {"backlog", next.backlog != m_config.backlog},
+        {"defer_accept", next.defer_accept != m_config.defer_accept},
+        {"fastopen", next.fastopen != m_config.fastopen},
+    };
+    for (size_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); ++i) {
+        if (fixed[i].changed)
+            spdlog::warn("{0} changed, takes effect after restart", fixed[i].name);
+    }
+    apply_runtime(next);
+    spdlog::info("reloaded {0}", m_config.config_file.empty() ? "command line" : m_config.config_file);
 }
 
 void WebServer::redis_pool() {
     //初始化数据库连接池
     m_connPool = connection_pool::GetInstance();
-    m_connPool->init("127.0.0.1", 6379, m_redis_num);
+    m_connPool->init(m_config.redis_host, m_config.redis_port, m_config.redis_num);
 }
 
 void WebServer::thread_pool() {
     //线程池
-    m_pool = new threadpool<http_conn>(m_connPool, m_thread_num);
+    m_pool = new threadpool<http_conn>(m_connPool, m_config.thread_num, m_config.max_requests);
 }
 
-void WebServer::eventListen() {
+int WebServer::open_listenfd(int port) {
     //常规网络编程
-    m_listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    assert(m_listenfd >= 0);
+    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    assert(listenfd >= 0);
 
     //优雅关闭连接
     struct linger tmp = {1, 1};
     //level：选项定义的层次SOL_SOCKET 1 
-    setsockopt(m_listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+    setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
 
-    int ret = 0;
     struct sockaddr_in address;
     memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = htonl(INADDR_ANY);
-    address.sin_port = htons(m_port);
+    address.sin_port = htons(port);
 
     int flag = 1;
-    setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-    if(ret = bind(m_listenfd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    if (bind(listenfd, (struct sockaddr *)&address, sizeof(address)) == -1) {
         spdlog::error("bind() error");
+        close(listenfd);
+        return -1;
     }
-    if(ret = listen(m_listenfd, 5) == -1) {
+    if (listen(listenfd, m_config.backlog) == -1) {
         spdlog::error("listen() error");
+        close(listenfd);
+        return -1;
+    }
+    //backlog超过somaxconn时内核按somaxconn截断
+    FILE *fp = fopen("/proc/sys/net/core/somaxconn", "r");
+    int somaxconn = 0;
+    if (fp) {
+        if (fscanf(fp, "%d", &somaxconn) != 1)
+            somaxconn = 0;
+        fclose(fp);
+    }
+    if (somaxconn > 0 && somaxconn < m_config.backlog)
+        spdlog::warn("backlog {0} capped by net.core.somaxconn {1}", m_config.backlog, somaxconn);
+    return listenfd;
+}
+
+void WebServer::tune_listenfd(int fd) {
+    //连接上有数据到达后才出现在accept队列中，不为只握手不发请求的连接分配http_conn和定时器
+    int defer = m_config.defer_accept;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer)) < 0)
+        spdlog::warn("TCP_DEFER_ACCEPT: {0}", strerror(errno));
+    //允许客户端在SYN中携带请求，省去一个RTT
+    if (m_config.fastopen > 0) {
+        int qlen = m_config.fastopen;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) < 0)
+            spdlog::warn("TCP_FASTOPEN: {0}", strerror(errno));
+    }
+}
+
+int WebServer::inherit_listenfd(int port, const int *ports, int *fds, int n) {
+    for (int i = 0; i < n; ++i) {
+        if (ports[i] == port && fds[i] >= 0) {
+            int fd = fds[i];
+            fds[i] = -1;
+            //沿用旧进程的监听队列，backlog按本进程的配置重新设置
+            listen(fd, m_config.backlog);
+            tune_listenfd(fd);
+            return fd;
+        }
+    }
+    int fd = open_listenfd(port);
+    if (fd >= 0)
+        tune_listenfd(fd);
+    return fd;
+}
+
+void WebServer::eventListen() {
+    int ret = 0;
+    //由旧进程平滑升级启动时，沿用它的监听socket，不重新bind
+    int ports[handoff::MAX_FDS], fds[handoff::MAX_FDS];
+    int inherited = handoff::receive(ports, fds, handoff::MAX_FDS);
+    if (inherited < 0) {
+        spdlog::error("upgrade: no listen sockets from the old process");
+        inherited = 0;
+    }
+    m_listenfd = inherit_listenfd(m_port, ports, fds, inherited);
+    if (m_tls_port > 0) {
+        m_tls_listenfd = inherit_listenfd(m_tls_port, ports, fds, inherited);
+        if (m_tls_listenfd >= 0)
+            spdlog::info("https on port {0}", m_tls_port);
+    }
+    //配置中已去掉的端口
+    for (int i = 0; i < inherited; ++i) {
+        if (fds[i] >= 0)
+            close(fds[i]);
     }
-  
-    utils.init(TIMESLOT);
+
+    utils.init(m_config.timeslot);
 
     //epoll创建内核事件表
-    epoll_event events[MAX_EVENT_NUMBER];
     m_epollfd = epoll_create(5);
     assert(m_epollfd != -1);
 
     utils.addfd(m_epollfd, m_listenfd, false);
+    if (m_tls_listenfd >= 0)
+        utils.addfd(m_epollfd, m_tls_listenfd, false);
     http_conn::m_epollfd = m_epollfd;
 
     ret = socketpair(PF_UNIX, SOCK_STREAM, 0, m_pipefd);
@@ -87,12 +314,111 @@ void WebServer::eventListen() {
     utils.addsig(SIGPIPE, SIG_IGN);
     utils.addsig(SIGALRM, utils.sig_handler, false);
     utils.addsig(SIGTERM, utils.sig_handler, false);
+    utils.addsig(SIGUSR1, utils.sig_handler, false);
+    utils.addsig(SIGHUP, utils.sig_handler, false);
+    utils.addsig(SIGUSR2, utils.sig_handler, false);
 
-    alarm(TIMESLOT);
+    alarm(m_config.timeslot);
 
     //工具类,信号和描述符基础操作
     Utils::u_pipefd = m_pipefd;
     Utils::u_epollfd = m_epollfd;
+
+    //监听socket已在epoll中，旧进程可以停止accept
+    if (inherited > 0) {
+        handoff::ready();
+        spdlog::info("upgrade: took over {0} listen sockets", inherited);
+    }
+}
+
+void WebServer::upgrade() {
+    if (m_upgrade_fd >= 0 || m_drain_deadline) {
+        spdlog::warn("upgrade already in progress");
+        return;
+    }
+    int ports[handoff::MAX_FDS], fds[handoff::MAX_FDS];
+    int n = 0;
+    ports[n] = m_port;
+    fds[n++] = m_listenfd;
+    if (m_tls_listenfd >= 0) {
+        ports[n] = m_tls_port;
+        fds[n++] = m_tls_listenfd;
+    }
+    char **argv = m_config.argv();
+    m_upgrade_pid = handoff::spawn(argv, ports, fds, n, &m_upgrade_fd);
+    if (m_upgrade_pid < 0) {
+        spdlog::error("upgrade: cannot start {0}: {1}", argv[0], strerror(errno));
+        m_upgrade_fd = -1;
+        return;
+    }
+    //新进程就绪前本进程照常accept，两个进程共用同一个监听队列
+    utils.addfd(m_epollfd, m_upgrade_fd, false);
+    spdlog::info("upgrade: started {0} as pid {1}", argv[0], m_upgrade_pid);
+}
+
+void WebServer::dealwithupgrade() {
+    char c;
+    int ret = recv(m_upgrade_fd, &c, 1, 0);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_upgrade_fd, 0);
+    close(m_upgrade_fd);
+    m_upgrade_fd = -1;
+    if (ret <= 0) {
+        //新进程在接管之前退出，继续由本进程服务
+        int status = 0;
+        waitpid(m_upgrade_pid, &status, 0);
+        spdlog::error("upgrade: pid {0} exited before taking over, exit code {1}", m_upgrade_pid,
+                      WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+        m_upgrade_pid = -1;
+        return;
+    }
+
+    //新进程已在监听socket上accept，监听队列中的连接由新进程取走
+    start_drain();
+    spdlog::info("upgrade: pid {0} took over, draining {1} connections", m_upgrade_pid, http_conn::m_user_count);
+}
+
+void WebServer::start_drain() {
+    if (m_listenfd >= 0) {
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, 0);
+        close(m_listenfd);
+        m_listenfd = -1;
+    }
+    if (m_tls_listenfd >= 0) {
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_tls_listenfd, 0);
+        close(m_tls_listenfd);
+        m_tls_listenfd = -1;
+    }
+    http_conn::set_draining(true);
+    m_drain_deadline = time(NULL) + m_config.drain_timeout;
+}
+
+bool WebServer::drain() {
+    //每秒检查一次；工作线程正在处理的连接m_read_idx不为0，不会当作空闲
+    time_t now = time(NULL);
+    if (now != m_last_sweep) {
+        m_last_sweep = now;
+        util_timer *timer = utils.m_timer_lst.front();
+        while (timer) {
+            util_timer *next = timer->next;
+            int sockfd = timer->user_data->sockfd;
+            //刚发完响应的长连接，客户端的下一个请求可能正在路上，至少空闲1秒才关闭
+            if (timer->expire - m_config.idle_timeout + 1 < now && users[sockfd].idle())
+                deal_timer(timer, sockfd);
+            timer = next;
+        }
+    }
+    //工作线程中关闭的连接也要等它的定时器删除，定时器链表为空时才没有连接
+    if (!utils.m_timer_lst.front()) {
+        spdlog::info("drain: all connections closed");
+        return true;
+    }
+    if (now >= m_drain_deadline) {
+        spdlog::warn("drain: timeout, closing {0} connections", http_conn::m_user_count);
+        return true;
+    }
+    return false;
 }
 
 void WebServer::timer(int connfd, struct sockaddr_in client_address) {
@@ -102,20 +428,24 @@ void WebServer::timer(int connfd, struct sockaddr_in client_address) {
     //创建定时器，设置回调函数和超时时间，绑定用户数据，将定时器添加到链表中
     users_timer[connfd].address = client_address;
     users_timer[connfd].sockfd = connfd;
+    users_timer[connfd].conn = &users[connfd];
     util_timer *timer = new util_timer;
     timer->user_data = &users_timer[connfd];
     timer->cb_func = cb_func;
     time_t cur = time(NULL);
-    timer->expire = cur + 3 * TIMESLOT;
+    timer->expire = cur + m_config.idle_timeout;
     users_timer[connfd].timer = timer;
     utils.m_timer_lst.add_timer(timer);
 }
 
-//若有数据传输，则将定时器往后延迟3个单位
-//并对新的定时器在链表上的位置进行调整
+//若有数据传输，则将定时器往后延迟idle_timeout秒，但不超过请求头或消息体的截止时刻
+//截止时刻由工作线程在上一次处理后算出，并对新的定时器在链表上的位置进行调整
 void WebServer::adjust_timer(util_timer *timer) {
     time_t cur = time(NULL);
-    timer->expire = cur + 3 * TIMESLOT;
+    timer->expire = cur + m_config.idle_timeout;
+    time_t deadline = users[timer->user_data->sockfd].deadline();
+    if (deadline && deadline < timer->expire)
+        timer->expire = deadline;
     utils.m_timer_lst.adjust_timer(timer);
     spdlog::info("adjust timer once");
 }
@@ -128,26 +458,85 @@ void WebServer::deal_timer(util_timer *timer, int sockfd) {
     spdlog::info("close fd{0}", users_timer[sockfd].sockfd);
 }
 
-bool WebServer::dealclinetdata() {
+bool WebServer::dealclinetdata(int listenfd) {
     struct sockaddr_in client_address;
-    socklen_t client_addrlength = sizeof(client_address);
-    //ET listenfd
-    while (1) {
-        int connfd = accept(m_listenfd, (struct sockaddr *)&client_address, &client_addrlength);
+    socklen_t client_addrlength;
+    //ET listenfd，每次最多accept accept_batch个，连接风暴时已有连接上的事件不被饿死
+    for (int n = 0; m_config.accept_batch <= 0 || n < m_config.accept_batch; ++n) {
+        client_addrlength = sizeof(client_address);
+        //accept4直接得到非阻塞的socket，省去两次fcntl
+        int connfd = accept4(listenfd, (struct sockaddr *)&client_address, &client_addrlength,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (connfd < 0) {
-            spdlog::error("accept error:errno is {0}", errno);
+            //对方在accept之前已断开
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return false;
+            int err = errno;
+            log_accept_error(err);
+            //fd耗尽时连接留在监听队列中，ET模式不会再通知；用预留的fd接受后立即关闭，让队列继续前进
+            if ((err == EMFILE || err == ENFILE) && m_spare_fd >= 0) {
+                close(m_spare_fd);
+                connfd = accept(listenfd, NULL, NULL);
+                if (connfd >= 0) {
+                    close(connfd);
+                    admission::get_instance()->shed(SHED_CONN);
+                }
+                m_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (connfd >= 0 && m_spare_fd >= 0)
+                    continue;
+            }
+            //其他错误跳出循环，重新注册后下一轮再试
             break;
         }
-        if (http_conn::m_user_count >= MAX_FD) {
-            utils.show_error(connfd, "Internal server busy");
-            spdlog::error("Internal server busy");
-            break;
+        //超过连接数上限时回复503后关闭，继续accept，不让监听队列积压；users按fd下标，fd也不能超过max_fd
+        if (!admission::get_instance()->admit_conn(http_conn::m_user_count) || connfd >= m_config.max_fd) {
+            if (connfd >= m_config.max_fd)
+                admission::get_instance()->shed(SHED_CONN);
+            //HTTPS连接握手之前无法回复
+            if (listenfd == m_tls_listenfd)
+                close(connfd);
+            else
+                http_conn::reject_fd(connfd, false);
+            continue;
         }
+        //同一IP新建连接过快
+        if (!rate_limiter::get_instance()->allow(RATE_CONN, client_address.sin_addr.s_addr)) {
+            if (listenfd == m_tls_listenfd)
+                close(connfd);
+            else
+                http_conn::reject_fd(connfd, true);
+            continue;
+        }
+        if (m_config.sndbuf > 0)
+            setsockopt(connfd, SOL_SOCKET, SO_SNDBUF, &m_config.sndbuf, sizeof(m_config.sndbuf));
+        if (m_config.rcvbuf > 0)
+            setsockopt(connfd, SOL_SOCKET, SO_RCVBUF, &m_config.rcvbuf, sizeof(m_config.rcvbuf));
         timer(connfd, client_address);
+        //握手在工作线程中随读写事件非阻塞地进行
+        if (listenfd == m_tls_listenfd && !users[connfd].start_tls())
+            deal_timer(users_timer[connfd].timer, connfd);
     }
+    //监听队列中还有连接，ET模式下重新注册，处理完本轮其他事件后再次通知
+    epoll_event event;
+    event.data.fd = listenfd;
+    event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    epoll_ctl(m_epollfd, EPOLL_CTL_MOD, listenfd, &event);
     return false;
 }
 
+//accept出错时每秒最多记录一次，其间的次数合并输出
+void WebServer::log_accept_error(int err) {
+    ++m_accept_err_count;
+    time_t now = time(NULL);
+    if (now == m_accept_err_time)
+        return;
+    spdlog::error("accept error:errno is {0}, {1} times since last logged", err, m_accept_err_count);
+    m_accept_err_time = now;
+    m_accept_err_count = 0;
+}
+
 bool WebServer::dealwithsignal(bool &timeout, bool &stop_server) {
     int ret = 0;
     int sig;
@@ -167,9 +556,37 @@ bool WebServer::dealwithsignal(bool &timeout, bool &stop_server) {
                 timeout = true;
                 break;
             }
+            //第一次SIGTERM停止accept并排空连接，排空期间再次收到时立即退出
             case SIGTERM:
             {
-                stop_server = true;
+                if (m_drain_deadline) {
+                    stop_server = true;
+                    break;
+                }
+                start_drain();
+                spdlog::info("shutdown: draining {0} connections, at most {1}s", http_conn::m_user_count,
+                             m_config.drain_timeout);
+                break;
+            }
+            //输出各阶段耗时直方图，刷新抓包文件
+            case SIGUSR1:
+            {
+                req_trace::dump();
+                admission::get_instance()->dump();
+                rate_limiter::get_instance()->dump();
+                traffic_capture::get_instance()->flush();
+                break;
+            }
+            //重新读取配置文件
+            case SIGHUP:
+            {
+                reload();
+                break;
+            }
+            //平滑升级
+            case SIGUSR2:
+            {
+                upgrade();
                 break;
             }
             }
@@ -186,8 +603,31 @@ void WebServer::dealwithread(int sockfd) {
         adjust_timer(timer);
     }
 
-    //若监测到读事件，将该事件放入请求队列
-    m_pool->append(users + sockfd, 0);
+    users[sockfd].m_trace.stamp_once(TP_EVENT);
+    uint64_t spin_start = req_trace::now();
+
+    //过载时在主线程直接回复503，不进入请求队列，也不自旋等待工作线程
+    bool between = users[sockfd].between_requests();
+    if (between && !admission::get_instance()->admit_request(m_pool->has_idle())) {
+        users[sockfd].reject(false);
+        deal_timer(timer, sockfd);
+        return;
+    }
+    //同一IP请求过快，同样在主线程回复429后关闭
+    if (between && !rate_limiter::get_instance()->allow(RATE_REQUEST, users[sockfd].get_address()->sin_addr.s_addr)) {
+        users[sockfd].reject(true);
+        deal_timer(timer, sockfd);
+        return;
+    }
+
+    //若监测到读事件，将该事件放入请求队列；投递失败时拒绝，不能自旋等待
+    if (!m_pool->append(users + sockfd, 0, m_ready_us)) {
+        admission::get_instance()->shed(SHED_QUEUE);
+        if (between)
+            users[sockfd].reject(false);
+        deal_timer(timer, sockfd);
+        return;
+    }
 
     while (true) {
         if (users[sockfd].improv == 1) {
@@ -199,6 +639,7 @@ void WebServer::dealwithread(int sockfd) {
             break;
         }
     }
+    req_trace::record(ST_REACTOR, req_trace::now() - spin_start);
 }
 
 void WebServer::dealwithwrite(int sockfd) {
@@ -208,7 +649,14 @@ void WebServer::dealwithwrite(int sockfd) {
         adjust_timer(timer);
     }
 
-    m_pool->append(users + sockfd, 1);
+    uint64_t spin_start = req_trace::now();
+
+    //投递失败，响应已无法继续发送
+    if (!m_pool->append(users + sockfd, 1, m_ready_us)) {
+        admission::get_instance()->shed(SHED_QUEUE);
+        deal_timer(timer, sockfd);
+        return;
+    }
 
     while (true) {
         if (users[sockfd].improv == 1) {
@@ -220,6 +668,7 @@ void WebServer::dealwithwrite(int sockfd) {
             break;
         }
     }
+    req_trace::record(ST_REACTOR, req_trace::now() - spin_start);
 }
 
 void WebServer::eventLoop() {
@@ -228,7 +677,11 @@ void WebServer::eventLoop() {
 
     while (!stop_server)
     {
-        int number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, -1);
+        //最多等待1秒，保证Date头部每秒刷新
+        int number = epoll_wait(m_epollfd, events, m_config.max_events, 1000);
+        date_cache::refresh();
+        //主线程逐个派发事件，排在后面的事件也在等待，排队时延从epoll_wait返回时算起
+        m_ready_us = admission::now_us();
         if (number < 0 && errno != EINTR) {
             spdlog::error("epoll failure");
             break;
@@ -238,11 +691,19 @@ void WebServer::eventLoop() {
             int sockfd = events[i].data.fd;
 
             //处理新到的客户连接
-            if (sockfd == m_listenfd) {
-                bool flag = dealclinetdata();
+            if (sockfd == m_listenfd || sockfd == m_tls_listenfd) {
+                bool flag = dealclinetdata(sockfd);
                 if (flag == false)
                     continue;
             }
+            //升级时启动的新进程就绪或退出
+            else if (sockfd == m_upgrade_fd) {
+                dealwithupgrade();
+            }
+            //后端连接上的事件交给所属的客户连接，由写事件的路径推进代理
+            else if (proxy_table::get_instance()->owner(sockfd) >= 0) {
+                dealwithwrite(proxy_table::get_instance()->owner(sockfd));
+            }
             else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
                 //服务器端关闭连接，移除对应的定时器
                 util_timer *timer = users_timer[sockfd].timer;
@@ -268,5 +729,14 @@ void WebServer::eventLoop() {
 
             timeout = false;
         }
+        //平滑升级或SIGTERM后排空已有连接
+        if (m_drain_deadline && drain())
+            stop_server = true;
     }
+
+    //工作线程处理完手上和队列中的任务后退出，之后才能释放连接
+    m_pool->shutdown();
+    traffic_capture::get_instance()->flush();
+    spdlog::info("server stopped");
+    spdlog::default_logger()->flush();
 }
\ No newline at end of file
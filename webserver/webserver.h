@@ -13,17 +13,16 @@
 #include <sys/epoll.h>
 #include "../threadpool.h"
 #include "../http/http_conn.h"
-
-const int MAX_FD = 65536;           //最大文件描述符
-const int MAX_EVENT_NUMBER = 10000; //最大事件数
-const int TIMESLOT = 5;             //最小超时单位
+#include "../configure/configure.h"
+#include "../upgrade/handoff.h"
+#include "../admission/admission.h"
 
 class WebServer {
 public:
     WebServer();
     ~WebServer();
 
-    void init(int port , int redis_num, int thread_num);
+    void init(const Config &config);
 
     void thread_pool();
     void redis_pool();
@@ -32,8 +31,27 @@ public:
     void timer(int connfd, struct sockaddr_in client_address);
     void adjust_timer(util_timer *timer);
     void deal_timer(util_timer *timer, int sockfd);
-    bool dealclinetdata();
+    bool dealclinetdata(int listenfd);
+    void log_accept_error(int err);
+    //创建监听socket，失败时返回-1
+    int open_listenfd(int port);
+    //设置TCP_DEFER_ACCEPT和TCP_FASTOPEN，新建和继承的监听socket都调用
+    void tune_listenfd(int fd);
+    //优先使用旧进程交来的同一端口的监听socket，用过的从fds中去掉
+    int inherit_listenfd(int port, const int *ports, int *fds, int n);
     bool dealwithsignal(bool& timeout, bool& stop_server);
+    //SIGHUP：重新读取配置，只应用运行中可以安全修改的项，已有连接不受影响
+    void reload();
+    //超时、日志级别、缓存上限等运行时可调的配置
+    void apply_runtime(const Config &config);
+    //SIGUSR2：启动新的可执行文件并交出监听socket
+    void upgrade();
+    //新进程就绪或退出
+    void dealwithupgrade();
+    //停止accept，之后的HTTP/1.1响应都带Connection: close，drain_timeout秒后不再等待
+    void start_drain();
+    //排空期间关闭空闲连接，全部关闭或超时后返回true
+    bool drain();
     void dealwithread(int sockfd);
     void dealwithwrite(int sockfd);
 
@@ -41,6 +59,8 @@ public:
     //基础
     int m_port;
     char *m_root;
+    //当前生效的配置
+    Config m_config;
 
     int m_pipefd[2];
     int m_epollfd;
@@ -48,16 +68,31 @@ public:
 
     //数据库相关
     connection_pool *m_connPool;
-    int m_redis_num;
 
     //线程池相关
     threadpool<http_conn> *m_pool;
-    int m_thread_num;
 
-    //epoll_event相关
-    epoll_event events[MAX_EVENT_NUMBER];
+    //epoll_event相关，大小为m_config.max_events
+    epoll_event *events;
 
     int m_listenfd;
+    //HTTPS监听，未开启时为-1
+    int m_tls_port;
+    int m_tls_listenfd;
+
+    //平滑升级：新进程的pid和与它相连的socket；SIGTERM或升级后排空的截止时间，未排空时为0
+    pid_t m_upgrade_pid;
+    int m_upgrade_fd;
+    time_t m_drain_deadline;
+    time_t m_last_sweep;
+
+    //fd耗尽时腾出位置用的预留fd；accept出错日志上次输出的时刻和之后累计的次数
+    int m_spare_fd;
+    time_t m_accept_err_time;
+    int m_accept_err_count;
+
+    //本轮epoll_wait返回的时刻(us)，用于计算请求的排队时延
+    uint64_t m_ready_us;
 
     //定时器相关
     client_data *users_timer;